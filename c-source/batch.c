@@ -0,0 +1,182 @@
+// Batch processing of bitmap files with libwinbmp.
+//
+// Usage: bmpbatch -o output dir [-f ops] [-j workers] [-q images in flight] [-t threads per image] [-m metrics] file...
+//
+// ops is a comma separated chain applied to every file in order, e.g. -f brightness=20,grayscale,sharpen.
+// Point operations: brightness=N, invert, grayscale, remove=C, swap=CC (channels b, g, r).
+// Filters: blur, edges, sharpen, emboss, mean.
+// Results keep the file name of their input. Throughput is printed when the batch is done.
+// With -m, per-function metrics go to the given file as JSON lines; they are only kept when built with BMP_METRICS.
+
+#include "libwinbmp.c"
+#include <libgen.h>
+
+typedef struct {
+    const char *name;
+    bmp_t *(*filter)(bmp_t *);
+} batch_filter_t;
+
+static const batch_filter_t batch_filters[] = {
+    {"blur", bmp_blur},
+    {"edges", bmp_edges},
+    {"sharpen", bmp_sharpen},
+    {"emboss", bmp_emboss},
+    {"mean", bmp_mean},
+};
+
+// parses one element of the op chain; returns 1 if it is not recognised
+static int batch_parse_op(const char *s, bmp_batch_op_t *op)
+{
+    unsigned int i;
+
+    op->filter = NULL;
+    op->op.arg = 0;
+    op->op.arg2 = 0;
+    for (i = 0; i < sizeof(batch_filters) / sizeof(batch_filters[0]); i++) {
+        if (strcmp(s, batch_filters[i].name) == 0) {
+            op->filter = batch_filters[i].filter;
+            return 0;
+        }
+    }
+    if (strncmp(s, "brightness=", 11) == 0) {
+        op->op.type = BMP_OP_BRIGHTNESS;
+        op->op.arg = atoi(s + 11);
+    } else if (strcmp(s, "invert") == 0) {
+        op->op.type = BMP_OP_INVERT;
+    } else if (strcmp(s, "grayscale") == 0) {
+        op->op.type = BMP_OP_GRAYSCALE;
+    } else if (strncmp(s, "remove=", 7) == 0 && strlen(s) == 8) {
+        op->op.type = BMP_OP_REMOVE_CHANNEL;
+        op->op.arg = s[7];
+    } else if (strncmp(s, "swap=", 5) == 0 && strlen(s) == 7) {
+        op->op.type = BMP_OP_SWAP_CHANNEL;
+        op->op.arg = s[5];
+        op->op.arg2 = s[6];
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *chain = "";
+    const char *dir = NULL;
+    const char *metrics = NULL;
+    unsigned int workers = 0;
+    unsigned int in_flight = 0;
+    unsigned int threads = 1;
+    bmp_batch_op_t ops[64];
+    unsigned int op_count = 0;
+    bmp_batch_stats_t stats;
+    const char **inputs;
+    char **outputs;
+    char *list;
+    char *name;
+    char *copy;
+    FILE *f;
+    unsigned int count;
+    unsigned int i;
+    int err;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:f:j:q:t:m:")) != -1) {
+        switch (opt) {
+            case 'o':
+                dir = optarg;
+                break;
+            case 'f':
+                chain = optarg;
+                break;
+            case 'j':
+                workers = (unsigned int)atoi(optarg);
+                break;
+            case 'q':
+                in_flight = (unsigned int)atoi(optarg);
+                break;
+            case 't':
+                threads = (unsigned int)atoi(optarg);
+                break;
+            case 'm':
+                metrics = optarg;
+                break;
+            default:
+                dir = NULL;
+                optind = argc;
+                break;
+        }
+    }
+    if (dir == NULL || optind >= argc) {
+        fprintf(stderr, "usage: %s -o output dir [-f ops] [-j workers] [-q images in flight] [-t threads per image] "
+                "[-m metrics] file...\n", argv[0]);
+        return 1;
+    }
+
+    list = strdup(chain);
+    if (list == NULL) {
+        perror("strdup");
+        return 1;
+    }
+    for (name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        if (op_count == sizeof(ops) / sizeof(ops[0]) || batch_parse_op(name, &ops[op_count])) {
+            fprintf(stderr, "unknown or too many operations: %s\n", name);
+            free(list);
+            return 1;
+        }
+        op_count++;
+    }
+    free(list);
+
+    if (bmp_set_threads(threads)) {
+        fprintf(stderr, "could only start %u threads\n", bmp_get_threads());
+    }
+
+    count = (unsigned int)(argc - optind);
+    inputs = (const char **)(argv + optind);
+    outputs = malloc(count * sizeof(char *));
+    if (outputs == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (i = 0; i < count; i++) {
+        copy = strdup(inputs[i]);
+        outputs[i] = malloc(strlen(dir) + strlen(inputs[i]) + 2);
+        if (copy == NULL || outputs[i] == NULL) {
+            perror("malloc");
+            free(copy);
+            do {
+                free(outputs[i]);
+            } while (i-- > 0);
+            free(outputs);
+            return 1;
+        }
+        sprintf(outputs[i], "%s/%s", dir, basename(copy));
+        free(copy);
+    }
+
+    err = bmp_batch(inputs, (const char **)outputs, count, ops, op_count, workers, in_flight, &stats);
+
+    printf("%u files, %u failed, %.3f s, %.1f files/s, %.1f MB/s read, %.1f MB/s written\n",
+            stats.files, stats.failed, stats.seconds,
+            stats.seconds > 0 ? stats.files / stats.seconds : 0.0,
+            stats.seconds > 0 ? stats.bytes_read / stats.seconds / 1e6 : 0.0,
+            stats.seconds > 0 ? stats.bytes_written / stats.seconds / 1e6 : 0.0);
+
+    if (metrics != NULL) {
+        f = fopen(metrics, "w");
+        if (f == NULL || bmp_metrics_dump(f)) {
+            fprintf(stderr, "could not write metrics to %s\n", metrics);
+            err = 1;
+        }
+        if (f != NULL) {
+            fclose(f);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        free(outputs[i]);
+    }
+    free(outputs);
+    bmp_set_threads(1);
+    return err;
+}
@@ -0,0 +1,588 @@
+// Throughput benchmark of every libwinbmp operation.
+//
+// Usage: bmpbench [-s vga,hd,24mp,100mp,lena,beach] [-n iterations] [-t threads] [-d image dir] [-o results]
+//
+// Every operation is timed `iterations` times on each image. A summary table goes to stdout and
+// one JSON object per image and operation goes to the results file, for diffing between builds.
+
+#include "libwinbmp.c"
+#include <time.h>
+
+typedef struct {
+    bmp_t *bmp;
+    bmp_t *other;
+    const char *file;                      // the image saved to disk, for the i/o benchmarks
+    const char *out;                       // scratch output file
+    bmp_t *mask;                           // 8 bit, 4 level quantisation of bmp, for the run-length cases
+    unsigned char *planes[3];              // width x height channels for the colour conversion cases
+} bench_t;
+
+typedef struct {
+    const char *name;
+    void (*run)(bench_t *b);
+} bench_case_t;
+
+typedef struct {
+    const char *name;
+    unsigned int width;
+    unsigned int height;
+} bench_size_t;
+
+static const bench_size_t bench_sizes[] = {
+    {"vga", 640, 480},
+    {"hd", 1920, 1080},
+    {"24mp", 6000, 4000},
+    {"100mp", 10000, 10000},
+};
+
+static double bench_now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void bench_brightness(bench_t *b) { bmp_brightness(b->bmp, 3); }
+static void bench_invert(bench_t *b) { bmp_invert(b->bmp); }
+static void bench_grayscale(bench_t *b) { bmp_grayscale(b->bmp); }
+static void bench_color_luma(bench_t *b) { bmp_color_from(b->bmp, BMP_COLOR_LUMA, b->planes, b->bmp->info.width); }
+
+static void bench_color(bench_t *b, const int space)
+{
+    bmp_color_from(b->bmp, space, b->planes, b->bmp->info.width);
+    bmp_color_to(b->bmp, space, (const unsigned char *const *)b->planes, b->bmp->info.width);
+}
+
+static void bench_color_ycbcr(bench_t *b) { bench_color(b, BMP_COLOR_YCBCR); }
+static void bench_color_hsv(bench_t *b) { bench_color(b, BMP_COLOR_HSV); }
+static void bench_remove_channel(bench_t *b) { bmp_remove_channel(b->bmp, 'g'); }
+static void bench_swap_channel(bench_t *b) { bmp_swap_channel(b->bmp, 'r', 'b'); }
+static void bench_add(bench_t *b) { bmp_add(b->bmp, b->other); }
+static void bench_subtract(bench_t *b) { bmp_subtract(b->bmp, b->other); }
+static void bench_difference(bench_t *b) { bmp_difference(b->bmp, b->other); }
+static void bench_multiply(bench_t *b) { bmp_multiply(b->bmp, b->other); }
+static void bench_average(bench_t *b) { bmp_average(b->bmp, b->other); }
+static void bench_min(bench_t *b) { bmp_min(b->bmp, b->other); }
+static void bench_max(bench_t *b) { bmp_max(b->bmp, b->other); }
+static void bench_blur(bench_t *b) { bmp_blur(b->bmp); }
+static void bench_edges(bench_t *b) { bmp_edges(b->bmp); }
+static void bench_sharpen(bench_t *b) { bmp_sharpen(b->bmp); }
+static void bench_emboss(bench_t *b) { bmp_emboss(b->bmp); }
+static void bench_mean(bench_t *b) { bmp_mean(b->bmp); }
+static void bench_box_blur(bench_t *b) { bmp_box_blur(b->bmp, 25, BMP_BORDER_CLAMP); }
+static void bench_gaussian_blur(bench_t *b) { bmp_gaussian_blur(b->bmp, 10.0, BMP_BORDER_MIRROR); }
+static void bench_integral(bench_t *b) { bmp_integral_destroy(bmp_integral(b->bmp, 1)); }
+
+static void bench_stats(bench_t *b)
+{
+    bmp_stats_t stats;
+
+    bmp_stats(b->bmp, &stats);
+}
+
+static void bench_lut(bench_t *b)
+{
+    bmp_lut_t lut;
+
+    bmp_apply_lut(b->bmp, bmp_lut_contrast(bmp_lut_gamma(bmp_lut_identity(&lut), 1.2), 1.1));
+}
+
+static void bench_convolve_mirror(bench_t *b)
+{
+    bmp_kernel_t kernel = {{{1, 2, 1}, {2, 4, 2}, {1, 2, 1}}, 16, 0};
+
+    bmp_convolve(b->bmp, &kernel, BMP_BORDER_MIRROR);
+}
+
+// a chain of four filters, interleaved and planar with both conversions included, to compare like for like
+static void bench_convolve_chain(bench_t *b)
+{
+    bmp_kernel_t kernel = {{{1, 2, 1}, {2, 4, 2}, {1, 2, 1}}, 16, 0};
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        bmp_convolve(b->bmp, &kernel, BMP_BORDER_MIRROR);
+    }
+}
+
+static void bench_planar_chain(bench_t *b)
+{
+    bmp_kernel_t kernel = {{{1, 2, 1}, {2, 4, 2}, {1, 2, 1}}, 16, 0};
+    bmp_planar_t *planar = bmp_planar_from(b->bmp);
+    int i;
+
+    if (planar == NULL) {
+        return;
+    }
+    for (i = 0; i < 4; i++) {
+        bmp_planar_convolve(planar, &kernel, BMP_BORDER_MIRROR);
+    }
+    bmp_destroy(bmp_planar_to(planar));
+    bmp_planar_destroy(planar);
+}
+
+static void bench_pipeline(bench_t *b)
+{
+    bmp_pipeline_t *pipeline = bmp_defer(b->bmp);
+
+    bmp_pipeline_brightness(pipeline, 3);
+    bmp_pipeline_grayscale(pipeline);
+    bmp_pipeline_invert(pipeline);
+    bmp_pipeline_remove_channel(pipeline, 'g');
+    bmp_flush(b->bmp);
+}
+
+static void bench_set_pixel(bench_t *b)
+{
+    unsigned int x;
+    unsigned int y;
+
+    for (y = 0; y < b->bmp->info.height; y++) {
+        for (x = 0; x < b->bmp->info.width; x++) {
+            bmp_set_pixel(b->bmp, x, y, x ^ y);
+        }
+    }
+}
+
+static void bench_get_pixel(bench_t *b)
+{
+    volatile unsigned char sink = 0;
+    unsigned int x;
+    unsigned int y;
+
+    for (y = 0; y < b->bmp->info.height; y++) {
+        for (x = 0; x < b->bmp->info.width; x++) {
+            sink ^= bmp_get_pixel(b->bmp, x, y)[1];
+        }
+    }
+    (void)sink;
+}
+
+static void bench_line(bench_t *b)
+{
+    unsigned int y;
+
+    // shallow lines across the whole image, one per 8 rows
+    for (y = 0; y + 8 < b->bmp->info.height; y += 8) {
+        bmp_line(b->bmp, 0, y, b->bmp->info.width, y + 8, 0xff8800);
+    }
+}
+
+// an overlay of 20000 annotations: box outlines, filled labels, lines and triangles
+static void bench_draw(bench_t *b)
+{
+    static bmp_shape_t shapes[20000];
+    static int points[20000][6];
+    unsigned int w = b->bmp->info.width;
+    unsigned int h = b->bmp->info.height;
+    unsigned int x;
+    unsigned int y;
+    unsigned int i;
+
+    for (i = 0; i < 20000; i++) {
+        x = (i * 2654435761u) % w;
+        y = (i * 40503u) % h;
+        shapes[i].type = i % 4;
+        shapes[i].rgb = i * 0x10101;
+        shapes[i].x0 = (int)x;
+        shapes[i].y0 = (int)y;
+        shapes[i].x1 = (int)x + ((i % 4 == BMP_SHAPE_FILL) ? 40 : 64);
+        shapes[i].y1 = (int)y + ((i % 4 == BMP_SHAPE_FILL) ? 12 : 48);
+        points[i][0] = (int)x;
+        points[i][1] = (int)y;
+        points[i][2] = (int)x + 30;
+        points[i][3] = (int)y + 50;
+        points[i][4] = (int)x - 25;
+        points[i][5] = (int)y + 40;
+        shapes[i].points = points[i];
+        shapes[i].count = 3;
+    }
+    bmp_draw(b->bmp, shapes, 20000);
+}
+
+// thumbnails an eighth of the size, and the exact 2:1 reduction
+static void bench_resize(bench_t *b, const unsigned int div, const int filter)
+{
+    bmp_destroy(bmp_resize(b->bmp, b->bmp->info.width / div, b->bmp->info.height / div, filter));
+}
+
+static void bench_resize_nearest(bench_t *b) { bench_resize(b, 8, BMP_RESIZE_NEAREST); }
+static void bench_resize_bilinear(bench_t *b) { bench_resize(b, 8, BMP_RESIZE_BILINEAR); }
+static void bench_resize_area(bench_t *b) { bench_resize(b, 8, BMP_RESIZE_AREA); }
+static void bench_resize_half(bench_t *b) { bench_resize(b, 2, BMP_RESIZE_AREA); }
+
+static void bench_pyramid(bench_t *b)
+{
+    bmp_pyramid_t *pyramid = bmp_pyramid(b->bmp);
+
+    bmp_pyramid_invalidate(b->bmp, 0, 0, b->bmp->info.width, b->bmp->info.height);
+    bmp_pyramid_level(pyramid, bmp_pyramid_levels(pyramid) - 1);
+}
+
+// a few scattered strokes, as an editor would make between two redraws of the thumbnails
+static void bench_pyramid_update(bench_t *b)
+{
+    bmp_pyramid_t *pyramid = bmp_pyramid(b->bmp);
+    unsigned int i;
+
+    for (i = 0; i < 16; i++) {
+        bmp_set_pixel(b->bmp, (i * 2654435761u) % b->bmp->info.width, (i * 40503u) % b->bmp->info.height, 0xffffff);
+    }
+    bmp_pyramid_level(pyramid, bmp_pyramid_levels(pyramid) - 1);
+}
+
+// widens to 32 bit and back, so the image stays 24 bit between iterations
+static void bench_convert(bench_t *b)
+{
+    bmp_convert(b->bmp, 32);
+    bmp_convert(b->bmp, 24);
+}
+
+static void bench_rotate(bench_t *b)
+{
+    bmp_rotate(b->bmp, 90);
+    bmp_rotate(b->bmp, 270);
+}
+
+static void bench_rotate_180(bench_t *b) { bmp_rotate(b->bmp, 180); }
+static void bench_flip_horizontal(bench_t *b) { bmp_flip_horizontal(b->bmp); }
+static void bench_flip_vertical(bench_t *b) { bmp_flip_vertical(b->bmp); }
+
+static void bench_load(bench_t *b) { bmp_destroy(bmp_load(b->file)); }
+static void bench_write_rle(bench_t *b) { bmp_write(b->mask, b->out); }
+// reads the file written by the case before it
+static void bench_load_rle(bench_t *b) { bmp_destroy(bmp_load(b->out)); }
+static void bench_write(bench_t *b) { bmp_write(b->bmp, b->out); }
+static void bench_load_parallel(bench_t *b) { bmp_destroy(bmp_load_parallel(b->file, 0)); }
+static void bench_load_direct(bench_t *b) { bmp_destroy(bmp_load_parallel(b->file, BMP_IO_DIRECT)); }
+
+// a 256x256 crop from the middle, as a tile server would fetch it
+static void bench_load_region(bench_t *b)
+{
+    unsigned int w = (b->bmp->info.width < 256) ? b->bmp->info.width : 256;
+    unsigned int h = (b->bmp->info.height < 256) ? b->bmp->info.height : 256;
+
+    bmp_destroy(bmp_load_region(b->file, (b->bmp->info.width - w) / 2, (b->bmp->info.height - h) / 2, w, h));
+}
+static void bench_write_parallel(bench_t *b) { bmp_write_parallel(b->bmp, b->out, 0); }
+
+static void bench_write_buffer(bench_t *b)
+{
+    size_t size;
+
+    free(bmp_write_buffer(b->bmp, &size));
+}
+
+// encodes to memory and decodes a private copy back, as a service answering over a socket would
+static void bench_buffer_roundtrip(bench_t *b)
+{
+    size_t size;
+    unsigned char *buffer = bmp_write_buffer(b->bmp, &size);
+
+    bmp_destroy(bmp_load_buffer(buffer, size, BMP_BUFFER_COPY));
+    free(buffer);
+}
+static void bench_write_direct(bench_t *b) { bmp_write_parallel(b->bmp, b->out, BMP_IO_DIRECT); }
+static void bench_stream_filter(bench_t *b) { bmp_stream_filter(b->file, b->out, bmp_sharpen, 256); }
+
+static void bench_map(bench_t *b)
+{
+    bmp_t *bmp = bmp_map(b->file, BMP_MAP_READONLY);
+    volatile unsigned char sink = 0;
+    unsigned int y;
+
+    if (bmp == NULL) {
+        return;
+    }
+    // touch every row so the page faults are part of the measurement
+    for (y = 0; y < bmp->info.height; y++) {
+        sink ^= bmp->data[y][0];
+    }
+    (void)sink;
+    bmp_destroy(bmp);
+}
+
+static const bench_case_t bench_cases[] = {
+    {"bmp_load", bench_load},
+    {"bmp_map", bench_map},
+    {"bmp_write", bench_write},
+    {"bmp_load_parallel", bench_load_parallel},
+    {"bmp_load_parallel_direct", bench_load_direct},
+    {"bmp_load_region", bench_load_region},
+    {"bmp_write_parallel", bench_write_parallel},
+    {"bmp_write_buffer", bench_write_buffer},
+    {"bmp_buffer_roundtrip", bench_buffer_roundtrip},
+    {"bmp_write_parallel_direct", bench_write_direct},
+    {"bmp_write_rle8", bench_write_rle},
+    {"bmp_load_rle8", bench_load_rle},
+    {"bmp_stream_filter", bench_stream_filter},
+    {"bmp_brightness", bench_brightness},
+    {"bmp_invert", bench_invert},
+    {"bmp_grayscale", bench_grayscale},
+    {"bmp_color_luma", bench_color_luma},
+    {"bmp_color_ycbcr_roundtrip", bench_color_ycbcr},
+    {"bmp_color_hsv_roundtrip", bench_color_hsv},
+    {"bmp_remove_channel", bench_remove_channel},
+    {"bmp_swap_channel", bench_swap_channel},
+    {"bmp_apply_lut", bench_lut},
+    {"bmp_flush", bench_pipeline},
+    {"bmp_add", bench_add},
+    {"bmp_subtract", bench_subtract},
+    {"bmp_difference", bench_difference},
+    {"bmp_multiply", bench_multiply},
+    {"bmp_average", bench_average},
+    {"bmp_min", bench_min},
+    {"bmp_max", bench_max},
+    {"bmp_blur", bench_blur},
+    {"bmp_edges", bench_edges},
+    {"bmp_sharpen", bench_sharpen},
+    {"bmp_emboss", bench_emboss},
+    {"bmp_mean", bench_mean},
+    {"bmp_convolve", bench_convolve_mirror},
+    {"bmp_convolve_x4", bench_convolve_chain},
+    {"bmp_planar_convolve_x4", bench_planar_chain},
+    {"bmp_box_blur", bench_box_blur},
+    {"bmp_gaussian_blur", bench_gaussian_blur},
+    {"bmp_integral", bench_integral},
+    {"bmp_stats", bench_stats},
+    {"bmp_convert_32_24", bench_convert},
+    {"bmp_rotate_90_270", bench_rotate},
+    {"bmp_rotate_180", bench_rotate_180},
+    {"bmp_flip_horizontal", bench_flip_horizontal},
+    {"bmp_flip_vertical", bench_flip_vertical},
+    {"bmp_resize_nearest", bench_resize_nearest},
+    {"bmp_resize_bilinear", bench_resize_bilinear},
+    {"bmp_resize_area", bench_resize_area},
+    {"bmp_resize_half", bench_resize_half},
+    {"bmp_pyramid", bench_pyramid},
+    {"bmp_pyramid_update", bench_pyramid_update},
+    {"bmp_set_pixel", bench_set_pixel},
+    {"bmp_get_pixel", bench_get_pixel},
+    {"bmp_line", bench_line},
+    {"bmp_draw", bench_draw},
+};
+
+// a smooth gradient with some noise, so nothing saturates or compresses trivially
+static bmp_t *bench_synthetic(const unsigned int width, const unsigned int height, unsigned int seed)
+{
+    bmp_t *bmp = bmp_create(width, height);
+    unsigned int x;
+    unsigned int y;
+
+    if (bmp == NULL) {
+        return NULL;
+    }
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            seed = seed * 1103515245 + 12345;
+            bmp->data[y][3 * x] = (unsigned char)(x * 255 / width + (seed >> 28));
+            bmp->data[y][3 * x + 1] = (unsigned char)(y * 255 / height + (seed >> 24 & 15));
+            bmp->data[y][3 * x + 2] = (unsigned char)((x + y) + (seed >> 20 & 15));
+        }
+    }
+    return bmp;
+}
+
+// the green channel quantised to 4 levels: long runs, like the masks kept next to real images
+static bmp_t *bench_mask(const bmp_t *bmp)
+{
+    bmp_t *mask = bmp_create(bmp->info.width, bmp->info.height);
+    unsigned int x;
+    unsigned int y;
+
+    if (mask == NULL) {
+        return NULL;
+    }
+    free(mask->data[0]);
+    free(mask->data);
+    mask->info.bits_per_pixel = 8;
+    mask->info.compression = BMP_BI_RLE8;
+    mask->info.colors = 4;
+    mask->data = bmp_alloc_rows(mask, mask->info.height);
+    mask->palette = calloc(256, 4);
+    if (mask->data == NULL || mask->palette == NULL) {
+        if (mask->data != NULL) {
+            free(mask->data[0]);
+            free(mask->data);
+        }
+        free(mask->palette);
+        free(mask);
+        return NULL;
+    }
+    for (x = 0; x < 4; x++) {
+        memset(mask->palette + 4 * x, x * 85, 3);
+    }
+    for (y = 0; y < bmp->info.height; y++) {
+        for (x = 0; x < bmp->info.width; x++) {
+            mask->data[y][x] = bmp->data[y][3 * x + 1] >> 6;
+        }
+    }
+    return mask;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    double d = *(const double *)a - *(const double *)b;
+
+    return (d > 0) - (d < 0);
+}
+
+// nearest-rank percentile of sorted samples
+static double bench_percentile(const double *t, const unsigned int n, const double p)
+{
+    unsigned int i = (unsigned int)ceil(p / 100.0 * n);
+
+    return t[i > 0 ? i - 1 : 0];
+}
+
+static void bench_image(const char *label, bench_t *b, const unsigned int iterations, FILE *json)
+{
+    double *t = malloc(iterations * sizeof(double));
+    double start;
+    double mpix = b->bmp->info.width * (double)b->bmp->info.height / 1e6;
+    double bytes = (double)get_pixel_array_size(b->bmp);
+    double p50;
+    unsigned int c;
+    unsigned int i;
+
+    if (t == NULL) {
+        perror("malloc");
+        return;
+    }
+    // the i/o cases read the image from this file
+    if (bmp_write(b->bmp, b->file)) {
+        free(t);
+        return;
+    }
+    printf("%-8s %5ux%-5u %-20s %10s %10s %10s %10s %10s\n", label, b->bmp->info.width, b->bmp->info.height,
+           "operation", "p50 ms", "p90 ms", "p99 ms", "MP/s", "MB/s");
+    for (c = 0; c < sizeof(bench_cases) / sizeof(bench_cases[0]); c++) {
+        for (i = 0; i < iterations; i++) {
+            start = bench_now();
+            bench_cases[c].run(b);
+            t[i] = bench_now() - start;
+        }
+        qsort(t, iterations, sizeof(double), bench_compare);
+        p50 = bench_percentile(t, iterations, 50);
+        printf("%-20s %-20s %10.3f %10.3f %10.3f %10.1f %10.1f\n", "", bench_cases[c].name,
+               p50 * 1e3, bench_percentile(t, iterations, 90) * 1e3, bench_percentile(t, iterations, 99) * 1e3,
+               mpix / p50, bytes / p50 / 1e6);
+        if (json != NULL) {
+            fprintf(json, "{\"image\": \"%s\", \"width\": %u, \"height\": %u, \"operation\": \"%s\", "
+                    "\"threads\": %u, \"iterations\": %u, \"min_s\": %.9f, \"p50_s\": %.9f, \"p90_s\": %.9f, "
+                    "\"p99_s\": %.9f, \"max_s\": %.9f, \"mpix_per_s\": %.3f, \"bytes_per_s\": %.0f}\n",
+                    label, b->bmp->info.width, b->bmp->info.height, bench_cases[c].name,
+                    bmp_get_threads(), iterations, t[0], p50, bench_percentile(t, iterations, 90),
+                    bench_percentile(t, iterations, 99), t[iterations - 1], mpix / p50, bytes / p50);
+            fflush(json);
+        }
+    }
+    remove(b->file);
+    remove(b->out);
+    free(t);
+}
+
+int main(int argc, char **argv)
+{
+    const char *sizes = "vga,hd,24mp,100mp,lena,beach";
+    const char *dir = ".";
+    const char *output = NULL;
+    unsigned int iterations = 5;
+    unsigned int threads = 1;
+    char path[4096];
+    char *list;
+    char *name;
+    FILE *json = NULL;
+    bench_t b;
+    unsigned int i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:t:d:o:")) != -1) {
+        switch (opt) {
+            case 's':
+                sizes = optarg;
+                break;
+            case 'n':
+                iterations = (unsigned int)atoi(optarg);
+                break;
+            case 't':
+                threads = (unsigned int)atoi(optarg);
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-s vga,hd,24mp,100mp,lena,beach] [-n iterations] [-t threads] "
+                        "[-d image dir] [-o results]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (iterations == 0) {
+        iterations = 1;
+    }
+    if (bmp_set_threads(threads)) {
+        fprintf(stderr, "could only start %u threads\n", bmp_get_threads());
+    }
+    if (output != NULL) {
+        json = fopen(output, "w");
+        if (json == NULL) {
+            perror("fopen");
+            return 1;
+        }
+    }
+    b.file = "bmpbench_in.bmp";
+    b.out = "bmpbench_out.bmp";
+
+    list = strdup(sizes);
+    for (name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        b.bmp = NULL;
+        b.other = NULL;
+        if (strcmp(name, "lena") == 0 || strcmp(name, "beach") == 0) {
+            snprintf(path, sizeof(path), "%s/%s.bmp", dir, name);
+            b.bmp = bmp_load(path);
+            if (b.bmp != NULL) {
+                b.other = bmp_create(b.bmp->info.width, b.bmp->info.height);
+            }
+            if (b.other != NULL) {
+                memcpy(b.other->data[0], b.bmp->data[0], get_pixel_array_size(b.bmp));
+            }
+        } else {
+            for (i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+                if (strcmp(name, bench_sizes[i].name) == 0) {
+                    b.bmp = bench_synthetic(bench_sizes[i].width, bench_sizes[i].height, 1);
+                    b.other = bench_synthetic(bench_sizes[i].width, bench_sizes[i].height, 2);
+                }
+            }
+        }
+        b.mask = (b.bmp != NULL) ? bench_mask(b.bmp) : NULL;
+        b.planes[0] = (b.bmp != NULL) ? malloc(3 * (size_t)b.bmp->info.width * b.bmp->info.height) : NULL;
+        if (b.bmp != NULL && b.other != NULL && b.mask != NULL && b.planes[0] != NULL) {
+            b.planes[1] = b.planes[0] + (size_t)b.bmp->info.width * b.bmp->info.height;
+            b.planes[2] = b.planes[1] + (size_t)b.bmp->info.width * b.bmp->info.height;
+            bench_image(name, &b, iterations, json);
+        } else {
+            fprintf(stderr, "skipping image %s\n", name);
+        }
+        // whatever was set up is freed, skipped or not
+        if (b.bmp != NULL) {
+            bmp_destroy(b.bmp);
+        }
+        if (b.other != NULL) {
+            bmp_destroy(b.other);
+        }
+        if (b.mask != NULL) {
+            bmp_destroy(b.mask);
+        }
+        free(b.planes[0]);
+    }
+    free(list);
+
+    if (json != NULL) {
+        fclose(json);
+    }
+    return 0;
+}
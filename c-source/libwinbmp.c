@@ -1,7 +1,108 @@
+// for O_DIRECT; has no effect when system headers were included before this file
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include <math.h>
+#include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// number of spare pixel arrays kept by the scratch pool
+#ifndef BMP_SCRATCH_SLOTS
+#define BMP_SCRATCH_SLOTS 8
+#endif
+
+// alignment of bmp_planar_t planes and of their row stride
+#ifndef BMP_PLANAR_ALIGN
+#define BMP_PLANAR_ALIGN 64
+#endif
+
+// compression methods (info.compression) of the supported formats
+#define BMP_BI_RGB       0                 // uncompressed; 16 bit pixels are x1r5g5b5
+#define BMP_BI_RLE8      1                 // run-length encoded 8 bit indices
+#define BMP_BI_RLE4      2                 // run-length encoded 4 bit indices, held as 8 bit indices in memory
+#define BMP_BI_BITFIELDS 3                 // uncompressed with colour masks: r5g6b5 for 16 bit, a8r8g8b8 for 32 bit
+
+// largest header written: file and info headers, colour masks and a 256 entry palette
+#define BMP_HEADER_MAX (54 + 12 + 1024)
+
+// bmp_map() flags
+#define BMP_MAP_READONLY 0                 // pixels are mapped read-only; in-place operations will fault
+#define BMP_MAP_PRIVATE  1                 // pixels are mapped copy-on-write; changes never reach the file
+
+// flags for bmp_load_buffer()
+#define BMP_BUFFER_BORROW 0                // rows point into the caller's buffer, which must outlive the bitmap
+#define BMP_BUFFER_COPY   1                // pixels are copied; the buffer can be reused once the call returns
+
+// operations bmp_pipeline_t can defer
+#define BMP_OP_BRIGHTNESS     0
+#define BMP_OP_INVERT         1
+#define BMP_OP_GRAYSCALE      2
+#define BMP_OP_REMOVE_CHANNEL 3
+#define BMP_OP_SWAP_CHANNEL   4
+#define BMP_OP_LUT            5
+
+// bmp_load_parallel() and bmp_write_parallel() flags
+#define BMP_IO_DIRECT 1                    // bypass the page cache (O_DIRECT) where the file system allows it
+
+// block alignment of direct i/o, and the unit the transfer is split into between threads
+#ifndef BMP_IO_ALIGN
+#define BMP_IO_ALIGN 4096
+#endif
+#ifndef BMP_IO_CHUNK
+#define BMP_IO_CHUNK (1 << 20)
+#endif
+
+// two-image blend modes, the operation of bmp_add() .. bmp_max()
+#define BMP_BLEND_ADD        0
+#define BMP_BLEND_SUBTRACT   1
+#define BMP_BLEND_DIFFERENCE 2
+#define BMP_BLEND_MULTIPLY   3
+#define BMP_BLEND_AVERAGE    4
+#define BMP_BLEND_MIN        5
+#define BMP_BLEND_MAX        6
+
+// bmp_convolve() border modes, i.e. where pixels past the image edge are taken from
+#define BMP_BORDER_WRAP   0                // the opposite edge
+#define BMP_BORDER_CLAMP  1                // the nearest edge pixel
+#define BMP_BORDER_MIRROR 2                // reflection about the edge pixel
+
+// bmp_resize() filters
+#define BMP_RESIZE_NEAREST  0              // the source pixel under the output pixel's centre
+#define BMP_RESIZE_BILINEAR 1              // the 2x2 source pixels around the centre, weighted by distance
+#define BMP_RESIZE_AREA     2              // every source pixel the output pixel covers, weighted by coverage
+
+// bmp_color_from() and bmp_color_to() colour spaces
+#define BMP_COLOR_LUMA  0                  // one channel: luma with the 0.07/0.72/0.21 weights of bmp_grayscale()
+#define BMP_COLOR_YCBCR 1                  // Y, Cb, Cr: full-range BT.601 as in JPEG
+#define BMP_COLOR_HSV   2                  // hue (256 to a full turn, 0 is red), saturation, value
+
+// bmp_draw() shapes
+#define BMP_SHAPE_LINE    0                // segment from (x0, y0) to (x1, y1), both ends included
+#define BMP_SHAPE_RECT    1                // outline of the box with corners (x0, y0) and (x1, y1)
+#define BMP_SHAPE_FILL    2                // the same box, filled
+#define BMP_SHAPE_POLYGON 3                // polygon through `count` points, filled by the even-odd rule
+
+// buckets of the bmp_metric_t latency histogram
+#define BMP_METRIC_BUCKETS 32
 
 
 typedef struct {
@@ -32,32 +133,674 @@ typedef struct {
     bmp_file_header_t header;
     bmp_bitmap_info_header_t info;
     unsigned char **data;
+    unsigned char *map;                    // start of the file mapping or borrowed buffer the rows point into, NULL otherwise
+    size_t map_size;                       // length of the file mapping, 0 for a buffer the bitmap does not own
+    struct bmp_pipeline *pipeline;         // operations deferred with bmp_defer(), NULL if never deferred
+    unsigned char *palette;                // b, g, r, 0 entries of an 8 bit bitmap, NULL for other formats
+    int top_down;                          // stored top row first (negative height on disk); data[0] is still the bottom row
+    struct bmp_pyramid *pyramid;           // reduced copies kept by bmp_pyramid(), NULL if never asked for
 } bmp_t;
 
 
+typedef struct {
+    unsigned char table[3][256];           // new value of every blue, green and red value
+} bmp_lut_t;
+
+
+typedef struct {
+    int type;                              // one of BMP_OP_*
+    int arg;                               // brightness step, channel or index of the lookup table
+    int arg2;                              // other channel of a swap
+} bmp_op_t;
+
+
+typedef struct bmp_pipeline {
+    bmp_t *bmp;
+    bmp_op_t *ops;
+    unsigned int count;
+    unsigned int capacity;
+    bmp_lut_t *luts;                       // tables of deferred bmp_apply_lut() calls
+    unsigned int lut_count;
+} bmp_pipeline_t;
+
+
+typedef struct {
+    int taps[3][3];                        // weights; taps[0] applies to data[y - 1], taps[1][0] to the pixel on the left
+    int divisor;                           // weighted sum is divided by this (rounded), must be at least 1
+    int bias;                              // added after the division
+} bmp_kernel_t;
+
+
+typedef struct {
+    int type;                              // one of BMP_SHAPE_*
+    unsigned int rgb;                      // colour as 0xrrggbb
+    int x0;                                // corners or ends, in pixels; they may lie outside the image
+    int y0;
+    int x1;
+    int y1;
+    const int *points;                     // x, y pairs of a polygon
+    unsigned int count;                    // number of polygon points
+} bmp_shape_t;
+
+
+typedef struct {
+    unsigned int width;
+    unsigned int height;
+    unsigned long long *sum;               // (width + 1) * (height + 1) bgr triplets; row 0 and column 0 are zero
+    unsigned long long *squares;           // the same for squared values, NULL unless requested
+} bmp_integral_t;
+
+
+typedef struct {
+    unsigned long long histogram[4][256];  // blue, green, red, luma
+    unsigned char min[4];
+    unsigned char max[4];
+    double mean[4];
+    double stddev[4];
+} bmp_stats_t;
+
+
+typedef struct bmp_pyramid {
+    bmp_t *bmp;                            // the base level, which the pyramid is attached to
+    unsigned int count;                    // levels, the base included
+    bmp_t *levels;                         // levels[i] is half the size of levels[i - 1]; levels[0] stands for the base
+    unsigned char *block;                  // pixels of every reduced level, one allocation
+    unsigned char **rows;                  // row pointers of every reduced level
+    unsigned char *dirty;                  // one flag per BMP_PYRAMID_TILE square of every reduced level
+    unsigned int *tiles;                   // index in dirty of the first tile of each level
+    unsigned int width;                    // base geometry the levels were laid out for
+    unsigned int height;
+    unsigned int bits;
+} bmp_pyramid_t;
+
+
+typedef struct {
+    bmp_file_header_t header;              // headers the bitmap is written back with
+    bmp_bitmap_info_header_t info;
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride;                   // bytes between rows of a plane, a multiple of BMP_PLANAR_ALIGN
+    unsigned char *planes[3];              // blue, green and red planes, one allocation starting at planes[0]
+    unsigned char *spare;                  // second block for filters to write into, NULL until first needed
+} bmp_planar_t;
+
+
+typedef struct {
+    bmp_t *(*filter)(bmp_t *);             // whole-image operation such as bmp_blur, or NULL to apply `op`
+    bmp_op_t op;                           // point operation; consecutive ones are fused as in bmp_defer()
+} bmp_batch_op_t;
+
+
+typedef struct {
+    unsigned int files;                    // files written
+    unsigned int failed;                   // files that could not be loaded, processed or written
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+    double seconds;                        // wall-clock time of the whole batch
+} bmp_batch_stats_t;
+
+
+typedef struct {
+    FILE *f;
+    bmp_t image;                           // headers of the whole bitmap; image.data is unused
+    bmp_t *band;                           // band buffer handed out by bmp_stream_read()
+    unsigned char **band_data;             // rows of band as last sized by bmp_stream_read()
+    unsigned int capacity;                 // rows allocated in band_data
+    unsigned int row;                      // next row to be read or written
+} bmp_stream_t;
+
+
+// counters of one library function, summed over its calls since the last bmp_metrics_reset();
+// they are only kept when the library is built with BMP_METRICS defined
+typedef struct {
+    const char *name;                      // function name
+    unsigned long long calls;
+    unsigned long long nanoseconds;        // wall time, nested library calls included
+    unsigned long long max_nanoseconds;    // the longest call
+    unsigned long long pixels;             // pixels of the images worked on or loaded
+    unsigned long long bytes_read;         // from files and buffers, by the function and the calls it makes
+    unsigned long long bytes_written;
+    unsigned long long bytes_allocated;    // pixel arrays and other buffers sized by the image
+    unsigned long long simd_calls;         // calls that ran a vector kernel; the others were scalar throughout
+    unsigned long long threaded_calls;     // calls that spread rows over more than one thread
+    unsigned long long latency[BMP_METRIC_BUCKETS]; // calls by duration: bucket 0 under 1 us, bucket i under 2^i us
+} bmp_metric_t;
+
+#ifdef BMP_METRICS
+// a function instrumented with BMP_METRIC(): its counters and its link in the list bmp_metrics() walks
+typedef struct bmp_metric_site {
+    bmp_metric_t metric;
+    int registered;
+    struct bmp_metric_site *next;
+} bmp_metric_site_t;
+
+// a call in progress, on the stack of its thread; pool workers add to the scope of the call whose rows they run
+typedef struct bmp_metric_scope {
+    bmp_metric_site_t *site;
+    struct bmp_metric_scope *parent;       // the library call this one was made from, if any
+    struct timespec start;
+    unsigned long long bytes[3];           // read, written, allocated
+    int path;                              // BMP_METRIC_PATH_* flags
+} bmp_metric_scope_t;
+
+#define BMP_METRIC_PATH_SIMD     1
+#define BMP_METRIC_PATH_THREADED 2
+
+static struct {
+    pthread_mutex_t lock;                  // guards the list
+    bmp_metric_site_t *first;              // in order of first call
+} bmp_metric_sites = { PTHREAD_MUTEX_INITIALIZER, NULL };
+
+// innermost call in progress on this thread
+static __thread bmp_metric_scope_t *bmp_metric_current;
+
+// call whose job the pool is running, set while bmp_pool.busy is held
+static bmp_metric_scope_t *bmp_metric_pool;
+
+// starts timing a call; the result initialises *self, which becomes the innermost call of the thread
+static bmp_metric_scope_t bmp_metric_begin(bmp_metric_scope_t *self, bmp_metric_site_t *site,
+        const unsigned long long pixels)
+{
+    bmp_metric_scope_t scope = { site, bmp_metric_current, { 0, 0 }, { 0, 0, 0 }, 0 };
+    bmp_metric_site_t **link;
+
+    if (!__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&bmp_metric_sites.lock);
+        if (!site->registered) {
+            for (link = &bmp_metric_sites.first; *link != NULL; link = &(*link)->next) {
+            }
+            *link = site;
+            __atomic_store_n(&site->registered, 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&bmp_metric_sites.lock);
+    }
+    __atomic_fetch_add(&site->metric.pixels, pixels, __ATOMIC_RELAXED);
+    bmp_metric_current = self;
+    clock_gettime(CLOCK_MONOTONIC, &scope.start);
+    return scope;
+}
+
+// runs as the instrumented function returns: folds the call into the counters of its function, and its bytes
+// and paths into the call it was made from
+static void bmp_metric_end(bmp_metric_scope_t *scope)
+{
+    bmp_metric_t *m = &scope->site->metric;
+    struct timespec now;
+    unsigned long long ns;
+    unsigned long long max;
+    unsigned int bucket = 0;
+    unsigned int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (unsigned long long)((now.tv_sec - scope->start.tv_sec) * 1000000000LL + (now.tv_nsec - scope->start.tv_nsec));
+    while (bucket < BMP_METRIC_BUCKETS - 1 && ns >= 1000ULL << bucket) {
+        bucket++;
+    }
+    __atomic_fetch_add(&m->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->nanoseconds, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->latency[bucket], 1, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&m->max_nanoseconds, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&m->max_nanoseconds, &max, ns, 1, __ATOMIC_RELAXED,
+                __ATOMIC_RELAXED)) {
+    }
+    __atomic_fetch_add(&m->bytes_read, scope->bytes[0], __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->bytes_written, scope->bytes[1], __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->bytes_allocated, scope->bytes[2], __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->simd_calls, (scope->path & BMP_METRIC_PATH_SIMD) != 0, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->threaded_calls, (scope->path & BMP_METRIC_PATH_THREADED) != 0, __ATOMIC_RELAXED);
+
+    bmp_metric_current = scope->parent;
+    if (scope->parent != NULL) {
+        for (i = 0; i < 3; i++) {
+            __atomic_fetch_add(&scope->parent->bytes[i], scope->bytes[i], __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_or(&scope->parent->path, scope->path, __ATOMIC_RELAXED);
+    }
+}
+
+// adds to byte counter `which` of the innermost call on this thread
+static void bmp_metric_bytes(const unsigned int which, const unsigned long long n)
+{
+    if (bmp_metric_current != NULL) {
+        __atomic_fetch_add(&bmp_metric_current->bytes[which], n, __ATOMIC_RELAXED);
+    }
+}
+
+static void bmp_metric_path(const int path)
+{
+    bmp_metric_scope_t *scope = bmp_metric_current;
+
+    // usually already set, and then a plain read is all it costs
+    if (scope != NULL && (__atomic_load_n(&scope->path, __ATOMIC_RELAXED) & path) != path) {
+        __atomic_fetch_or(&scope->path, path, __ATOMIC_RELAXED);
+    }
+}
+
+static void bmp_metric_pixels(const unsigned long long n)
+{
+    if (bmp_metric_current != NULL) {
+        __atomic_fetch_add(&bmp_metric_current->site->metric.pixels, n, __ATOMIC_RELAXED);
+    }
+}
+
+// times the enclosing function until it returns; goes last among its declarations
+#define BMP_METRIC(width, height) \
+    static bmp_metric_site_t bmp_metric_site = { .metric = { .name = __func__ } }; \
+    bmp_metric_scope_t bmp_metric_scope __attribute__((cleanup(bmp_metric_end))) = \
+            bmp_metric_begin(&bmp_metric_scope, &bmp_metric_site, (unsigned long long)(width) * (height))
+#define BMP_METRIC_PIXELS(n)  bmp_metric_pixels(n)
+#define BMP_METRIC_READ(n)    bmp_metric_bytes(0, n)
+#define BMP_METRIC_WRITTEN(n) bmp_metric_bytes(1, n)
+#define BMP_METRIC_ALLOC(n)   bmp_metric_bytes(2, n)
+#define BMP_METRIC_SIMD()     bmp_metric_path(BMP_METRIC_PATH_SIMD)
+// the pool is about to run the rows of the innermost call on more than one thread
+#define BMP_METRIC_SHARE()    (bmp_metric_pool = bmp_metric_current, bmp_metric_path(BMP_METRIC_PATH_THREADED))
+// a worker takes on, and gives back, the call of the job it runs
+#define BMP_METRIC_JOIN()     (bmp_metric_current = bmp_metric_pool)
+#define BMP_METRIC_LEAVE()    (bmp_metric_current = NULL)
+#else
+#define BMP_METRIC(width, height)
+#define BMP_METRIC_PIXELS(n)  ((void)0)
+#define BMP_METRIC_READ(n)    ((void)0)
+#define BMP_METRIC_WRITTEN(n) ((void)0)
+#define BMP_METRIC_ALLOC(n)   ((void)0)
+#define BMP_METRIC_SIMD()     ((void)0)
+#define BMP_METRIC_SHARE()    ((void)0)
+#define BMP_METRIC_JOIN()     ((void)0)
+#define BMP_METRIC_LEAVE()    ((void)0)
+#endif
+
+#ifdef BMP_METRICS
+static unsigned long long bmp_metric_take(unsigned long long *counter, const int reset)
+{
+    return reset ? __atomic_exchange_n(counter, 0, __ATOMIC_RELAXED) : __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// copies the counters of one function, zeroing them on the way when `reset` is set; calls still running may
+// be counted in some fields and not yet in others
+static void bmp_metric_copy(bmp_metric_t *dst, bmp_metric_t *src, const int reset)
+{
+    unsigned int i;
+
+    dst->name = src->name;
+    dst->calls = bmp_metric_take(&src->calls, reset);
+    dst->nanoseconds = bmp_metric_take(&src->nanoseconds, reset);
+    dst->max_nanoseconds = bmp_metric_take(&src->max_nanoseconds, reset);
+    dst->pixels = bmp_metric_take(&src->pixels, reset);
+    dst->bytes_read = bmp_metric_take(&src->bytes_read, reset);
+    dst->bytes_written = bmp_metric_take(&src->bytes_written, reset);
+    dst->bytes_allocated = bmp_metric_take(&src->bytes_allocated, reset);
+    dst->simd_calls = bmp_metric_take(&src->simd_calls, reset);
+    dst->threaded_calls = bmp_metric_take(&src->threaded_calls, reset);
+    for (i = 0; i < BMP_METRIC_BUCKETS; i++) {
+        dst->latency[i] = bmp_metric_take(&src->latency[i], reset);
+    }
+}
+#endif
+
+unsigned int bmp_metrics(bmp_metric_t *metrics, const unsigned int max)
+{
+#ifdef BMP_METRICS
+    bmp_metric_site_t *site;
+    unsigned int count = 0;
+
+    pthread_mutex_lock(&bmp_metric_sites.lock);
+    for (site = bmp_metric_sites.first; site != NULL; site = site->next, count++) {
+        if (count < max) {
+            bmp_metric_copy(&metrics[count], &site->metric, 0);
+        }
+    }
+    pthread_mutex_unlock(&bmp_metric_sites.lock);
+    return count;
+#else
+    (void)metrics;
+    (void)max;
+    return 0;
+#endif
+}
+
+void bmp_metrics_reset(void)
+{
+#ifdef BMP_METRICS
+    bmp_metric_site_t *site;
+    bmp_metric_t discard;
+
+    pthread_mutex_lock(&bmp_metric_sites.lock);
+    for (site = bmp_metric_sites.first; site != NULL; site = site->next) {
+        bmp_metric_copy(&discard, &site->metric, 1);
+    }
+    pthread_mutex_unlock(&bmp_metric_sites.lock);
+#endif
+}
+
+int bmp_metrics_dump(FILE *f)
+{
+    bmp_metric_t *metrics;
+    bmp_metric_t *m;
+    const char *sep;
+    unsigned int count;
+    unsigned int i;
+    unsigned int k;
+
+    // functions only ever join the list, so a second look finds at least as many
+    count = bmp_metrics(NULL, 0);
+    if (count == 0) {
+        return 0;
+    }
+    metrics = malloc(count * sizeof(bmp_metric_t));
+    if (metrics == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    bmp_metrics(metrics, count);
+    for (i = 0; i < count; i++) {
+        m = &metrics[i];
+        fprintf(f, "{\"function\": \"%s\", \"calls\": %llu, \"seconds\": %.9f, \"max_seconds\": %.9f, "
+                "\"megapixels\": %.6f, \"bytes_read\": %llu, \"bytes_written\": %llu, \"bytes_allocated\": %llu, "
+                "\"simd_calls\": %llu, \"threaded_calls\": %llu, \"latency_us\": {",
+                m->name, m->calls, m->nanoseconds * 1e-9, m->max_nanoseconds * 1e-9, m->pixels * 1e-6,
+                m->bytes_read, m->bytes_written, m->bytes_allocated, m->simd_calls, m->threaded_calls);
+        // non-empty buckets only, keyed by their upper bound
+        sep = "";
+        for (k = 0; k < BMP_METRIC_BUCKETS; k++) {
+            if (m->latency[k] > 0 && k + 1 < BMP_METRIC_BUCKETS) {
+                fprintf(f, "%s\"%llu\": %llu", sep, 1ULL << k, m->latency[k]);
+                sep = ", ";
+            } else if (m->latency[k] > 0) {
+                fprintf(f, "%s\"inf\": %llu", sep, m->latency[k]);
+            }
+        }
+        fprintf(f, "}}\n");
+    }
+    free(metrics);
+    fflush(f);
+    return ferror(f) != 0;
+}
+
+
+// row and pixel array sizes without wrapping; the 32 bit getters below are exact for any bitmap that
+// passed bmp_check_size()
+static unsigned long long bmp_row_size64(const bmp_t *bmp)
+{
+    return (((unsigned long long)bmp->info.bits_per_pixel * bmp->info.width + 31) / 32) * 4;
+}
+
+static unsigned long long bmp_pixel_array_size64(const bmp_t *bmp)
+{
+    return bmp_row_size64(bmp) * bmp->info.height;
+}
+
+// rejects dimensions whose pixel array does not fit the 32 bit size fields of the format; every loader
+// calls this before sizing anything from the headers
+static int bmp_check_size(const bmp_t *bmp)
+{
+    // the row size is below 2^36, so the product can only overflow 64 bits once the row alone is too big
+    return bmp_row_size64(bmp) > UINT_MAX || bmp_pixel_array_size64(bmp) > UINT_MAX;
+}
+
 unsigned int get_row_size(bmp_t *bmp)
 {
-    unsigned int row_size;
-    row_size = ((bmp->info.bits_per_pixel * bmp->info.width + 31) / 32) * 4;
-    return row_size;
+    return (unsigned int)bmp_row_size64(bmp);
 }
 
 unsigned int get_pixel_array_size(bmp_t *bmp)
 {
-    return get_row_size(bmp) * bmp->info.height;
+    return (unsigned int)bmp_pixel_array_size64(bmp);
+}
+
+bmp_t *bmp_flush(bmp_t *bmp);
+void bmp_integral_destroy(bmp_integral_t *ii);
+void bmp_pyramid_invalidate(bmp_t *bmp, const unsigned int x, const unsigned int y, const unsigned int w,
+        const unsigned int h);
+void bmp_pyramid_destroy(bmp_pyramid_t *pyramid);
+static void bmp_rle_decode(bmp_t *bmp, const unsigned char *src, size_t size);
+static unsigned char *bmp_rle_encode(bmp_t *bmp, size_t *size);
+
+// resets the bookkeeping fields that are not part of the file headers
+static void bmp_init(bmp_t *bmp)
+{
+    bmp->map = NULL;
+    bmp->map_size = 0;
+    bmp->pipeline = NULL;
+    bmp->palette = NULL;
+    bmp->top_down = 0;
+    bmp->pyramid = NULL;
+}
+
+static int bmp_is_rle(const bmp_t *bmp)
+{
+    return bmp->info.compression == BMP_BI_RLE8 || bmp->info.compression == BMP_BI_RLE4;
+}
+
+// marks the whole image as changed for the pyramid, after an in-place operation
+static void bmp_changed(bmp_t *bmp)
+{
+    bmp_pyramid_invalidate(bmp, 0, 0, bmp->info.width, bmp->info.height);
+}
+
+// entries in the palette of an 8 bit bitmap (at most 16 when it is stored as RLE4), 0 for other formats
+static unsigned int bmp_palette_colors(const bmp_t *bmp)
+{
+    unsigned int max = (bmp->info.compression == BMP_BI_RLE4) ? 16 : 256;
+
+    if (bmp->info.bits_per_pixel != 8) {
+        return 0;
+    }
+    return (bmp->info.colors > 0 && bmp->info.colors <= max) ? bmp->info.colors : max;
+}
+
+// height field on disk: negative for top-down, which compressed bitmaps cannot be
+static int bmp_file_height(const bmp_t *bmp)
+{
+    return (bmp->top_down && !bmp_is_rle(bmp)) ? -(int)bmp->info.height : (int)bmp->info.height;
+}
+
+// bits per pixel on disk: RLE4 indices are held one per byte in memory
+static unsigned short int bmp_file_bits(const bmp_t *bmp)
+{
+    return (bmp->info.compression == BMP_BI_RLE4) ? 4 : bmp->info.bits_per_pixel;
+}
+
+// bytes of RLE data to decode: image_size, unless that is missing or runs past the `available` bytes
+static size_t bmp_rle_size(const bmp_t *bmp, const size_t available)
+{
+    return (bmp->info.image_size > 0 && bmp->info.image_size <= available) ? bmp->info.image_size : available;
+}
+
+// bytes written between the 54 byte header and the pixels: colour masks and palette
+static unsigned int bmp_extras_size(const bmp_t *bmp)
+{
+    return ((bmp->info.compression == BMP_BI_BITFIELDS) ? 12 : 0) + 4 * bmp_palette_colors(bmp);
+}
+
+// only the 40 byte info header is written, extended headers of the source file are dropped;
+// the image size of compressed bitmaps is set beforehand from the encoded length
+static void bmp_normalize_header(bmp_t *bmp)
+{
+    bmp->info.header_size = 40;
+    bmp->info.colors = bmp_palette_colors(bmp);
+    if (!bmp_is_rle(bmp)) {
+        bmp->info.image_size = get_pixel_array_size(bmp);
+    }
+    bmp->header.bitmap_offset = 54 + bmp_extras_size(bmp);
+    bmp->header.bitmap_size = bmp->header.bitmap_offset + bmp->info.image_size;
+}
+
+static void bmp_pack_extras(const bmp_t *bmp, unsigned char *p)
+{
+    unsigned int masks[3] = { 0xff0000, 0xff00, 0xff };
+
+    if (bmp->info.compression == BMP_BI_BITFIELDS) {
+        if (bmp->info.bits_per_pixel == 16) {
+            masks[0] = 0xf800;
+            masks[1] = 0x07e0;
+            masks[2] = 0x001f;
+        }
+        memcpy(p, masks, 12);
+        p += 12;
+    }
+    if (bmp->palette != NULL) {
+        memcpy(p, bmp->palette, 4 * bmp_palette_colors(bmp));
+    } else {
+        memset(p, 0, 4 * bmp_palette_colors(bmp));
+    }
+}
+
+// checks freshly parsed headers against the formats there are kernels for, and turns a negative
+// height into top_down; `masks` are the 12 bytes at file offset 54, read when compression is bitfields
+static int bmp_check_format(bmp_t *bmp, const unsigned char *masks, const char *path)
+{
+    unsigned int m[3] = { 0, 0, 0 };
+    int ok = 0;
+
+    if ((int)bmp->info.height < 0 && (int)bmp->info.height != INT_MIN) {
+        bmp->info.height = -(int)bmp->info.height;
+        bmp->top_down = 1;
+    }
+    if (bmp->info.compression == BMP_BI_BITFIELDS && masks != NULL) {
+        memcpy(m, masks, 12);
+    }
+    switch (bmp->info.bits_per_pixel) {
+        case 4:
+            // expanded to one index per byte by the decoder
+            ok = (bmp->info.compression == BMP_BI_RLE4);
+            bmp->info.bits_per_pixel = 8;
+            break;
+        case 8:
+            ok = (bmp->info.compression == BMP_BI_RGB) || (bmp->info.compression == BMP_BI_RLE8);
+            break;
+        case 24:
+            ok = (bmp->info.compression == BMP_BI_RGB);
+            break;
+        case 16:
+            if (bmp->info.compression == BMP_BI_BITFIELDS && m[0] == 0x7c00 && m[1] == 0x03e0 && m[2] == 0x001f) {
+                // x1r5g5b5 is what BI_RGB means anyway
+                bmp->info.compression = BMP_BI_RGB;
+            }
+            ok = (bmp->info.compression == BMP_BI_RGB) || (bmp->info.compression == BMP_BI_BITFIELDS
+                    && m[0] == 0xf800 && m[1] == 0x07e0 && m[2] == 0x001f);
+            break;
+        case 32:
+            ok = (bmp->info.compression == BMP_BI_RGB) || (bmp->info.compression == BMP_BI_BITFIELDS
+                    && m[0] == 0xff0000 && m[1] == 0xff00 && m[2] == 0xff);
+            break;
+    }
+    // run-length encoded bitmaps are always stored bottom-up
+    if (bmp->header.type != 19778 || !ok || (bmp->top_down && bmp_is_rle(bmp)) || bmp_check_size(bmp)) {
+        printf("Invalid file format: %s\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+static unsigned char **bmp_alloc_rows(bmp_t *bmp, unsigned int height)
+{
+    unsigned char **rows;
+    unsigned int row_size = get_row_size(bmp);
+    unsigned int i;
+
+    // catches the dimensions of new images, files are rejected by bmp_check_format() already
+    if (bmp_row_size64(bmp) > UINT_MAX || bmp_row_size64(bmp) * height > UINT_MAX) {
+        printf("Invalid size: %ux%u\n", bmp->info.width, height);
+        return NULL;
+    }
+    rows = malloc((height ? height : 1) * sizeof(unsigned char *));
+    if (rows == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    rows[0] = malloc((size_t)row_size * height + 1);
+    if (rows[0] == NULL) {
+        perror("malloc");
+        free(rows);
+        return NULL;
+    }
+    BMP_METRIC_ALLOC((size_t)row_size * height);
+    // write addresses of row_sized chunks
+    for (i = 0; i < height; i++) {
+        rows[i] = rows[0] + (size_t)row_size * i;
+    }
+    return rows;
+}
+
+bmp_t *bmp_create(const unsigned int width, const unsigned int height)
+{
+    bmp_t *bmp = malloc(sizeof(bmp_t));
+    BMP_METRIC(width, height);
+
+    if (bmp == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    bmp_init(bmp);
+
+    bmp->info.header_size = 40;
+    bmp->info.width = width;
+    bmp->info.height = height;
+    bmp->info.planes = 1;
+    bmp->info.bits_per_pixel = 24;
+    bmp->info.compression = 0;
+    bmp->info.image_size = get_pixel_array_size(bmp);
+    bmp->info.x_resolution = 2835;
+    bmp->info.y_resolution = 2835;
+    bmp->info.colors = 0;
+    bmp->info.important_colors = 0;
+
+    bmp->header.type = 19778;
+    bmp->header.bitmap_size = 54 + bmp->info.image_size;
+    bmp->header.reserved1 = 0;
+    bmp->header.reserved2 = 0;
+    bmp->header.bitmap_offset = 54;
+
+    bmp->data = bmp_alloc_rows(bmp, height);
+    if (bmp->data == NULL) {
+        free(bmp);
+        return NULL;
+    }
+    memset(bmp->data[0], 0, get_pixel_array_size(bmp));
+    return bmp;
+}
+
+// frees what bmp_load() has built so far and closes the file, if still open; returns NULL for the caller
+// to pass on
+static bmp_t *bmp_load_fail(bmp_t *bmp, FILE *f)
+{
+    if (f != NULL) {
+        fclose(f);
+    }
+    if (bmp->data != NULL) {
+        free(bmp->data[0]);
+        free(bmp->data);
+    }
+    free(bmp->palette);
+    free(bmp);
+    return NULL;
 }
 
 bmp_t *bmp_load(const char *path)
 {
+    unsigned char masks[12] = {0};
+    unsigned char *rle;
     unsigned int row_size;
     unsigned int pixel_array_size;
+    size_t rle_size;
+    size_t got = 0;
+    long file_size;
     FILE* f;
     unsigned int i;
     bmp_t *bmp = malloc(sizeof(bmp_t));
+    BMP_METRIC(0, 0);
 
+    if (bmp == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    bmp_init(bmp);
+    bmp->data = NULL;
     f = fopen(path, "rb");
     if (f == NULL) {
         perror("fopen");
+        free(bmp);
         return NULL;
     }
 
@@ -66,7 +809,7 @@ bmp_t *bmp_load(const char *path)
     // check if the file is indeed a bitmap
     if (bmp->header.type != 19778) {
         printf("Invalid file format: %s\n", path);
-        return NULL;
+        return bmp_load_fail(bmp, f);
     }
     fread(&bmp->header.bitmap_size, sizeof(unsigned int), 1, f);
     fread(&bmp->header.reserved1, sizeof(unsigned short int), 1, f);
@@ -79,726 +822,6362 @@ bmp_t *bmp_load(const char *path)
     fread(&bmp->info.height, sizeof(unsigned int), 1, f);
     fread(&bmp->info.planes, sizeof(unsigned short int), 1, f);
     fread(&bmp->info.bits_per_pixel, sizeof(unsigned short int), 1, f);
-    if (bmp->info.bits_per_pixel != 24) {
-        printf("Invalid file format: %s\n", path);
-        return NULL;
-    }
     fread(&bmp->info.compression, sizeof(unsigned int), 1, f);
     fread(&bmp->info.image_size, sizeof(unsigned int), 1, f);
     fread(&bmp->info.x_resolution, sizeof(unsigned int), 1, f);
     fread(&bmp->info.y_resolution, sizeof(unsigned int), 1, f);
     fread(&bmp->info.colors, sizeof(unsigned int), 1, f);
     fread(&bmp->info.important_colors, sizeof(unsigned int), 1, f);
+    // a short read leaves the end-of-file flag set, and then some of the fields above are garbage
+    if (feof(f) || ferror(f)) {
+        printf("Invalid file format: %s\n", path);
+        return bmp_load_fail(bmp, f);
+    }
+
+    // colour masks follow a 40 byte info header and sit at the same offset inside larger ones
+    fread(masks, 1, sizeof(masks), f);
+    if (bmp_check_format(bmp, masks, path)) {
+        return bmp_load_fail(bmp, f);
+    }
+    if (bmp_palette_colors(bmp) > 0) {
+        bmp->palette = calloc(256, 4);
+        if (bmp->palette == NULL) {
+            perror("calloc");
+            return bmp_load_fail(bmp, f);
+        }
+        fseek(f, 14 + bmp->info.header_size, SEEK_SET);
+        if (fread(bmp->palette, 4, bmp_palette_colors(bmp), f) != bmp_palette_colors(bmp)) {
+            printf("Invalid file format: %s\n", path);
+            return bmp_load_fail(bmp, f);
+        }
+    }
 
     // allocate pixel data array
     row_size = get_row_size(bmp);
     pixel_array_size = get_pixel_array_size(bmp);
-    bmp->data = malloc(bmp->info.height * sizeof(unsigned char *));
-    bmp->data[0] = malloc(pixel_array_size * sizeof(unsigned char));
+    bmp->data = bmp_alloc_rows(bmp, bmp->info.height);
     if (bmp->data == NULL) {
-        perror("malloc");
-        return NULL;
-    }
-    // write addresses of row_sized chunks
-    for (i = 0; i < bmp->info.height; i++) {
-        bmp->data[i] = (*bmp->data + row_size * i);
+        return bmp_load_fail(bmp, f);
     }
 
     // read pixel data; pixel format: [b g r] ...
-    fread(bmp->data[0], sizeof(char), pixel_array_size, f);
+    fseek(f, 0, SEEK_END);
+    file_size = ftell(f);
+    fseek(f, bmp->header.bitmap_offset, SEEK_SET);
+    if (bmp_is_rle(bmp)) {
+        // the whole run-length stream in one read, decoded straight into the rows; a truncated
+        // stream is decoded as far as it goes
+        rle_size = bmp_rle_size(bmp, file_size > (long)bmp->header.bitmap_offset
+                ? (size_t)(file_size - bmp->header.bitmap_offset) : 0);
+        rle = malloc(rle_size + 1);
+        if (rle == NULL) {
+            perror("malloc");
+            return bmp_load_fail(bmp, f);
+        }
+        rle_size = fread(rle, 1, rle_size, f);
+        bmp_rle_decode(bmp, rle, rle_size);
+        free(rle);
+    } else if (bmp->top_down) {
+        for (i = bmp->info.height; i-- > 0;) {
+            got += fread(bmp->data[i], sizeof(char), row_size, f);
+        }
+    } else {
+        got = fread(bmp->data[0], sizeof(char), pixel_array_size, f);
+    }
+    // uncompressed pixels must all be there
+    if (!bmp_is_rle(bmp) && got < pixel_array_size) {
+        printf("Invalid file format: %s\n", path);
+        return bmp_load_fail(bmp, f);
+    }
+    BMP_METRIC_READ(ftell(f));
+    BMP_METRIC_PIXELS((unsigned long long)bmp->info.width * bmp->info.height);
 
     if (fclose(f) == EOF) {
         perror("fclose");
-        return NULL;
+        return bmp_load_fail(bmp, NULL);
     }
     return bmp;
 }
 
-int bmp_write(bmp_t *bmp, const char *path)
+static void bmp_parse_header(bmp_t *bmp, const unsigned char *p)
 {
-    FILE *f;
+    // fields are packed and little-endian on disk, hence the fixed offsets
+    memcpy(&bmp->header.type, p + 0, 2);
+    memcpy(&bmp->header.bitmap_size, p + 2, 4);
+    memcpy(&bmp->header.reserved1, p + 6, 2);
+    memcpy(&bmp->header.reserved2, p + 8, 2);
+    memcpy(&bmp->header.bitmap_offset, p + 10, 4);
 
-    f = fopen(path, "wb");
-    if (f == NULL) {
-        perror("fopen");
-        return 1;
+    memcpy(&bmp->info.header_size, p + 14, 4);
+    memcpy(&bmp->info.width, p + 18, 4);
+    memcpy(&bmp->info.height, p + 22, 4);
+    memcpy(&bmp->info.planes, p + 26, 2);
+    memcpy(&bmp->info.bits_per_pixel, p + 28, 2);
+    memcpy(&bmp->info.compression, p + 30, 4);
+    memcpy(&bmp->info.image_size, p + 34, 4);
+    memcpy(&bmp->info.x_resolution, p + 38, 4);
+    memcpy(&bmp->info.y_resolution, p + 42, 4);
+    memcpy(&bmp->info.colors, p + 46, 4);
+    memcpy(&bmp->info.important_colors, p + 50, 4);
+}
+
+// the inverse of bmp_parse_header(), followed by colour masks and palette; `rle_size` is the length of
+// the encoded pixels of a compressed bitmap. p holds BMP_HEADER_MAX bytes, returns the number used
+static unsigned int bmp_pack_header(const bmp_t *bmp, const size_t rle_size, unsigned char *p)
+{
+    unsigned short int bits = bmp_file_bits(bmp);
+    int height = bmp_file_height(bmp);
+    bmp_t file = *bmp;
+
+    // the headers describe the file being written, the bitmap keeps the ones it has
+    if (bmp_is_rle(&file)) {
+        file.info.image_size = (unsigned int)rle_size;
     }
+    bmp_normalize_header(&file);
 
-    // header dump
-    if (0 > (int)fwrite(&bmp->header.type, sizeof(unsigned short int), 1, f)) {
-        perror("fwrite");
+    memcpy(p + 0, &file.header.type, 2);
+    memcpy(p + 2, &file.header.bitmap_size, 4);
+    memcpy(p + 6, &file.header.reserved1, 2);
+    memcpy(p + 8, &file.header.reserved2, 2);
+    memcpy(p + 10, &file.header.bitmap_offset, 4);
+
+    memcpy(p + 14, &file.info.header_size, 4);
+    memcpy(p + 18, &file.info.width, 4);
+    memcpy(p + 22, &height, 4);
+    memcpy(p + 26, &file.info.planes, 2);
+    memcpy(p + 28, &bits, 2);
+    memcpy(p + 30, &file.info.compression, 4);
+    memcpy(p + 34, &file.info.image_size, 4);
+    memcpy(p + 38, &file.info.x_resolution, 4);
+    memcpy(p + 42, &file.info.y_resolution, 4);
+    memcpy(p + 46, &file.info.colors, 4);
+    memcpy(p + 50, &file.info.important_colors, 4);
+    bmp_pack_extras(&file, p + 54);
+    return file.header.bitmap_offset;
+}
+
+// parses a whole bitmap file held in memory and points the rows into it, bottom row first either way; run-length
+// encoded pixels are decoded into rows of their own instead. The caller keeps p alive for as long as the rows use it
+static int bmp_parse_file(bmp_t *bmp, unsigned char *p, const size_t size, const char *path)
+{
+    unsigned int row_size;
+    unsigned int i;
+
+    if (size < 54) {
+        printf("Invalid file format: %s\n", path);
+        return 1;
+    }
+    bmp_parse_header(bmp, p);
+
+    // check if the file is indeed a bitmap that fits in the buffer
+    if (bmp_check_format(bmp, (size >= 66) ? p + 54 : NULL, path)) {
+        return 1;
+    }
+    if (bmp->header.bitmap_offset > size
+            || (!bmp_is_rle(bmp) && bmp_pixel_array_size64(bmp) > size - bmp->header.bitmap_offset)
+            || 14ull + bmp->info.header_size + 4 * bmp_palette_colors(bmp) > size) {
+        printf("Invalid file format: %s\n", path);
+        return 1;
+    }
+    if (bmp_palette_colors(bmp) > 0) {
+        bmp->palette = calloc(256, 4);
+        if (bmp->palette == NULL) {
+            perror("calloc");
+            return 1;
+        }
+        memcpy(bmp->palette, p + 14 + bmp->info.header_size, 4 * bmp_palette_colors(bmp));
+    }
+
+    if (bmp_is_rle(bmp)) {
+        // compressed rows cannot be pointed into
+        bmp->data = bmp_alloc_rows(bmp, bmp->info.height);
+        if (bmp->data == NULL) {
+            free(bmp->palette);
+            return 1;
+        }
+        bmp_rle_decode(bmp, p + bmp->header.bitmap_offset, bmp_rle_size(bmp, size - bmp->header.bitmap_offset));
+        return 0;
+    }
+
+    bmp->data = malloc((bmp->info.height ? bmp->info.height : 1) * sizeof(unsigned char *));
+    if (bmp->data == NULL) {
+        perror("malloc");
+        free(bmp->palette);
+        return 1;
+    }
+    row_size = get_row_size(bmp);
+    for (i = 0; i < bmp->info.height; i++) {
+        bmp->data[bmp->top_down ? bmp->info.height - 1 - i : i] = p + bmp->header.bitmap_offset + (size_t)row_size * i;
+    }
+    return 0;
+}
+
+bmp_t *bmp_map(const char *path, int flags)
+{
+    int fd;
+    struct stat st;
+    unsigned char *map;
+    bmp_t *bmp;
+    BMP_METRIC(0, 0);
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size < 54) {
+        printf("Invalid file format: %s\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    // a private mapping shares the page cache until a page is written to
+    map = mmap(NULL, st.st_size, (flags & BMP_MAP_PRIVATE) ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    bmp = malloc(sizeof(bmp_t));
+    if (bmp == NULL) {
+        perror("malloc");
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    bmp_init(bmp);
+    if (bmp_parse_file(bmp, map, st.st_size, path)) {
+        munmap(map, st.st_size);
+        free(bmp);
+        return NULL;
+    }
+    BMP_METRIC_PIXELS((unsigned long long)bmp->info.width * bmp->info.height);
+    if (bmp_is_rle(bmp)) {
+        // decoded from the mapping, which is dropped afterwards
+        BMP_METRIC_READ(st.st_size);
+        munmap(map, st.st_size);
+        return bmp;
+    }
+    bmp->map = map;
+    bmp->map_size = st.st_size;
+    return bmp;
+}
+
+bmp_t *bmp_load_buffer(unsigned char *buffer, const size_t size, const int flags)
+{
+    unsigned char **rows;
+    unsigned int row_size;
+    unsigned int i;
+    bmp_t *bmp = malloc(sizeof(bmp_t));
+    BMP_METRIC(0, 0);
+
+    if (bmp == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    bmp_init(bmp);
+    if (bmp_parse_file(bmp, buffer, size, "buffer")) {
+        free(bmp);
+        return NULL;
+    }
+    BMP_METRIC_PIXELS((unsigned long long)bmp->info.width * bmp->info.height);
+    if (bmp_is_rle(bmp)) {
+        BMP_METRIC_READ(size);
+        return bmp;
+    }
+    if (!(flags & BMP_BUFFER_COPY)) {
+        // the bitmap never frees what it borrows
+        bmp->map = buffer;
+        bmp->map_size = 0;
+        return bmp;
+    }
+
+    rows = bmp_alloc_rows(bmp, bmp->info.height);
+    if (rows == NULL) {
+        free(bmp->data);
+        free(bmp->palette);
+        free(bmp);
+        return NULL;
+    }
+    row_size = get_row_size(bmp);
+    if (bmp->top_down) {
+        for (i = 0; i < bmp->info.height; i++) {
+            memcpy(rows[i], bmp->data[i], row_size);
+        }
+    } else {
+        memcpy(rows[0], bmp->data[0], (size_t)row_size * bmp->info.height);
+    }
+    free(bmp->data);
+    bmp->data = rows;
+    BMP_METRIC_READ(size);
+    return bmp;
+}
+
+static int bmp_write_header(const bmp_t *bmp, FILE *f)
+{
+    unsigned char header[BMP_HEADER_MAX];
+    unsigned int size = bmp_pack_header(bmp, 0, header);
+
+    if (fwrite(header, 1, size, f) != size) {
+        perror("fwrite");
+        return 1;
+    }
+    BMP_METRIC_WRITTEN(size);
+    return 0;
+}
+
+// writes every byte of iov[0..count), in as few system calls as the kernel allows; retries short writes,
+// which pipes and sockets make, from where they stopped
+static int bmp_writev_all(const int fd, struct iovec *iov, int count)
+{
+    ssize_t written;
+    int batch;
+
+    while (count > 0) {
+        batch = (count < IOV_MAX) ? count : IOV_MAX;
+        written = writev(fd, iov, batch);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written == -1) {
+            perror("writev");
+            return 1;
+        }
+        BMP_METRIC_WRITTEN(written);
+        for (; count > 0 && (size_t)written >= iov->iov_len; iov++, count--) {
+            written -= iov->iov_len;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+int bmp_write_fd(bmp_t *bmp, const int fd)
+{
+    unsigned char header[BMP_HEADER_MAX];
+    struct iovec *iov;
+    unsigned char *rle = NULL;
+    size_t rle_size = 0;
+    unsigned int row_size;
+    unsigned int count = 2;
+    unsigned int i;
+    int err;
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    if (bmp_flush(bmp) == NULL) {
+        return 1;
+    }
+    // info.compression picks the encoding
+    if (bmp_is_rle(bmp)) {
+        rle = bmp_rle_encode(bmp, &rle_size);
+        if (rle == NULL) {
+            return 1;
+        }
+    }
+    row_size = get_row_size(bmp);
+    // rows of a top-down bitmap are not contiguous in file order, they go out as one vector each
+    if (rle == NULL && bmp->top_down) {
+        count = 1 + bmp->info.height;
+    }
+    iov = malloc(count * sizeof(struct iovec));
+    if (iov == NULL) {
+        perror("malloc");
+        free(rle);
+        return 1;
+    }
+
+    // the header block and the pixels in a single call
+    iov[0].iov_base = header;
+    iov[0].iov_len = bmp_pack_header(bmp, rle_size, header);
+    if (rle != NULL) {
+        iov[1].iov_base = rle;
+        iov[1].iov_len = rle_size;
+    } else if (bmp->top_down) {
+        for (i = 0; i < bmp->info.height; i++) {
+            iov[1 + i].iov_base = bmp->data[bmp->info.height - 1 - i];
+            iov[1 + i].iov_len = row_size;
+        }
+    } else {
+        iov[1].iov_base = bmp->data[0];
+        iov[1].iov_len = (size_t)row_size * bmp->info.height;
+    }
+    err = bmp_writev_all(fd, iov, (int)count);
+
+    free(iov);
+    free(rle);
+    return err;
+}
+
+int bmp_write(bmp_t *bmp, const char *path)
+{
+    int fd;
+    int err;
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    // pending operations first, a bitmap that cannot be written then leaves an existing file alone
+    if (bmp_flush(bmp) == NULL) {
+        return 1;
+    }
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        perror("open");
+        return 1;
+    }
+    err = bmp_write_fd(bmp, fd);
+    if (close(fd) == -1) {
+        perror("close");
+        return 1;
+    }
+    return err;
+}
+
+unsigned char *bmp_write_buffer(bmp_t *bmp, size_t *size)
+{
+    unsigned char *buffer;
+    unsigned char *rle = NULL;
+    size_t pixels;
+    unsigned int header_size;
+    unsigned int row_size;
+    unsigned int i;
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    if (bmp_flush(bmp) == NULL) {
+        return NULL;
+    }
+    row_size = get_row_size(bmp);
+    pixels = (size_t)row_size * bmp->info.height;
+    if (bmp_is_rle(bmp)) {
+        rle = bmp_rle_encode(bmp, &pixels);
+        if (rle == NULL) {
+            return NULL;
+        }
+    }
+    buffer = malloc(BMP_HEADER_MAX + pixels);
+    if (buffer == NULL) {
+        perror("malloc");
+        free(rle);
+        return NULL;
+    }
+    BMP_METRIC_ALLOC(BMP_HEADER_MAX + pixels);
+
+    header_size = bmp_pack_header(bmp, pixels, buffer);
+    if (rle != NULL) {
+        memcpy(buffer + header_size, rle, pixels);
+        free(rle);
+    } else if (bmp->top_down) {
+        for (i = 0; i < bmp->info.height; i++) {
+            memcpy(buffer + header_size + (size_t)row_size * i, bmp->data[bmp->info.height - 1 - i], row_size);
+        }
+    } else {
+        memcpy(buffer + header_size, bmp->data[0], pixels);
+    }
+    *size = header_size + pixels;
+    BMP_METRIC_WRITTEN(*size);
+    return buffer;
+}
+
+static void bmp_free_pixels(bmp_t *bmp)
+{
+    if (bmp->map != NULL) {
+        if (bmp->map_size > 0) {
+            munmap(bmp->map, bmp->map_size);
+        }
+        bmp->map = NULL;
+        bmp->map_size = 0;
+    } else {
+        free(bmp->data[0]);
+    }
+    free(bmp->data);
+}
+
+void bmp_destroy(bmp_t *bmp)
+{
+    if (bmp->pipeline != NULL) {
+        free(bmp->pipeline->ops);
+        free(bmp->pipeline->luts);
+        free(bmp->pipeline);
+    }
+    if (bmp->pyramid != NULL) {
+        bmp_pyramid_destroy(bmp->pyramid);
+    }
+    bmp_free_pixels(bmp);
+    free(bmp->palette);
+    free(bmp);
+}
+
+// spare pixel arrays, handed out again to filters working on bitmaps of the same size
+static struct {
+    pthread_mutex_t lock;
+    unsigned char **rows[BMP_SCRATCH_SLOTS];
+    unsigned int row_size[BMP_SCRATCH_SLOTS];
+    unsigned int height[BMP_SCRATCH_SLOTS];
+    unsigned int count;
+} bmp_scratch = { PTHREAD_MUTEX_INITIALIZER, {NULL}, {0}, {0}, 0 };
+
+// a pixel array for bmp's dimensions, taken from the scratch pool when one is spare
+static unsigned char **bmp_acquire_rows(bmp_t *bmp)
+{
+    unsigned char **rows = NULL;
+    unsigned int row_size = get_row_size(bmp);
+    unsigned int i;
+
+    pthread_mutex_lock(&bmp_scratch.lock);
+    for (i = 0; i < bmp_scratch.count; i++) {
+        if (bmp_scratch.row_size[i] == row_size && bmp_scratch.height[i] == bmp->info.height) {
+            rows = bmp_scratch.rows[i];
+            bmp_scratch.count--;
+            bmp_scratch.rows[i] = bmp_scratch.rows[bmp_scratch.count];
+            bmp_scratch.row_size[i] = bmp_scratch.row_size[bmp_scratch.count];
+            bmp_scratch.height[i] = bmp_scratch.height[bmp_scratch.count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&bmp_scratch.lock);
+
+    if (rows == NULL) {
+        rows = bmp_alloc_rows(bmp, bmp->info.height);
+    }
+    return rows;
+}
+
+// gives the pixels of bmp to the scratch pool, or frees them when the pool is full
+static void bmp_recycle_pixels(bmp_t *bmp)
+{
+    if (bmp->map == NULL) {
+        pthread_mutex_lock(&bmp_scratch.lock);
+        if (bmp_scratch.count < BMP_SCRATCH_SLOTS) {
+            bmp_scratch.rows[bmp_scratch.count] = bmp->data;
+            bmp_scratch.row_size[bmp_scratch.count] = get_row_size(bmp);
+            bmp_scratch.height[bmp_scratch.count] = bmp->info.height;
+            bmp_scratch.count++;
+            pthread_mutex_unlock(&bmp_scratch.lock);
+            return;
+        }
+        pthread_mutex_unlock(&bmp_scratch.lock);
+    }
+    bmp_free_pixels(bmp);
+}
+
+int bmp_scratch_reserve(const unsigned int width, const unsigned int height, const unsigned int count)
+{
+    bmp_t bmp;
+    unsigned int i;
+
+    bmp_init(&bmp);
+    bmp.info.width = width;
+    bmp.info.height = height;
+    bmp.info.bits_per_pixel = 24;
+    for (i = 0; i < count; i++) {
+        bmp.data = bmp_alloc_rows(&bmp, height);
+        if (bmp.data == NULL) {
+            return 1;
+        }
+        // touch the pages now rather than on the first filter call
+        memset(bmp.data[0], 0, get_pixel_array_size(&bmp));
+        bmp_recycle_pixels(&bmp);
+    }
+    return 0;
+}
+
+void bmp_scratch_release(void)
+{
+    pthread_mutex_lock(&bmp_scratch.lock);
+    while (bmp_scratch.count > 0) {
+        bmp_scratch.count--;
+        free(bmp_scratch.rows[bmp_scratch.count][0]);
+        free(bmp_scratch.rows[bmp_scratch.count]);
+    }
+    pthread_mutex_unlock(&bmp_scratch.lock);
+}
+
+static unsigned int bmp_wrap_row(long long y, unsigned int height)
+{
+    y %= height;
+    return (unsigned int)(y < 0 ? y + height : y);
+}
+
+bmp_stream_t *bmp_stream_open(const char *path)
+{
+    unsigned char header[54];
+    bmp_stream_t *stream;
+
+    stream = malloc(sizeof(bmp_stream_t));
+    if (stream == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    stream->f = fopen(path, "rb");
+    if (stream->f == NULL) {
+        perror("fopen");
+        free(stream);
+        return NULL;
+    }
+    // check if the file is indeed an uncompressed, bottom-up 24 bit bitmap
+    if (fread(header, 1, sizeof(header), stream->f) != sizeof(header)) {
+        printf("Invalid file format: %s\n", path);
+        fclose(stream->f);
+        free(stream);
+        return NULL;
+    }
+    bmp_parse_header(&stream->image, header);
+    if (stream->image.header.type != 19778 || stream->image.info.bits_per_pixel != 24
+            || stream->image.info.compression != 0 || (int)stream->image.info.height <= 0
+            || bmp_check_size(&stream->image)) {
+        printf("Invalid file format: %s\n", path);
+        fclose(stream->f);
+        free(stream);
+        return NULL;
+    }
+    stream->image.data = NULL;
+    bmp_init(&stream->image);
+    stream->band = NULL;
+    stream->band_data = NULL;
+    stream->capacity = 0;
+    stream->row = 0;
+    return stream;
+}
+
+bmp_t *bmp_stream_read(bmp_stream_t *stream, unsigned int rows, const unsigned int halo)
+{
+    bmp_t *band = stream->band;
+    unsigned int height = stream->image.info.height;
+    unsigned int row_size = get_row_size(&stream->image);
+    long long first;
+    unsigned int total;
+    unsigned int src;
+    unsigned int run;
+    unsigned int i;
+    BMP_METRIC(stream->image.info.width, rows);
+
+    if (stream->row >= height || rows == 0) {
+        return NULL;
+    }
+    if (rows > height - stream->row) {
+        rows = height - stream->row;
+    }
+    total = rows + 2 * halo;
+
+    // a filter may have swapped in a pixel array sized to the band it was handed
+    if (band != NULL && band->data != stream->band_data) {
+        stream->band_data = band->data;
+        stream->capacity = band->info.height;
+    }
+    // the band buffer never shrinks, short bands reuse it
+    if (band == NULL || stream->capacity < total) {
+        if (band != NULL) {
+            bmp_destroy(band);
+            stream->band = NULL;
+        }
+        band = malloc(sizeof(bmp_t));
+        if (band == NULL) {
+            perror("malloc");
+            return NULL;
+        }
+        *band = stream->image;
+        band->data = bmp_alloc_rows(band, total);
+        if (band->data == NULL) {
+            free(band);
+            return NULL;
+        }
+        stream->band = band;
+        stream->band_data = band->data;
+        stream->capacity = total;
+    }
+    band->header = stream->image.header;
+    band->info = stream->image.info;
+    band->info.height = total;
+    band->info.image_size = row_size * total;
+
+    // halo rows wrap around the image edges, the same way the in-memory filters do;
+    // read runs of consecutive file rows with a single seek
+    first = (long long)stream->row - halo;
+    for (i = 0; i < total; i += run) {
+        src = bmp_wrap_row(first + i, height);
+        for (run = 1; i + run < total && bmp_wrap_row(first + i + run, height) == src + run; run++);
+
+        if (fseeko(stream->f, (off_t)stream->image.header.bitmap_offset + (off_t)row_size * src, SEEK_SET) != 0) {
+            perror("fseeko");
+            return NULL;
+        }
+        if (fread(band->data[i], row_size, run, stream->f) != run) {
+            perror("fread");
+            return NULL;
+        }
+        BMP_METRIC_READ((size_t)row_size * run);
+    }
+    stream->row += rows;
+    return band;
+}
+
+bmp_stream_t *bmp_stream_create(const char *path, const bmp_t *bmp, const unsigned int height)
+{
+    bmp_stream_t *stream;
+
+    stream = malloc(sizeof(bmp_stream_t));
+    if (stream == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    stream->image.header = bmp->header;
+    stream->image.info = bmp->info;
+    stream->image.data = NULL;
+    bmp_init(&stream->image);
+    stream->band = NULL;
+    stream->band_data = NULL;
+    stream->capacity = 0;
+    stream->row = 0;
+
+    // only a plain 54 byte header is ever written
+    stream->image.info.header_size = 40;
+    stream->image.info.height = height;
+    stream->image.info.image_size = get_pixel_array_size(&stream->image);
+    stream->image.header.bitmap_offset = 54;
+    stream->image.header.bitmap_size = 54 + stream->image.info.image_size;
+
+    stream->f = fopen(path, "wb");
+    if (stream->f == NULL) {
+        perror("fopen");
+        free(stream);
+        return NULL;
+    }
+    if (bmp_write_header(&stream->image, stream->f)) {
+        fclose(stream->f);
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+int bmp_stream_write(bmp_stream_t *stream, const bmp_t *band, const unsigned int first, const unsigned int rows)
+{
+    unsigned int row_size = get_row_size(&stream->image);
+    unsigned int i;
+    BMP_METRIC(band->info.width, rows);
+
+    assert(band->info.width == stream->image.info.width);
+    assert(first + rows <= band->info.height);
+
+    if (rows > stream->image.info.height - stream->row) {
+        printf("Too many rows written to the stream\n");
+        return 1;
+    }
+    for (i = 0; i < rows; i++) {
+        if (fwrite(band->data[first + i], 1, row_size, stream->f) != row_size) {
+            perror("fwrite");
+            return 1;
+        }
+        BMP_METRIC_WRITTEN(row_size);
+    }
+    stream->row += rows;
+    return 0;
+}
+
+int bmp_stream_close(bmp_stream_t *stream)
+{
+    int err = 0;
+
+    if (stream->band != NULL) {
+        bmp_destroy(stream->band);
+    }
+    if (fclose(stream->f) == EOF) {
+        perror("fclose");
+        err = 1;
+    }
+    free(stream);
+    return err;
+}
+
+int bmp_stream_filter(const char *src, const char *dst, bmp_t *(*filter)(bmp_t *), const unsigned int rows)
+{
+    bmp_stream_t *in;
+    bmp_stream_t *out;
+    bmp_t *band;
+    unsigned int n;
+    int err = 0;
+    BMP_METRIC(0, 0);
+
+    in = bmp_stream_open(src);
+    if (in == NULL) {
+        return 1;
+    }
+    out = bmp_stream_create(dst, &in->image, in->image.info.height);
+    if (out == NULL) {
+        bmp_stream_close(in);
+        return 1;
+    }
+    // one halo row above and below is all a 3x3 filter looks at
+    while (!err && (band = bmp_stream_read(in, rows, 1)) != NULL) {
+        n = band->info.height - 2;
+        if (filter(band) == NULL) {
+            err = 1;
+            break;
+        }
+        err = bmp_stream_write(out, band, 1, n);
+    }
+    if (in->row < in->image.info.height) {
+        err = 1;
+    }
+    err |= bmp_stream_close(in);
+    err |= bmp_stream_close(out);
+    return err;
+}
+
+// callback processing rows [y0, y1) of a job
+typedef void (*bmp_rows_fn)(void *job, unsigned int y0, unsigned int y1);
+
+// arguments of a row-band job
+typedef struct {
+    bmp_t *bmp;
+    const bmp_t *other;
+    int arg;
+    int arg2;
+    unsigned char **out;
+    const void *params;
+} bmp_job_t;
+
+// bands of one participant: the owner takes them from the front, thieves from the back
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned int next;
+    unsigned int end;
+} bmp_queue_t;
+
+static struct {
+    pthread_mutex_t lock;                  // guards generation, pending and quit
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    pthread_mutex_t busy;                  // held while a job runs; one job at a time
+    pthread_t *workers;
+    bmp_queue_t *queues;
+    unsigned int threads;                  // participants, the calling thread included
+    unsigned int generation;
+    unsigned int spawned;                  // generation current when the workers were started
+    unsigned int pending;                  // workers that have not finished the current job
+    int quit;
+    bmp_rows_fn fn;
+    void *job;
+    unsigned int height;
+    unsigned int band_rows;
+} bmp_pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    NULL, NULL, 1, 0, 0, 0, 0, NULL, NULL, 0, 0
+};
+
+// set on threads that are inside a job, nested calls then run serially
+static __thread int bmp_in_job;
+
+static int bmp_take_band(const unsigned int self, unsigned int *band)
+{
+    bmp_queue_t *q;
+    unsigned int k;
+
+    q = &bmp_pool.queues[self];
+    pthread_mutex_lock(&q->lock);
+    if (q->next < q->end) {
+        *band = q->next++;
+        pthread_mutex_unlock(&q->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    // own bands are done, steal from the back of somebody else's
+    for (k = 1; k < bmp_pool.threads; k++) {
+        q = &bmp_pool.queues[(self + k) % bmp_pool.threads];
+        pthread_mutex_lock(&q->lock);
+        if (q->next < q->end) {
+            *band = --q->end;
+            pthread_mutex_unlock(&q->lock);
+            return 1;
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+    return 0;
+}
+
+static void bmp_run_bands(const unsigned int self)
+{
+    unsigned int band;
+    unsigned int y0;
+    unsigned int y1;
+
+    bmp_in_job = 1;
+    while (bmp_take_band(self, &band)) {
+        y0 = band * bmp_pool.band_rows;
+        y1 = (bmp_pool.height - y0 < bmp_pool.band_rows) ? bmp_pool.height : y0 + bmp_pool.band_rows;
+        bmp_pool.fn(bmp_pool.job, y0, y1);
+    }
+    bmp_in_job = 0;
+}
+
+static void *bmp_worker(void *arg)
+{
+    unsigned int self = (unsigned int)(size_t)arg;
+    unsigned int seen;
+
+    // a job may already be posted by the time this thread runs, so it must not read generation itself
+    pthread_mutex_lock(&bmp_pool.lock);
+    seen = bmp_pool.spawned;
+    for (;;) {
+        while (!bmp_pool.quit && bmp_pool.generation == seen) {
+            pthread_cond_wait(&bmp_pool.wake, &bmp_pool.lock);
+        }
+        if (bmp_pool.quit) {
+            break;
+        }
+        seen = bmp_pool.generation;
+        pthread_mutex_unlock(&bmp_pool.lock);
+
+        BMP_METRIC_JOIN();
+        bmp_run_bands(self);
+        BMP_METRIC_LEAVE();
+
+        pthread_mutex_lock(&bmp_pool.lock);
+        if (--bmp_pool.pending == 0) {
+            pthread_cond_signal(&bmp_pool.idle);
+        }
+    }
+    pthread_mutex_unlock(&bmp_pool.lock);
+    return NULL;
+}
+
+static void bmp_stop_threads(void)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&bmp_pool.lock);
+    bmp_pool.quit = 1;
+    pthread_cond_broadcast(&bmp_pool.wake);
+    pthread_mutex_unlock(&bmp_pool.lock);
+    for (i = 1; i < bmp_pool.threads; i++) {
+        pthread_join(bmp_pool.workers[i], NULL);
+    }
+    for (i = 0; i < bmp_pool.threads; i++) {
+        pthread_mutex_destroy(&bmp_pool.queues[i].lock);
+    }
+    free(bmp_pool.workers);
+    free(bmp_pool.queues);
+    bmp_pool.workers = NULL;
+    bmp_pool.queues = NULL;
+    bmp_pool.threads = 1;
+    bmp_pool.quit = 0;
+}
+
+int bmp_set_threads(unsigned int threads)
+{
+    unsigned int i;
+    long cores;
+
+    if (threads == 0) {
+        cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cores > 0) ? (unsigned int)cores : 1;
+    }
+
+    pthread_mutex_lock(&bmp_pool.busy);
+    if (bmp_pool.threads > 1) {
+        bmp_stop_threads();
+    }
+    if (threads > 1) {
+        bmp_pool.workers = malloc(threads * sizeof(pthread_t));
+        bmp_pool.queues = malloc(threads * sizeof(bmp_queue_t));
+        if (bmp_pool.workers == NULL || bmp_pool.queues == NULL) {
+            perror("malloc");
+            free(bmp_pool.workers);
+            free(bmp_pool.queues);
+            bmp_pool.workers = NULL;
+            bmp_pool.queues = NULL;
+            pthread_mutex_unlock(&bmp_pool.busy);
+            return 1;
+        }
+        for (i = 0; i < threads; i++) {
+            pthread_mutex_init(&bmp_pool.queues[i].lock, NULL);
+        }
+        bmp_pool.spawned = bmp_pool.generation;
+        // slot 0 is the thread calling bmp_parallel_rows()
+        for (i = 1; i < threads; i++) {
+            if (pthread_create(&bmp_pool.workers[i], NULL, bmp_worker, (void *)(size_t)i) != 0) {
+                perror("pthread_create");
+                break;
+            }
+            bmp_pool.threads = i + 1;
+        }
+        if (bmp_pool.threads < threads) {
+            // keep the queues in step with the threads that did start
+            for (; i < threads; i++) {
+                pthread_mutex_destroy(&bmp_pool.queues[i].lock);
+            }
+        }
+        if (bmp_pool.threads == 1) {
+            // no worker started: run single threaded, as bmp_stop_threads() leaves the pool
+            pthread_mutex_destroy(&bmp_pool.queues[0].lock);
+            free(bmp_pool.workers);
+            free(bmp_pool.queues);
+            bmp_pool.workers = NULL;
+            bmp_pool.queues = NULL;
+        }
+    }
+    pthread_mutex_unlock(&bmp_pool.busy);
+    return bmp_pool.threads != threads;
+}
+
+unsigned int bmp_get_threads(void)
+{
+    return bmp_pool.threads;
+}
+
+// runs fn over rows [0, height), split into bands across the pool when parallel mode is on
+static void bmp_parallel_rows(const unsigned int height, bmp_rows_fn fn, void *job)
+{
+    unsigned int bands;
+    unsigned int threads;
+    unsigned int i;
+
+    threads = bmp_pool.threads;
+    if (threads <= 1 || bmp_in_job || height < 2 * threads) {
+        fn(job, 0, height);
+        return;
+    }
+    // another thread owns the pool: running serially beats waiting for it
+    if (pthread_mutex_trylock(&bmp_pool.busy) != 0) {
+        fn(job, 0, height);
+        return;
+    }
+    threads = bmp_pool.threads;
+
+    // several bands per thread so that stealing can even out uneven bands
+    bmp_pool.band_rows = height / (threads * 8);
+    if (bmp_pool.band_rows < 4) {
+        bmp_pool.band_rows = 4;
+    }
+    bands = (height + bmp_pool.band_rows - 1) / bmp_pool.band_rows;
+    for (i = 0; i < threads; i++) {
+        bmp_pool.queues[i].next = (unsigned int)((unsigned long long)bands * i / threads);
+        bmp_pool.queues[i].end = (unsigned int)((unsigned long long)bands * (i + 1) / threads);
+    }
+    bmp_pool.fn = fn;
+    bmp_pool.job = job;
+    bmp_pool.height = height;
+    BMP_METRIC_SHARE();
+
+    pthread_mutex_lock(&bmp_pool.lock);
+    bmp_pool.pending = threads - 1;
+    bmp_pool.generation++;
+    pthread_cond_broadcast(&bmp_pool.wake);
+    pthread_mutex_unlock(&bmp_pool.lock);
+
+    bmp_run_bands(0);
+
+    pthread_mutex_lock(&bmp_pool.lock);
+    while (bmp_pool.pending > 0) {
+        pthread_cond_wait(&bmp_pool.idle, &bmp_pool.lock);
+    }
+    pthread_mutex_unlock(&bmp_pool.lock);
+    pthread_mutex_unlock(&bmp_pool.busy);
+}
+
+// decodes a BI_RLE8 or BI_RLE4 stream into the 8 bit index rows of bmp; pixels skipped by delta
+// and end-of-line codes or missing from a truncated stream are left at index 0
+static void bmp_rle_decode(bmp_t *bmp, const unsigned char *src, size_t size)
+{
+    const unsigned char *end = src + size;
+    unsigned int width = bmp->info.width;
+    int rle4 = (bmp->info.compression == BMP_BI_RLE4);
+    unsigned char *row;
+    unsigned int room;
+    unsigned int count;
+    unsigned int bytes;
+    unsigned int x = 0;
+    unsigned int y = 0;
+    unsigned int i;
+
+    memset(bmp->data[0], 0, (size_t)bmp_pixel_array_size64(bmp));
+    while (y < bmp->info.height && end - src >= 2) {
+        row = bmp->data[y];
+        room = width - x;
+        if (src[0] > 0) {
+            // encoded mode: one index repeated, for RLE4 two alternating ones
+            count = (src[0] < room) ? src[0] : room;
+            if (!rle4 || (src[1] >> 4) == (src[1] & 15)) {
+                memset(row + x, rle4 ? src[1] & 15 : src[1], count);
+            } else {
+                for (i = 0; i < count; i++) {
+                    row[x + i] = (i & 1) ? src[1] & 15 : src[1] >> 4;
+                }
+            }
+            x += count;
+            src += 2;
+        } else if (src[1] == 0) {
+            // end of line
+            x = 0;
+            y++;
+            src += 2;
+        } else if (src[1] == 1) {
+            // end of bitmap
+            break;
+        } else if (src[1] == 2) {
+            // delta: skip right and up
+            if (end - src < 4) {
+                break;
+            }
+            x = (src[2] < room) ? x + src[2] : width;
+            y += src[3];
+            src += 4;
+        } else {
+            // absolute mode: literal indices, padded to a 16 bit boundary
+            bytes = rle4 ? (src[1] + 1u) / 2 : src[1];
+            count = (src[1] < room) ? src[1] : room;
+            src += 2;
+            if ((size_t)(end - src) < bytes) {
+                break;
+            }
+            if (rle4) {
+                for (i = 0; i < count; i++) {
+                    row[x + i] = (i & 1) ? src[i / 2] & 15 : src[i / 2] >> 4;
+                }
+            } else {
+                memcpy(row + x, src, count);
+            }
+            x += count;
+            src += bytes;
+            if ((bytes & 1) && src < end) {
+                src++;
+            }
+        }
+    }
+}
+
+// whether a run worth an encoded pair starts at p[i]: three equal indices, or with period 2 (RLE4)
+// two pairs of the same alternating indices
+static int bmp_rle_run_at(const unsigned char *p, const unsigned int i, const unsigned int width,
+        const unsigned int period)
+{
+    return i + period + 1 < width && p[i] == p[i + period] && p[i + 1] == p[i + 1 + period];
+}
+
+// whether there is a run anywhere in the row; noisy rows fail this quickly and go out as literals
+static int bmp_rle_has_runs(const unsigned char *p, const unsigned int width, const unsigned int period)
+{
+    unsigned int i = 0;
+#ifdef __SSE2__
+    unsigned int m;
+
+    if (i + 16 + period <= width) {
+        BMP_METRIC_SIMD();
+    }
+    // bit j compares p[i + j] with p[i + j + period]; two neighbouring bits make a run at i + j
+    for (; i + 16 + period <= width; i += 15) {
+        m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)),
+                    _mm_loadu_si128((const __m128i *)(p + i + period))));
+        if (m & (m >> 1)) {
+            return 1;
+        }
+    }
+#endif
+    for (; i < width; i++) {
+        if (bmp_rle_run_at(p, i, width, period)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// encodes one row of indices followed by an end of line, at most 2 * width + 2 bytes;
+// returns the bytes written, or 0 if an index does not fit in RLE4
+static size_t bmp_rle_encode_row(const unsigned char *p, const unsigned int width, const int rle4, unsigned char *out)
+{
+    unsigned int period = rle4 ? 2 : 1;
+    unsigned char *o = out;
+    unsigned int x;
+    unsigned int n;
+    unsigned int i;
+    int runs;
+
+    if (rle4) {
+        for (x = 0; x < width; x++) {
+            if (p[x] > 15) {
+                return 0;
+            }
+        }
+    }
+    runs = bmp_rle_has_runs(p, width, period);
+    for (x = 0; x < width; x += n) {
+        n = 1;
+        if ((runs && bmp_rle_run_at(p, x, width, period)) || width - x < 3) {
+            // encoded mode for as long as the run (or the row's last pixels) lasts
+            while (x + n < width && n < 255 && p[x + n] == p[x + n % period]) {
+                n++;
+            }
+            *o++ = (unsigned char)n;
+            *o++ = rle4 ? (unsigned char)(p[x] << 4 | (n > 1 ? p[x + 1] : 0)) : p[x];
+            continue;
+        }
+        // literals up to the next run
+        while (x + n < width && n < 255 && !(runs && bmp_rle_run_at(p, x + n, width, period))) {
+            n++;
+        }
+        if (n < 3) {
+            // absolute mode needs at least 3 pixels
+            if (rle4) {
+                *o++ = (unsigned char)n;
+                *o++ = (unsigned char)(p[x] << 4 | (n > 1 ? p[x + 1] : 0));
+            } else {
+                for (i = 0; i < n; i++) {
+                    *o++ = 1;
+                    *o++ = p[x + i];
+                }
+            }
+            continue;
+        }
+        *o++ = 0;
+        *o++ = (unsigned char)n;
+        if (rle4) {
+            for (i = 0; i < n; i += 2) {
+                *o++ = (unsigned char)(p[x + i] << 4 | (i + 1 < n ? p[x + i + 1] : 0));
+            }
+        } else {
+            memcpy(o, p + x, n);
+            o += n;
+        }
+        // everything before is whole 16 bit words
+        if ((o - out) & 1) {
+            *o++ = 0;
+        }
+    }
+    *o++ = 0;
+    *o++ = 0;
+    return o - out;
+}
+
+// rows encoded independently, each into its own worst-case sized slot
+typedef struct {
+    bmp_t *bmp;
+    unsigned char *out;                    // row y starts at out + y * bound
+    size_t bound;
+    size_t *length;
+} bmp_rle_job_t;
+
+static void bmp_rle_encode_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_rle_job_t *job = ctx;
+    unsigned int y;
+
+    for (y = y0; y < y1; y++) {
+        job->length[y] = bmp_rle_encode_row(job->bmp->data[y], job->bmp->info.width,
+                job->bmp->info.compression == BMP_BI_RLE4, job->out + y * job->bound);
+    }
+}
+
+// run-length encodes the pixels as info.compression (BI_RLE8 or BI_RLE4) says;
+// returns the stream, to be freed by the caller, with its size in *size
+static unsigned char *bmp_rle_encode(bmp_t *bmp, size_t *size)
+{
+    bmp_rle_job_t job;
+    unsigned int height = bmp->info.height;
+    size_t at = 0;
+    unsigned int y;
+
+    if (bmp->info.bits_per_pixel != 8) {
+        printf("Unsupported pixel format: %u bits per pixel, run-length encoding needs 8 bit indices\n",
+                bmp->info.bits_per_pixel);
+        return NULL;
+    }
+    job.bmp = bmp;
+    job.bound = 2 * (size_t)bmp->info.width + 2;
+    // the slots are twice the pixel array, which may not fit a 32 bit size_t
+    if (height > 0 && job.bound > (SIZE_MAX - 2) / height) {
+        printf("Invalid size: %ux%u\n", bmp->info.width, height);
+        return NULL;
+    }
+    job.out = malloc(job.bound * height + 2);
+    job.length = malloc((height ? height : 1) * sizeof(size_t));
+    if (job.out == NULL || job.length == NULL) {
+        perror("malloc");
+        free(job.out);
+        free(job.length);
+        return NULL;
+    }
+    BMP_METRIC_ALLOC(job.bound * height);
+    bmp_parallel_rows(height, bmp_rle_encode_rows, &job);
+
+    // slots are packed down in order, so a row never moves over one still to come
+    for (y = 0; y < height; y++) {
+        if (job.length[y] == 0) {
+            printf("Unsupported pixel format: RLE4 needs indices below 16\n");
+            free(job.out);
+            free(job.length);
+            return NULL;
+        }
+        memmove(job.out + at, job.out + y * job.bound, job.length[y]);
+        at += job.length[y];
+    }
+    free(job.length);
+    // the last end of line becomes the end of bitmap
+    if (at == 0) {
+        job.out[0] = 0;
+        at = 2;
+    }
+    job.out[at - 1] = 1;
+    // the stream length goes into the 32 bit image and file size fields
+    if (at > UINT_MAX - 54 - bmp_extras_size(bmp)) {
+        printf("Invalid size: %zu bytes of run-length encoded pixels\n", at);
+        free(job.out);
+        return NULL;
+    }
+
+    *size = at;
+    return job.out;
+}
+
+// a file transfer split into BMP_IO_CHUNK sized pieces for bmp_parallel_rows()
+typedef struct {
+    int fd;
+    unsigned char *buf;                    // memory of the first byte of the transfer
+    off_t offset;                          // file offset of the first byte
+    size_t size;
+    size_t limit;                          // end of the real data; direct writes pad the last block past it
+    const unsigned char *header;           // packed header, prepended by direct writes
+    size_t header_size;
+    pthread_mutex_t lock;
+    int failed;
+} bmp_io_t;
+
+static void bmp_io_fail(bmp_io_t *io, const char *what)
+{
+    pthread_mutex_lock(&io->lock);
+    if (!io->failed) {
+        perror(what);
+    }
+    io->failed = 1;
+    pthread_mutex_unlock(&io->lock);
+}
+
+static void bmp_io_read_chunks(void *ctx, unsigned int c0, unsigned int c1)
+{
+    bmp_job_t *job = ctx;
+    bmp_io_t *io = (bmp_io_t *)job->params;
+    size_t start = (size_t)c0 * BMP_IO_CHUNK;
+    size_t end = (size_t)c1 * BMP_IO_CHUNK;
+    ssize_t n;
+
+    if (end > io->size) {
+        end = io->size;
+    }
+    while (start < end) {
+        n = pread(io->fd, io->buf + start, end - start, io->offset + start);
+        if (n <= 0) {
+            // a direct read of the last block stops at the end of the file
+            if (n == 0 && job->arg) {
+                break;
+            }
+            bmp_io_fail(io, "pread");
+            return;
+        }
+        BMP_METRIC_READ(n);
+        start += n;
+    }
+}
+
+static void bmp_io_write_chunks(void *ctx, unsigned int c0, unsigned int c1)
+{
+    bmp_job_t *job = ctx;
+    bmp_io_t *io = (bmp_io_t *)job->params;
+    size_t start = (size_t)c0 * BMP_IO_CHUNK;
+    size_t end = (size_t)c1 * BMP_IO_CHUNK;
+    unsigned char *bounce = NULL;
+    const unsigned char *src;
+    size_t len;
+    size_t at;
+    size_t n;
+    ssize_t w;
+
+    if (end > io->size) {
+        end = io->size;
+    }
+    // direct writes need aligned memory, so the chunk is staged in a bounce buffer laid out like the file
+    if (job->arg && posix_memalign((void **)&bounce, BMP_IO_ALIGN, BMP_IO_CHUNK) != 0) {
+        bmp_io_fail(io, "posix_memalign");
+        return;
+    }
+    for (; start < end; start += len) {
+        len = (end - start < BMP_IO_CHUNK) ? end - start : BMP_IO_CHUNK;
+        src = io->buf + start;
+        if (bounce != NULL) {
+            at = 0;
+            if (start < io->header_size) {
+                at = (io->header_size - start < len) ? io->header_size - start : len;
+                memcpy(bounce, io->header + start, at);
+            }
+            if (start + at < io->limit) {
+                n = (io->limit - (start + at) < len - at) ? io->limit - (start + at) : len - at;
+                memcpy(bounce + at, io->buf + (start + at - io->header_size), n);
+                at += n;
+            }
+            // padding up to the block size, cut off again by ftruncate()
+            memset(bounce + at, 0, len - at);
+            src = bounce;
+        }
+        for (at = 0; at < len; at += w) {
+            w = pwrite(io->fd, src + at, len - at, io->offset + start + at);
+            if (w <= 0) {
+                bmp_io_fail(io, "pwrite");
+                free(bounce);
+                return;
+            }
+            BMP_METRIC_WRITTEN(w);
+        }
+    }
+    free(bounce);
+}
+
+// rows of a top-down bitmap, each written to its mirrored place in the file
+static void bmp_io_write_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_job_t *job = ctx;
+    bmp_io_t *io = (bmp_io_t *)job->params;
+    unsigned int row_size = get_row_size(job->bmp);
+    unsigned int y;
+
+    for (y = y0; y < y1; y++) {
+        if (pwrite(io->fd, job->bmp->data[y], row_size,
+                    io->offset + (off_t)row_size * (job->bmp->info.height - 1 - y)) != (ssize_t)row_size) {
+            bmp_io_fail(io, "pwrite");
+            return;
+        }
+        BMP_METRIC_WRITTEN(row_size);
+    }
+}
+
+// swaps row y with its mirror image for the lower half of a freshly read top-down bitmap
+static void bmp_io_flip_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_job_t *job = ctx;
+    unsigned int row_size = get_row_size(job->bmp);
+    unsigned char *a;
+    unsigned char *b;
+    unsigned char t;
+    unsigned int x;
+    unsigned int y;
+
+    for (y = y0; y < y1; y++) {
+        a = job->bmp->data[y];
+        b = job->bmp->data[job->bmp->info.height - 1 - y];
+        for (x = 0; x < row_size; x++) {
+            t = a[x];
+            a[x] = b[x];
+            b[x] = t;
+        }
+    }
+}
+
+// opens with O_DIRECT when asked and supported; *direct tells which one happened
+static int bmp_io_open(const char *path, const int oflags, const int flags, int *direct)
+{
+    int fd = -1;
+
+    *direct = 0;
+#ifdef O_DIRECT
+    if (flags & BMP_IO_DIRECT) {
+        fd = open(path, oflags | O_DIRECT, 0644);
+        *direct = (fd != -1);
+    }
+#else
+    (void)flags;
+#endif
+    if (fd == -1) {
+        fd = open(path, oflags, 0644);
+    }
+    if (fd == -1) {
+        perror("open");
+    }
+    return fd;
+}
+
+bmp_t *bmp_load_parallel(const char *path, const int flags)
+{
+    bmp_t *bmp;
+    bmp_io_t io;
+    bmp_job_t job = { NULL, NULL, 0, 0, NULL, NULL };
+    unsigned char *head;
+    unsigned char *block;
+    struct stat st;
+    size_t pixels;
+    size_t span;
+    unsigned int row_size;
+    unsigned int i;
+    int direct;
+    int fd;
+    BMP_METRIC(0, 0);
+
+    fd = bmp_io_open(path, O_RDONLY, flags, &direct);
+    if (fd == -1) {
+        return NULL;
+    }
+    // every header, extended ones included, comes in with the first block
+    if (posix_memalign((void **)&head, BMP_IO_ALIGN, BMP_IO_ALIGN) != 0) {
+        perror("posix_memalign");
+        close(fd);
+        return NULL;
+    }
+    bmp = malloc(sizeof(bmp_t));
+    if (bmp == NULL || fstat(fd, &st) == -1 || pread(fd, head, BMP_IO_ALIGN, 0) < 54) {
+        perror("pread");
+        free(head);
+        free(bmp);
+        close(fd);
+        return NULL;
+    }
+    bmp_init(bmp);
+    bmp_parse_header(bmp, head);
+
+    if (bmp_check_format(bmp, head + 54, path)) {
+        free(head);
+        free(bmp);
+        close(fd);
+        return NULL;
+    }
+    pixels = get_pixel_array_size(bmp);
+    if (bmp_is_rle(bmp) && bmp->header.bitmap_offset <= (size_t)st.st_size) {
+        pixels = bmp_rle_size(bmp, (size_t)st.st_size - bmp->header.bitmap_offset);
+    }
+    if (bmp->header.bitmap_offset > (size_t)st.st_size
+            || pixels > (size_t)st.st_size - bmp->header.bitmap_offset
+            || 14ull + bmp->info.header_size + 4 * bmp_palette_colors(bmp) > BMP_IO_ALIGN) {
+        printf("Invalid file format: %s\n", path);
+        free(head);
+        free(bmp);
+        close(fd);
+        return NULL;
+    }
+    if (bmp_palette_colors(bmp) > 0) {
+        bmp->palette = calloc(256, 4);
+        if (bmp->palette != NULL) {
+            memcpy(bmp->palette, head + 14 + bmp->info.header_size, 4 * bmp_palette_colors(bmp));
+        }
+    }
+    free(head);
+
+    bmp->data = malloc((bmp->info.height ? bmp->info.height : 1) * sizeof(unsigned char *));
+    if (bmp->data == NULL || (bmp_palette_colors(bmp) > 0 && bmp->palette == NULL)) {
+        perror("malloc");
+        free(bmp->data);
+        free(bmp->palette);
+        free(bmp);
+        close(fd);
+        return NULL;
+    }
+    // direct reads must start on a block boundary, so the headers are read again and cut off afterwards
+    span = direct ? (bmp->header.bitmap_offset + pixels + BMP_IO_ALIGN - 1) / BMP_IO_ALIGN * BMP_IO_ALIGN : pixels;
+    if (posix_memalign((void **)&block, BMP_IO_ALIGN, span + 1) != 0) {
+        perror("posix_memalign");
+        free(bmp->data);
+        free(bmp->palette);
+        free(bmp);
+        close(fd);
+        return NULL;
+    }
+    BMP_METRIC_ALLOC(span);
+
+    io.fd = fd;
+    io.buf = block;
+    io.offset = direct ? 0 : bmp->header.bitmap_offset;
+    io.size = span;
+    io.limit = span;
+    io.header = NULL;
+    io.header_size = 0;
+    io.failed = 0;
+    pthread_mutex_init(&io.lock, NULL);
+    job.arg = direct;
+    job.params = &io;
+    bmp_parallel_rows((unsigned int)((span + BMP_IO_CHUNK - 1) / BMP_IO_CHUNK), bmp_io_read_chunks, &job);
+    pthread_mutex_destroy(&io.lock);
+    close(fd);
+
+    if (io.failed) {
+        free(block);
+        free(bmp->data);
+        free(bmp->palette);
+        free(bmp);
+        return NULL;
+    }
+    BMP_METRIC_PIXELS((unsigned long long)bmp->info.width * bmp->info.height);
+    if (bmp_is_rle(bmp)) {
+        // the compressed stream came in parallel; decoding it is sequential
+        free(bmp->data);
+        bmp->data = bmp_alloc_rows(bmp, bmp->info.height);
+        if (bmp->data != NULL) {
+            bmp_rle_decode(bmp, block + (direct ? bmp->header.bitmap_offset : 0), pixels);
+        }
+        free(block);
+        if (bmp->data == NULL) {
+            free(bmp->palette);
+            free(bmp);
+            return NULL;
+        }
+        return bmp;
+    }
+    if (direct) {
+        memmove(block, block + bmp->header.bitmap_offset, pixels);
+    }
+    row_size = get_row_size(bmp);
+    for (i = 0; i < bmp->info.height; i++) {
+        bmp->data[i] = block + (size_t)row_size * i;
+    }
+    if (bmp->top_down) {
+        job.bmp = bmp;
+        bmp_parallel_rows(bmp->info.height / 2, bmp_io_flip_rows, &job);
+    }
+    return bmp;
+}
+
+// rows of a region per read task, and the widest gap between the spans of neighbouring rows that is read through
+// rather than skipped with a separate read
+#ifndef BMP_REGION_GAP
+#define BMP_REGION_GAP 8192
+#endif
+
+// reads the spans of output rows [b0, b1) bands of job->arg2 rows at a time; io->offset is the file offset of
+// output row 0's span, io->limit the file row size and io->size the span length, job->arg is set for top-down files
+static void bmp_io_read_region(void *ctx, unsigned int b0, unsigned int b1)
+{
+    bmp_job_t *job = ctx;
+    bmp_io_t *io = (bmp_io_t *)job->params;
+    bmp_t *bmp = job->bmp;
+    unsigned char *stage = NULL;
+    unsigned char *dst;
+    unsigned int rows = (unsigned int)job->arg2;
+    unsigned int j0;
+    unsigned int j1;
+    unsigned int j;
+    off_t first;
+    off_t at;
+    size_t size;
+    size_t done;
+    ssize_t n;
+
+    for (; b0 < b1; b0++) {
+        j0 = b0 * rows;
+        j1 = (j0 + rows < bmp->info.height) ? j0 + rows : bmp->info.height;
+        // file rows run the other way in top-down files, so the band starts at its last output row
+        first = io->offset + (off_t)io->limit * (job->arg ? -(off_t)(j1 - 1) : (off_t)j0);
+        if (io->limit - io->size > BMP_REGION_GAP) {
+            for (j = j0; j < j1; j++) {
+                at = io->offset + (off_t)io->limit * (job->arg ? -(off_t)j : (off_t)j);
+                for (done = 0; done < io->size; done += n) {
+                    n = pread(io->fd, bmp->data[j] + done, io->size - done, at + done);
+                    if (n <= 0) {
+                        bmp_io_fail(io, "pread");
+                        free(stage);
+                        return;
+                    }
+                    BMP_METRIC_READ(n);
+                }
+            }
+            continue;
+        }
+        // one read for the whole band; whole bottom-up rows land in place, anything else goes through a buffer
+        size = (size_t)io->limit * (j1 - j0 - 1) + io->size;
+        dst = (!job->arg && io->size == io->limit) ? bmp->data[j0] : NULL;
+        if (dst == NULL) {
+            if (stage == NULL) {
+                stage = malloc((size_t)io->limit * rows);
+            }
+            if (stage == NULL) {
+                bmp_io_fail(io, "malloc");
+                return;
+            }
+            dst = stage;
+        }
+        for (done = 0; done < size; done += n) {
+            n = pread(io->fd, dst + done, size - done, first + done);
+            if (n <= 0) {
+                bmp_io_fail(io, "pread");
+                free(stage);
+                return;
+            }
+            BMP_METRIC_READ(n);
+        }
+        if (dst == stage) {
+            for (j = j0; j < j1; j++) {
+                memcpy(bmp->data[j], stage + (size_t)io->limit * (job->arg ? j1 - 1 - j : j - j0), io->size);
+            }
+        }
+    }
+    free(stage);
+}
+
+bmp_t *bmp_load_region(const char *path, const unsigned int x, const unsigned int y, const unsigned int width,
+        const unsigned int height)
+{
+    bmp_t *bmp;
+    bmp_t *whole;
+    bmp_io_t io;
+    bmp_job_t job = { NULL, NULL, 0, 0, NULL, NULL };
+    unsigned char head[BMP_HEADER_MAX];
+    struct stat st;
+    unsigned int file_row;
+    unsigned int step;
+    unsigned int rows;
+    unsigned int j;
+    int fd;
+    BMP_METRIC(width, height);
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return NULL;
+    }
+    memset(head, 0, sizeof(head));
+    bmp = malloc(sizeof(bmp_t));
+    if (bmp == NULL || fstat(fd, &st) == -1 || pread(fd, head, sizeof(head), 0) < 54) {
+        perror("pread");
+        free(bmp);
+        close(fd);
+        return NULL;
+    }
+    bmp_init(bmp);
+    bmp_parse_header(bmp, head);
+    if (bmp_check_format(bmp, head + 54, path)) {
+        free(bmp);
+        close(fd);
+        return NULL;
+    }
+    if (x >= bmp->info.width || y >= bmp->info.height || width == 0 || height == 0
+            || width > bmp->info.width - x || height > bmp->info.height - y) {
+        printf("Invalid region: %ux%u at (%u, %u) of %ux%u\n", width, height, x, y, bmp->info.width,
+                bmp->info.height);
+        free(bmp);
+        close(fd);
+        return NULL;
+    }
+    // run-length streams cannot be indexed by row, so they are decoded whole and the region copied out
+    if (bmp_is_rle(bmp)) {
+        free(bmp);
+        close(fd);
+        whole = bmp_load_parallel(path, 0);
+        if (whole == NULL) {
+            return NULL;
+        }
+        bmp = malloc(sizeof(bmp_t));
+        if (bmp == NULL) {
+            perror("malloc");
+            bmp_destroy(whole);
+            return NULL;
+        }
+        *bmp = *whole;
+        bmp->info.width = width;
+        bmp->info.height = height;
+        bmp->data = bmp_alloc_rows(bmp, height);
+        if (bmp->data == NULL) {
+            free(bmp);
+            bmp_destroy(whole);
+            return NULL;
+        }
+        memset(bmp->data[0], 0, get_pixel_array_size(bmp));
+        for (j = 0; j < height; j++) {
+            memcpy(bmp->data[j], whole->data[y + j] + x, width);
+        }
+        whole->palette = NULL;
+        bmp_destroy(whole);
+        bmp_normalize_header(bmp);
+        return bmp;
+    }
+    file_row = get_row_size(bmp);
+    if (bmp->header.bitmap_offset > (size_t)st.st_size
+            || (off_t)file_row * bmp->info.height > (off_t)st.st_size - bmp->header.bitmap_offset
+            || 14ull + bmp->info.header_size + 4 * bmp_palette_colors(bmp) > sizeof(head)) {
+        printf("Invalid file format: %s\n", path);
+        free(bmp);
+        close(fd);
+        return NULL;
+    }
+    if (bmp_palette_colors(bmp) > 0) {
+        bmp->palette = calloc(256, 4);
+        if (bmp->palette == NULL) {
+            perror("calloc");
+            free(bmp);
+            close(fd);
+            return NULL;
+        }
+        memcpy(bmp->palette, head + 14 + bmp->info.header_size, 4 * bmp_palette_colors(bmp));
+    }
+
+    io.fd = fd;
+    io.buf = NULL;
+    step = bmp->info.bits_per_pixel / 8;
+    io.offset = bmp->header.bitmap_offset + (off_t)step * x
+            + (off_t)file_row * (bmp->top_down ? bmp->info.height - 1 - y : y);
+    io.limit = file_row;
+    io.size = (size_t)step * width;
+    io.header = NULL;
+    io.header_size = 0;
+    io.failed = 0;
+    bmp->info.width = width;
+    bmp->info.height = height;
+    bmp->data = bmp_alloc_rows(bmp, height);
+    if (bmp->data == NULL) {
+        free(bmp->palette);
+        free(bmp);
+        close(fd);
+        return NULL;
+    }
+    // row padding is not read from the file
+    memset(bmp->data[0], 0, get_pixel_array_size(bmp));
+    rows = BMP_IO_CHUNK / file_row;
+    rows = (rows > 0) ? rows : 1;
+
+    pthread_mutex_init(&io.lock, NULL);
+    job.bmp = bmp;
+    job.arg = bmp->top_down;
+    job.arg2 = (int)rows;
+    job.params = &io;
+    bmp_parallel_rows((height + rows - 1) / rows, bmp_io_read_region, &job);
+    pthread_mutex_destroy(&io.lock);
+    close(fd);
+
+    if (io.failed) {
+        bmp_destroy(bmp);
+        return NULL;
+    }
+    bmp_normalize_header(bmp);
+    return bmp;
+}
+
+int bmp_write_parallel(bmp_t *bmp, const char *path, const int flags)
+{
+    unsigned char header[BMP_HEADER_MAX];
+    bmp_io_t io;
+    bmp_job_t job = { bmp, NULL, 0, 0, NULL, NULL };
+    unsigned char *src;
+    unsigned char *rle = NULL;
+    unsigned int header_size;
+    size_t pixels;
+    size_t total;
+    int rows;
+    int direct;
+    int fd;
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    if (bmp_flush(bmp) == NULL) {
+        return 1;
+    }
+    pixels = get_pixel_array_size(bmp);
+    src = bmp->data[0];
+    if (bmp_is_rle(bmp)) {
+        // rows are encoded in parallel, the stream then goes out like an uncompressed pixel array
+        rle = bmp_rle_encode(bmp, &pixels);
+        if (rle == NULL) {
+            return 1;
+        }
+        src = rle;
+    }
+    header_size = bmp_pack_header(bmp, pixels, header);
+    total = header_size + pixels;
+
+    // rows of a top-down bitmap are not contiguous in file order, they go out one by one without O_DIRECT
+    rows = bmp->top_down && rle == NULL;
+    fd = bmp_io_open(path, O_WRONLY | O_CREAT | O_TRUNC, rows ? flags & ~BMP_IO_DIRECT : flags, &direct);
+    if (fd == -1) {
+        free(rle);
+        return 1;
+    }
+    // sizing the file up front lets the chunks land in any order
+    if (ftruncate(fd, total) == -1) {
+        perror("ftruncate");
+        free(rle);
+        close(fd);
+        return 1;
+    }
+
+    io.fd = fd;
+    io.header = header;
+    io.header_size = header_size;
+    io.failed = 0;
+    pthread_mutex_init(&io.lock, NULL);
+    job.params = &io;
+    if (direct) {
+        // whole blocks from the start of the file, header included
+        io.buf = src;
+        io.offset = 0;
+        io.size = (total + BMP_IO_ALIGN - 1) / BMP_IO_ALIGN * BMP_IO_ALIGN;
+        io.limit = total;
+        job.arg = 1;
+    } else {
+        if (pwrite(fd, header, header_size, 0) != (ssize_t)header_size) {
+            io.failed = 1;
+            perror("pwrite");
+        }
+        BMP_METRIC_WRITTEN(header_size);
+        io.buf = src;
+        io.offset = header_size;
+        io.size = pixels;
+        io.limit = pixels;
+    }
+    if (!io.failed && rows) {
+        bmp_parallel_rows(bmp->info.height, bmp_io_write_rows, &job);
+    } else if (!io.failed) {
+        bmp_parallel_rows((unsigned int)((io.size + BMP_IO_CHUNK - 1) / BMP_IO_CHUNK), bmp_io_write_chunks, &job);
+    }
+    pthread_mutex_destroy(&io.lock);
+
+    if (direct && !io.failed && ftruncate(fd, total) == -1) {
+        perror("ftruncate");
+        io.failed = 1;
+    }
+    if (close(fd) == -1) {
+        perror("close");
+        io.failed = 1;
+    }
+    free(rle);
+    return io.failed;
+}
+
+static int bmp_channel_index(const char channel)
+{
+    switch (channel) {
+        case 'b':
+            return 0;
+        case 'g':
+            return 1;
+        case 'r':
+            return 2;
+    }
+    return -1;
+}
+
+bmp_lut_t *bmp_lut_identity(bmp_lut_t *lut)
+{
+    unsigned int c;
+    unsigned int v;
+
+    for (c = 0; c < 3; c++) {
+        for (v = 0; v < 256; v++) {
+            lut->table[c][v] = (unsigned char)v;
+        }
+    }
+    return lut;
+}
+
+// applies map after whatever the table already does, to every channel
+static bmp_lut_t *bmp_lut_map(bmp_lut_t *lut, const unsigned char map[256])
+{
+    unsigned int c;
+    unsigned int v;
+
+    for (c = 0; c < 3; c++) {
+        for (v = 0; v < 256; v++) {
+            lut->table[c][v] = map[lut->table[c][v]];
+        }
+    }
+    return lut;
+}
+
+static unsigned char bmp_clamp(const double d)
+{
+    if (d < 0.0) {
+        return 0;
+    } else if (d > 255.0) {
+        return 255;
+    }
+    return (unsigned char)d;
+}
+
+bmp_lut_t *bmp_lut_brightness(bmp_lut_t *lut, int step)
+{
+    unsigned char map[256];
+    int v;
+
+    for (v = 0; v < 256; v++) {
+        map[v] = bmp_clamp(v + step);
+    }
+    return bmp_lut_map(lut, map);
+}
+
+bmp_lut_t *bmp_lut_invert(bmp_lut_t *lut)
+{
+    unsigned char map[256];
+    int v;
+
+    for (v = 0; v < 256; v++) {
+        map[v] = (unsigned char)(255 - v);
+    }
+    return bmp_lut_map(lut, map);
+}
+
+bmp_lut_t *bmp_lut_gamma(bmp_lut_t *lut, const double gamma)
+{
+    unsigned char map[256];
+    int v;
+
+    assert(gamma > 0.0);
+
+    for (v = 0; v < 256; v++) {
+        map[v] = bmp_clamp(255.0 * pow(v / 255.0, 1.0 / gamma) + 0.5);
+    }
+    return bmp_lut_map(lut, map);
+}
+
+bmp_lut_t *bmp_lut_levels(bmp_lut_t *lut, const int in_low, const int in_high, const int out_low, const int out_high)
+{
+    unsigned char map[256];
+    int v;
+
+    assert(in_low < in_high);
+
+    for (v = 0; v < 256; v++) {
+        if (v <= in_low) {
+            map[v] = bmp_clamp(out_low);
+        } else if (v >= in_high) {
+            map[v] = bmp_clamp(out_high);
+        } else {
+            map[v] = bmp_clamp(out_low + (double)(v - in_low) * (out_high - out_low) / (in_high - in_low) + 0.5);
+        }
+    }
+    return bmp_lut_map(lut, map);
+}
+
+bmp_lut_t *bmp_lut_contrast(bmp_lut_t *lut, const double contrast)
+{
+    unsigned char map[256];
+    int v;
+
+    for (v = 0; v < 256; v++) {
+        map[v] = bmp_clamp((v - 128) * contrast + 128.5);
+    }
+    return bmp_lut_map(lut, map);
+}
+
+bmp_lut_t *bmp_lut_remove_channel(bmp_lut_t *lut, const char channel)
+{
+    int c = bmp_channel_index(channel);
+
+    if (c >= 0) {
+        memset(lut->table[c], 0, 256);
+    }
+    return lut;
+}
+
+bmp_lut_t *bmp_lut_compose(bmp_lut_t *lut, const bmp_lut_t *other)
+{
+    unsigned int c;
+    unsigned int v;
+
+    for (c = 0; c < 3; c++) {
+        for (v = 0; v < 256; v++) {
+            lut->table[c][v] = other->table[c][lut->table[c][v]];
+        }
+    }
+    return lut;
+}
+
+bmp_lut_t *bmp_lut_set_channel(bmp_lut_t *lut, const char channel, const bmp_lut_t *other)
+{
+    int c = bmp_channel_index(channel);
+
+    if (c >= 0) {
+        memcpy(lut->table[c], other->table[c], 256);
+    }
+    return lut;
+}
+
+// arg is set when all three channel tables are the same
+static void bmp_lut_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_job_t *job = ctx;
+    bmp_t *bmp = job->bmp;
+    const bmp_lut_t *lut = job->params;
+    const unsigned char *b = lut->table[0];
+    const unsigned char *g = lut->table[1];
+    const unsigned char *r = lut->table[2];
+    unsigned int width = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
+    unsigned int step = bmp->info.bits_per_pixel / 8;
+    unsigned char *row;
+    unsigned int x;
+    unsigned int y;
+
+    // a byte-wide table lookup is one load; it beats any shuffle-based vector lookup of 256 entries
+    for (y = y0; y < y1; y++) {
+        row = bmp->data[y];
+        x = 0;
+        if (bmp->info.bits_per_pixel == 32) {
+            // alpha is left alone
+            for (; x < width; x += 4) {
+                row[x] = b[row[x]];
+                row[x+1] = g[row[x+1]];
+                row[x+2] = r[row[x+2]];
+            }
+        } else if (job->arg) {
+            for (; x + 4 <= width; x += 4) {
+                row[x] = b[row[x]];
+                row[x+1] = b[row[x+1]];
+                row[x+2] = b[row[x+2]];
+                row[x+3] = b[row[x+3]];
+            }
+        } else {
+            for (; x + 12 <= width; x += 12) {
+                row[x] = b[row[x]];
+                row[x+1] = g[row[x+1]];
+                row[x+2] = r[row[x+2]];
+                row[x+3] = b[row[x+3]];
+                row[x+4] = g[row[x+4]];
+                row[x+5] = r[row[x+5]];
+                row[x+6] = b[row[x+6]];
+                row[x+7] = g[row[x+7]];
+                row[x+8] = r[row[x+8]];
+                row[x+9] = b[row[x+9]];
+                row[x+10] = g[row[x+10]];
+                row[x+11] = r[row[x+11]];
+            }
+        }
+        // the channel follows from the byte's place in its pixel; alpha has no table
+        for (; x < width; x++) {
+            if (x % step < 3) {
+                row[x] = lut->table[x % step][row[x]];
+            }
+        }
+    }
+}
+
+// what point operations run on: the palette of an 8 bit bitmap, seen as one row of 32 bit pixels, or
+// the bitmap itself; NULL for formats without point operation kernels
+static bmp_t *bmp_point_target(bmp_t *bmp, bmp_t *view)
+{
+    switch (bmp->info.bits_per_pixel) {
+        case 24:
+        case 32:
+            return bmp;
+        case 8:
+            bmp_init(view);
+            view->info = bmp->info;
+            view->info.width = bmp_palette_colors(bmp);
+            view->info.height = 1;
+            view->info.bits_per_pixel = 32;
+            view->data = &bmp->palette;
+            return view;
+    }
+    printf("Unsupported pixel format: %u bits per pixel, convert with bmp_convert()\n", bmp->info.bits_per_pixel);
+    return NULL;
+}
+
+// prints why and returns 1 unless the bitmap has 24 or 32 bit pixels, which neighbourhood kernels need
+static int bmp_check_direct_color(const bmp_t *bmp)
+{
+    if (bmp->info.bits_per_pixel == 24 || bmp->info.bits_per_pixel == 32) {
+        return 0;
+    }
+    printf("Unsupported pixel format: %u bits per pixel, convert with bmp_convert()\n", bmp->info.bits_per_pixel);
+    return 1;
+}
+
+static int bmp_lut_uniform(const bmp_lut_t *lut)
+{
+    return memcmp(lut->table[0], lut->table[1], 256) == 0 && memcmp(lut->table[0], lut->table[2], 256) == 0;
+}
+
+bmp_t *bmp_apply_lut(bmp_t *bmp, const bmp_lut_t *lut)
+{
+    bmp_t view;
+    bmp_job_t job = { bmp, NULL, bmp_lut_uniform(lut), 0, NULL, lut };
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    if (bmp_flush(bmp) == NULL) {
+        return NULL;
+    }
+    job.bmp = bmp_point_target(bmp, &view);
+    if (job.bmp == NULL) {
+        return NULL;
+    }
+    bmp_parallel_rows(job.bmp->info.height, bmp_lut_rows, &job);
+    bmp_changed(bmp);
+    return bmp;
+}
+
+bmp_t *bmp_brightness(bmp_t *bmp, int step)
+{
+    bmp_lut_t lut;
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    return bmp_apply_lut(bmp, bmp_lut_brightness(bmp_lut_identity(&lut), step));
+}
+
+bmp_t *bmp_invert(bmp_t *bmp)
+{
+    bmp_lut_t lut;
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    return bmp_apply_lut(bmp, bmp_lut_invert(bmp_lut_identity(&lut)));
+}
+
+// pixels converted at a time when a conversion runs in place
+#define BMP_COLOR_CHUNK 256
+
+// (a * w[0] + b * w[1] + c * w[2] + w[3]) >> w[4] for every channel: blue, green, red to luma, to Y, Cb, Cr,
+// and Y, Cb - 128, Cr - 128 back to blue, green, red; Q8 for luma, Q14 for the rest
+static const int bmp_color_weights[7][5] = {
+    {19, 183, 54, 128, 8},
+    {1868, 9617, 4899, 8192, 14},
+    {8192, -5427, -2765, 8192 + (128 << 14), 14},
+    {-1332, -6860, 8192, 8192 + (128 << 14), 14},
+    {16384, 29032, 0, 8192, 14},
+    {16384, -5638, -11700, 8192, 14},
+    {16384, 0, 22970, 8192, 14},
+};
+
+// arguments of a colour conversion, in bmp_job_t.params
+typedef struct {
+    unsigned int stride;                   // bytes between rows of a plane
+    unsigned int hue[256];                 // hue[d] = 65536 * 256 / (6 * d): Q16 hue per unit of difference at range d
+    unsigned int saturation[256];          // saturation[v] = 65536 * 255 / v
+} bmp_color_t;
+
+static unsigned char bmp_color_weigh(const int *w, const int a, const int b, const int c)
+{
+    // biased so that the shift floors negative sums too
+    int v = ((a * w[0] + b * w[1] + c * w[2] + w[3] + (256 << w[4])) >> w[4]) - 256;
+
+    return (unsigned char)((v < 0) ? 0 : (v > 255) ? 255 : v);
+}
+
+#ifdef __SSE2__
+// the same for 8 pixels in 16 bit lanes, as 16 bit results
+static __m128i bmp_color_weigh_sse2(const int *w, const __m128i a, const __m128i b, const __m128i c)
+{
+    __m128i ab = _mm_set1_epi32((int)(((unsigned int)w[1] << 16) | (w[0] & 0xffff)));
+    __m128i c0 = _mm_set1_epi32(w[2] & 0xffff);
+    __m128i bias = _mm_set1_epi32(w[3]);
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo;
+    __m128i hi;
+
+    lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a, b), ab), _mm_madd_epi16(_mm_unpacklo_epi16(c, zero), c0));
+    hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a, b), ab), _mm_madd_epi16(_mm_unpackhi_epi16(c, zero), c0));
+    lo = _mm_srai_epi32(_mm_add_epi32(lo, bias), w[4]);
+    hi = _mm_srai_epi32(_mm_add_epi32(hi, bias), w[4]);
+    return _mm_packs_epi32(lo, hi);
+}
+
+#ifdef __SSSE3__
+// splits 16 pixels of 3 bytes into 16 blue, 16 green and 16 red bytes
+static void bmp_split3(const unsigned char *p, __m128i ch[3])
+{
+    // byte k of channel c comes from byte 3 * k + c, in one of the three loads
+    static const signed char shuffle[3][3][16] = {
+        {{0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+         {-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1},
+         {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13}},
+        {{1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+         {-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1},
+         {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14}},
+        {{2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+         {-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1},
+         {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15}},
+    };
+    __m128i v[3];
+    unsigned int c;
+
+    for (c = 0; c < 3; c++) {
+        v[c] = _mm_loadu_si128((const __m128i *)(p + 16 * c));
+    }
+    for (c = 0; c < 3; c++) {
+        ch[c] = _mm_or_si128(_mm_or_si128(
+                _mm_shuffle_epi8(v[0], _mm_loadu_si128((const __m128i *)shuffle[c][0])),
+                _mm_shuffle_epi8(v[1], _mm_loadu_si128((const __m128i *)shuffle[c][1]))),
+                _mm_shuffle_epi8(v[2], _mm_loadu_si128((const __m128i *)shuffle[c][2])));
+    }
+}
+
+// splits 16 pixels of 4 bytes into 16 blue, 16 green and 16 red bytes, alpha is dropped
+static void bmp_split4(const unsigned char *p, __m128i ch[3])
+{
+    // gathers each load into its four blue, green, red and alpha bytes, then transposes the 32 bit groups
+    __m128i shuffle = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    __m128i v[4];
+    __m128i lo;
+    __m128i hi;
+    unsigned int c;
+
+    for (c = 0; c < 4; c++) {
+        v[c] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * c)), shuffle);
+    }
+    lo = _mm_unpacklo_epi32(v[0], v[1]);
+    hi = _mm_unpacklo_epi32(v[2], v[3]);
+    ch[0] = _mm_unpacklo_epi64(lo, hi);
+    ch[1] = _mm_unpackhi_epi64(lo, hi);
+    ch[2] = _mm_unpacklo_epi64(_mm_unpackhi_epi32(v[0], v[1]), _mm_unpackhi_epi32(v[2], v[3]));
+}
+
+// the inverse of bmp_split3(), 16 pixels of 3 bytes from 16 bytes of each channel
+static void bmp_merge3(const __m128i ch[3], unsigned char *p)
+{
+    // byte j of output vector o comes from channel j % 3 (after the 16 * o offset), at index (16 * o + j) / 3
+    static const signed char shuffle[3][3][16] = {
+        {{0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5},
+         {-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1},
+         {-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1}},
+        {{-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1},
+         {5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10},
+         {-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1}},
+        {{-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1},
+         {-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1},
+         {10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15}},
+    };
+    unsigned int o;
+
+    for (o = 0; o < 3; o++) {
+        _mm_storeu_si128((__m128i *)(p + 16 * o), _mm_or_si128(_mm_or_si128(
+                _mm_shuffle_epi8(ch[0], _mm_loadu_si128((const __m128i *)shuffle[o][0])),
+                _mm_shuffle_epi8(ch[1], _mm_loadu_si128((const __m128i *)shuffle[o][1]))),
+                _mm_shuffle_epi8(ch[2], _mm_loadu_si128((const __m128i *)shuffle[o][2]))));
+    }
+}
+#endif
+
+// splits 16 pixels of 3 or 4 bytes into blue, green and red, pixels 0-7 in ch[c][0] and 8-15 in ch[c][1], 16 bit lanes;
+// returns 0 when there is no vector path for the pixel size
+static int bmp_color_deinterleave(const unsigned char *p, const unsigned int step, __m128i ch[3][2])
+{
+#ifdef __SSSE3__
+    __m128i x[3];
+#endif
+    __m128i zero = _mm_setzero_si128();
+    __m128i mask = _mm_set1_epi32(0xff);
+    __m128i v[4];
+    unsigned int c;
+
+    if (step == 4) {
+        for (c = 0; c < 4; c++) {
+            v[c] = _mm_loadu_si128((const __m128i *)(p + 16 * c));
+        }
+        for (c = 0; c < 3; c++) {
+            ch[c][0] = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(v[0], 8 * c), mask),
+                    _mm_and_si128(_mm_srli_epi32(v[1], 8 * c), mask));
+            ch[c][1] = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(v[2], 8 * c), mask),
+                    _mm_and_si128(_mm_srli_epi32(v[3], 8 * c), mask));
+        }
+        return 1;
+    }
+#ifdef __SSSE3__
+    bmp_split3(p, x);
+    for (c = 0; c < 3; c++) {
+        ch[c][0] = _mm_unpacklo_epi8(x[c], zero);
+        ch[c][1] = _mm_unpackhi_epi8(x[c], zero);
+    }
+    return 1;
+#else
+    (void)zero;
+    return 0;
+#endif
+}
+#endif
+
+static void bmp_color_hsv(const bmp_color_t *color, const unsigned int b, const unsigned int g, const unsigned int r,
+        unsigned char *h, unsigned char *s, unsigned char *v)
+{
+    unsigned int max = (b > g) ? ((b > r) ? b : r) : ((g > r) ? g : r);
+    unsigned int min = (b < g) ? ((b < r) ? b : r) : ((g < r) ? g : r);
+    unsigned int d = max - min;
+    int hue;
+
+    // sixths of the turn start at 0 (red), 256 / 3 (green) and 512 / 3 (blue), kept in Q16
+    if (d == 0) {
+        hue = 0;
+    } else if (max == r) {
+        hue = ((int)g - (int)b) * (int)color->hue[d];
+    } else if (max == g) {
+        hue = 5592405 + ((int)b - (int)r) * (int)color->hue[d];
+    } else {
+        hue = 11184811 + ((int)r - (int)g) * (int)color->hue[d];
+    }
+    *h = (unsigned char)(((unsigned int)(hue + (256 << 16) + 32768) >> 16) & 255);
+    *s = (unsigned char)((max == 0) ? 0 : (d * color->saturation[max] + 32768) >> 16);
+    *v = (unsigned char)max;
+}
+
+static unsigned int bmp_div255(const unsigned int x)
+{
+    return (x + 1 + (x >> 8)) >> 8;
+}
+
+static void bmp_color_rgb(const unsigned int h, const unsigned int s, const unsigned int v, unsigned char *p)
+{
+    unsigned int f = (h * 6) & 255;
+    unsigned int lo = bmp_div255(v * (255 - s));
+    unsigned int down = bmp_div255(v * (255 - ((s * f + 128) >> 8)));
+    unsigned int up = bmp_div255(v * (255 - ((s * (256 - f) + 128) >> 8)));
+    unsigned int bgr[6][3] = {
+        {lo, up, v}, {lo, v, down}, {up, v, lo}, {v, down, lo}, {v, lo, up}, {down, lo, v},
+    };
+
+    p[0] = (unsigned char)bgr[(h * 6) >> 8][0];
+    p[1] = (unsigned char)bgr[(h * 6) >> 8][1];
+    p[2] = (unsigned char)bgr[(h * 6) >> 8][2];
+}
+
+// n pixels of `step` bytes to channels c[0] .. c[2]; c[1] and c[2] are unused for luma
+static void bmp_color_from_span(const bmp_color_t *color, const int space, const unsigned char *p,
+        const unsigned int n, const unsigned int step, unsigned char *const *c)
+{
+    const int (*w)[5] = bmp_color_weights + ((space == BMP_COLOR_LUMA) ? 0 : 1);
+    unsigned int channels = (space == BMP_COLOR_LUMA) ? 1 : 3;
+    unsigned int x = 0;
+    unsigned int k;
+#ifdef __SSE2__
+    __m128i ch[3][2];
+
+    for (; space != BMP_COLOR_HSV && x + 16 <= n && bmp_color_deinterleave(p + step * x, step, ch); x += 16) {
+        for (k = 0; k < channels; k++) {
+            _mm_storeu_si128((__m128i *)(c[k] + x), _mm_packus_epi16(
+                    bmp_color_weigh_sse2(w[k], ch[0][0], ch[1][0], ch[2][0]),
+                    bmp_color_weigh_sse2(w[k], ch[0][1], ch[1][1], ch[2][1])));
+        }
+    }
+    if (x > 0) {
+        BMP_METRIC_SIMD();
+    }
+#endif
+    for (; x < n; x++) {
+        if (space == BMP_COLOR_HSV) {
+            bmp_color_hsv(color, p[step * x], p[step * x + 1], p[step * x + 2], c[0] + x, c[1] + x, c[2] + x);
+            continue;
+        }
+        for (k = 0; k < channels; k++) {
+            c[k][x] = bmp_color_weigh(w[k], p[step * x], p[step * x + 1], p[step * x + 2]);
+        }
+    }
+}
+
+// channels c[0] .. c[2] of n pixels back to blue, green and red; the fourth byte of 32 bit pixels is kept
+static void bmp_color_to_span(const int space, unsigned char *p, const unsigned int n, const unsigned int step,
+        const unsigned char *const *c)
+{
+    const int (*w)[5] = bmp_color_weights + 4;
+    unsigned char bgr[3][16];
+    unsigned int x = 0;
+    unsigned int i;
+    unsigned int k;
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i half = _mm_set1_epi16(128);
+    __m128i ch[3][2];
+    __m128i v;
+
+    if (space == BMP_COLOR_YCBCR && n >= 16) {
+        BMP_METRIC_SIMD();
+    }
+    for (; space == BMP_COLOR_YCBCR && x + 16 <= n; x += 16) {
+        for (k = 0; k < 3; k++) {
+            v = _mm_loadu_si128((const __m128i *)(c[k] + x));
+            ch[k][0] = _mm_unpacklo_epi8(v, zero);
+            ch[k][1] = _mm_unpackhi_epi8(v, zero);
+            if (k > 0) {
+                ch[k][0] = _mm_sub_epi16(ch[k][0], half);
+                ch[k][1] = _mm_sub_epi16(ch[k][1], half);
+            }
+        }
+        for (k = 0; k < 3; k++) {
+            _mm_storeu_si128((__m128i *)bgr[k], _mm_packus_epi16(
+                    bmp_color_weigh_sse2(w[k], ch[0][0], ch[1][0], ch[2][0]),
+                    bmp_color_weigh_sse2(w[k], ch[0][1], ch[1][1], ch[2][1])));
+        }
+        for (i = 0; i < 16; i++) {
+            p[step * (x + i)] = bgr[0][i];
+            p[step * (x + i) + 1] = bgr[1][i];
+            p[step * (x + i) + 2] = bgr[2][i];
+        }
+    }
+#else
+    (void)bgr;
+    (void)i;
+#endif
+    for (; x < n; x++) {
+        switch (space) {
+            case BMP_COLOR_LUMA:
+                p[step * x] = p[step * x + 1] = p[step * x + 2] = c[0][x];
+                break;
+            case BMP_COLOR_YCBCR:
+                for (k = 0; k < 3; k++) {
+                    p[step * x + k] = bmp_color_weigh(w[k], c[0][x], c[1][x] - 128, c[2][x] - 128);
+                }
+                break;
+            default:
+                bmp_color_rgb(c[0][x], c[1][x], c[2][x], p + step * x);
+                break;
+        }
+    }
+}
+
+// rows [y0, y1) of job->bmp to the planes in job->out, or in place when there are none
+static void bmp_color_from_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_job_t *job = ctx;
+    bmp_t *bmp = job->bmp;
+    const bmp_color_t *color = (const bmp_color_t *)job->params;
+    unsigned int step = bmp->info.bits_per_pixel / 8;
+    unsigned char tmp[3][BMP_COLOR_CHUNK];
+    unsigned char *c[3];
+    unsigned char *row;
+    unsigned int n;
+    unsigned int x;
+    unsigned int i;
+    unsigned int y;
+
+    for (y = y0; y < y1; y++) {
+        if (job->out != NULL) {
+            for (i = 0; i < 3; i++) {
+                c[i] = (job->out[i] != NULL) ? job->out[i] + (size_t)color->stride * y : NULL;
+            }
+            bmp_color_from_span(color, job->arg, bmp->data[y], bmp->info.width, step, c);
+            continue;
+        }
+        // in place, a chunk at a time; luma goes to all three bytes
+        c[0] = tmp[0];
+        c[1] = (job->arg == BMP_COLOR_LUMA) ? tmp[0] : tmp[1];
+        c[2] = (job->arg == BMP_COLOR_LUMA) ? tmp[0] : tmp[2];
+        for (x = 0; x < bmp->info.width; x += n) {
+            n = (bmp->info.width - x < BMP_COLOR_CHUNK) ? bmp->info.width - x : BMP_COLOR_CHUNK;
+            row = bmp->data[y] + step * x;
+            bmp_color_from_span(color, job->arg, row, n, step, c);
+            for (i = 0; i < n; i++, row += step) {
+                row[0] = c[0][i];
+                row[1] = c[1][i];
+                row[2] = c[2][i];
+            }
+        }
+    }
+}
+
+static void bmp_color_to_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_job_t *job = ctx;
+    bmp_t *bmp = job->bmp;
+    const bmp_color_t *color = (const bmp_color_t *)job->params;
+    unsigned int step = bmp->info.bits_per_pixel / 8;
+    unsigned char tmp[3][BMP_COLOR_CHUNK];
+    const unsigned char *c[3];
+    unsigned char *row;
+    unsigned int n;
+    unsigned int x;
+    unsigned int i;
+    unsigned int y;
+
+    for (y = y0; y < y1; y++) {
+        if (job->out != NULL) {
+            for (i = 0; i < 3; i++) {
+                c[i] = (job->out[i] != NULL) ? job->out[i] + (size_t)color->stride * y : NULL;
+            }
+            bmp_color_to_span(job->arg, bmp->data[y], bmp->info.width, step, c);
+            continue;
+        }
+        c[0] = tmp[0];
+        c[1] = tmp[1];
+        c[2] = tmp[2];
+        for (x = 0; x < bmp->info.width; x += n) {
+            n = (bmp->info.width - x < BMP_COLOR_CHUNK) ? bmp->info.width - x : BMP_COLOR_CHUNK;
+            row = bmp->data[y] + step * x;
+            for (i = 0; i < n; i++) {
+                tmp[0][i] = row[step * i];
+                tmp[1][i] = row[step * i + 1];
+                tmp[2][i] = row[step * i + 2];
+            }
+            bmp_color_to_span(job->arg, row, n, step, c);
+        }
+    }
+}
+
+static int bmp_color_run(bmp_t *bmp, const int space, unsigned char *const *planes, const unsigned int stride,
+        bmp_rows_fn fn)
+{
+    bmp_color_t color;
+    bmp_job_t job = { bmp, NULL, space, 0, (unsigned char **)planes, &color };
+    unsigned int i;
+
+    if (space < BMP_COLOR_LUMA || space > BMP_COLOR_HSV) {
+        printf("Unsupported colour space: %d\n", space);
+        return 1;
+    }
+    if (bmp_flush(bmp) == NULL) {
+        return 1;
+    }
+    if (bmp_check_direct_color(bmp)) {
+        return 1;
+    }
+    color.stride = stride;
+    color.hue[0] = 0;
+    color.saturation[0] = 0;
+    for (i = 1; i < 256; i++) {
+        color.hue[i] = (65536 * 256 + 3 * i) / (6 * i);
+        color.saturation[i] = (65536 * 255 + i / 2) / i;
+    }
+    bmp_parallel_rows(bmp->info.height, fn, &job);
+    if (planes == NULL) {
+        bmp_changed(bmp);
+    }
+    return 0;
+}
+
+int bmp_color_from(bmp_t *bmp, const int space, unsigned char *const *planes, const unsigned int stride)
+{
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    if (planes != NULL && (planes[0] == NULL
+            || (space != BMP_COLOR_LUMA && (planes[1] == NULL || planes[2] == NULL)))) {
+        printf("Missing colour plane\n");
+        return 1;
+    }
+    return bmp_color_run(bmp, space, planes, stride, bmp_color_from_rows);
+}
+
+int bmp_color_to(bmp_t *bmp, const int space, const unsigned char *const *planes, const unsigned int stride)
+{
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    if (planes != NULL && (planes[0] == NULL
+            || (space != BMP_COLOR_LUMA && (planes[1] == NULL || planes[2] == NULL)))) {
+        printf("Missing colour plane\n");
+        return 1;
+    }
+    return bmp_color_run(bmp, space, (unsigned char *const *)planes, stride, bmp_color_to_rows);
+}
+
+static void bmp_grayscale_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_job_t *job = ctx;
+    bmp_job_t luma = { job->bmp, NULL, BMP_COLOR_LUMA, 0, NULL, NULL };
+
+    bmp_color_from_rows(&luma, y0, y1);
+}
+
+bmp_t *bmp_grayscale(bmp_t *bmp)
+{
+    bmp_t view;
+    bmp_job_t job = { bmp, NULL, 0, 0, NULL, NULL };
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    if (bmp_flush(bmp) == NULL) {
+        return NULL;
+    }
+    job.bmp = bmp_point_target(bmp, &view);
+    if (job.bmp == NULL) {
+        return NULL;
+    }
+    bmp_parallel_rows(job.bmp->info.height, bmp_grayscale_rows, &job);
+    bmp_changed(bmp);
+    return bmp;
+}
+
+static void bmp_remove_channel_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_job_t *job = ctx;
+    bmp_t *bmp = job->bmp;
+    const char channel = (char)job->arg;
+    unsigned int row_size = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
+    unsigned int step = bmp->info.bits_per_pixel / 8;
+    unsigned int x;
+    unsigned int y;
+
+    for (y = y0; y < y1; y++) {
+        for (x = 0; x < row_size; x += step) {
+            switch (channel) {
+                case 'b':
+                    bmp->data[y][x] = 0;
+                    break;
+                case 'g':
+                    bmp->data[y][x+1] = 0;
+                    break;
+                case 'r':
+                    bmp->data[y][x+2] = 0;
+                    break;
+            }
+        }
+    }
+}
+
+bmp_t *bmp_remove_channel(bmp_t *bmp, const char channel)
+{
+    bmp_t view;
+    bmp_job_t job = { bmp, NULL, channel, 0, NULL, NULL };
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    if (bmp_flush(bmp) == NULL) {
+        return NULL;
+    }
+    job.bmp = bmp_point_target(bmp, &view);
+    if (job.bmp == NULL) {
+        return NULL;
+    }
+    bmp_parallel_rows(job.bmp->info.height, bmp_remove_channel_rows, &job);
+    bmp_changed(bmp);
+    return bmp;
+}
+
+static void bmp_swap_channel_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_job_t *job = ctx;
+    bmp_t *bmp = job->bmp;
+    const char channel = (char)job->arg;
+    const char other = (char)job->arg2;
+    unsigned int row_size = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
+    unsigned int step = bmp->info.bits_per_pixel / 8;
+    unsigned int x;
+    unsigned int y;
+
+    for (y = y0; y < y1; y++) {
+        for (x = 0; x < row_size; x += step) {
+            switch (channel) {
+                case 'b':
+                    switch (other) {
+                        case 'g':
+                            bmp->data[y][x] = bmp->data[y][x+1];
+                            break;
+                        case 'r':
+                            bmp->data[y][x] = bmp->data[y][x+2];
+                            break;
+                    }
+                    break;
+                case 'g':
+                    switch (other) {
+                        case 'b':
+                            bmp->data[y][x+1] = bmp->data[y][x];
+                            break;
+                        case 'r':
+                            bmp->data[y][x+1] = bmp->data[y][x+2];
+                            break;
+                    }
+                    break;
+                case 'r':
+                    switch (other) {
+                        case 'b':
+                            bmp->data[y][x+2] = bmp->data[y][x];
+                            break;
+                        case 'g':
+                            bmp->data[y][x+2] = bmp->data[y][x+1];
+                            break;
+                    }
+                    break;
+            }
+        }
+    }
+}
+
+bmp_t *bmp_swap_channel(bmp_t *bmp, const char channel, const char other)
+{
+    bmp_t view;
+    bmp_job_t job = { bmp, NULL, channel, other, NULL, NULL };
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    if (bmp_flush(bmp) == NULL) {
+        return NULL;
+    }
+    job.bmp = bmp_point_target(bmp, &view);
+    if (job.bmp == NULL) {
+        return NULL;
+    }
+    bmp_parallel_rows(job.bmp->info.height, bmp_swap_channel_rows, &job);
+    bmp_changed(bmp);
+    return bmp;
+}
+
+bmp_pipeline_t *bmp_defer(bmp_t *bmp)
+{
+    bmp_pipeline_t *pipeline = bmp->pipeline;
+
+    if (pipeline == NULL) {
+        pipeline = malloc(sizeof(bmp_pipeline_t));
+        if (pipeline == NULL) {
+            perror("malloc");
+            return NULL;
+        }
+        pipeline->bmp = bmp;
+        pipeline->ops = NULL;
+        pipeline->count = 0;
+        pipeline->capacity = 0;
+        pipeline->luts = NULL;
+        pipeline->lut_count = 0;
+        bmp->pipeline = pipeline;
+    }
+    return pipeline;
+}
+
+static bmp_pipeline_t *bmp_pipeline_push(bmp_pipeline_t *pipeline, const int type, const int arg, const int arg2)
+{
+    bmp_op_t *ops;
+
+    // a failed step earlier in a chain passes NULL along
+    if (pipeline == NULL) {
+        return NULL;
+    }
+    if (pipeline->count == pipeline->capacity) {
+        ops = realloc(pipeline->ops, (pipeline->capacity + 8) * sizeof(bmp_op_t));
+        if (ops == NULL) {
+            perror("realloc");
+            return NULL;
+        }
+        pipeline->ops = ops;
+        pipeline->capacity += 8;
+    }
+    pipeline->ops[pipeline->count].type = type;
+    pipeline->ops[pipeline->count].arg = arg;
+    pipeline->ops[pipeline->count].arg2 = arg2;
+    pipeline->count++;
+    return pipeline;
+}
+
+bmp_pipeline_t *bmp_pipeline_brightness(bmp_pipeline_t *pipeline, int step)
+{
+    return bmp_pipeline_push(pipeline, BMP_OP_BRIGHTNESS, step, 0);
+}
+
+bmp_pipeline_t *bmp_pipeline_invert(bmp_pipeline_t *pipeline)
+{
+    return bmp_pipeline_push(pipeline, BMP_OP_INVERT, 0, 0);
+}
+
+bmp_pipeline_t *bmp_pipeline_grayscale(bmp_pipeline_t *pipeline)
+{
+    return bmp_pipeline_push(pipeline, BMP_OP_GRAYSCALE, 0, 0);
+}
+
+bmp_pipeline_t *bmp_pipeline_remove_channel(bmp_pipeline_t *pipeline, const char channel)
+{
+    return bmp_pipeline_push(pipeline, BMP_OP_REMOVE_CHANNEL, channel, 0);
+}
+
+bmp_pipeline_t *bmp_pipeline_swap_channel(bmp_pipeline_t *pipeline, const char channel, const char other)
+{
+    return bmp_pipeline_push(pipeline, BMP_OP_SWAP_CHANNEL, channel, other);
+}
+
+bmp_pipeline_t *bmp_pipeline_lut(bmp_pipeline_t *pipeline, const bmp_lut_t *lut)
+{
+    bmp_lut_t *luts;
+
+    if (pipeline == NULL) {
+        return NULL;
+    }
+    luts = realloc(pipeline->luts, (pipeline->lut_count + 1) * sizeof(bmp_lut_t));
+    if (luts == NULL) {
+        perror("realloc");
+        return NULL;
+    }
+    pipeline->luts = luts;
+    pipeline->luts[pipeline->lut_count] = *lut;
+    // the table only counts once its step is recorded
+    if (bmp_pipeline_push(pipeline, BMP_OP_LUT, pipeline->lut_count, 0) == NULL) {
+        return NULL;
+    }
+    pipeline->lut_count++;
+    return pipeline;
+}
+
+// a step of bmp_flush(); runs of table-driven operations are folded into one lookup table
+typedef struct {
+    bmp_rows_fn fn;
+    bmp_job_t job;
+    bmp_lut_t lut;
+} bmp_stage_t;
+
+static void bmp_pipeline_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_job_t *job = ctx;
+    bmp_stage_t *stages = (bmp_stage_t *)job->params;
+    unsigned int count = (unsigned int)job->arg;
+    unsigned int y;
+    unsigned int i;
+
+    // every stage runs on a row while it is still in cache
+    for (y = y0; y < y1; y++) {
+        for (i = 0; i < count; i++) {
+            stages[i].fn(&stages[i].job, y, y + 1);
+        }
+    }
+}
+
+bmp_t *bmp_flush(bmp_t *bmp)
+{
+    bmp_pipeline_t *pipeline = bmp->pipeline;
+    bmp_t view;
+    bmp_t *target;
+    bmp_stage_t *stages;
+    bmp_stage_t *stage = NULL;
+    bmp_job_t job = { bmp, NULL, 0, 0, NULL, NULL };
+    bmp_op_t *op;
+    unsigned int i;
+
+    if (pipeline == NULL || pipeline->count == 0) {
+        return bmp;
+    }
+    // operations that can never run on this pixel format are dropped, the caller learns of it from NULL
+    target = bmp_point_target(bmp, &view);
+    if (target == NULL) {
+        pipeline->count = 0;
+        pipeline->lut_count = 0;
+        return NULL;
+    }
+    // out of memory: the operations stay pending for the next flush
+    stages = malloc(pipeline->count * sizeof(bmp_stage_t));
+    if (stages == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    for (i = 0; i < pipeline->count; i++) {
+        op = &pipeline->ops[i];
+        if (op->type == BMP_OP_GRAYSCALE || op->type == BMP_OP_SWAP_CHANNEL) {
+            stage = &stages[job.arg++];
+            stage->fn = (op->type == BMP_OP_GRAYSCALE) ? bmp_grayscale_rows : bmp_swap_channel_rows;
+            stage->job.arg = op->arg;
+            stage->job.arg2 = op->arg2;
+            stage->job.params = NULL;
+            stage = NULL;
+            continue;
+        }
+        if (stage == NULL) {
+            stage = &stages[job.arg++];
+            stage->fn = bmp_lut_rows;
+            stage->job.params = &stage->lut;
+            bmp_lut_identity(&stage->lut);
+        }
+        switch (op->type) {
+            case BMP_OP_BRIGHTNESS:
+                bmp_lut_brightness(&stage->lut, op->arg);
+                break;
+            case BMP_OP_INVERT:
+                bmp_lut_invert(&stage->lut);
+                break;
+            case BMP_OP_REMOVE_CHANNEL:
+                bmp_lut_remove_channel(&stage->lut, (char)op->arg);
+                break;
+            case BMP_OP_LUT:
+                bmp_lut_compose(&stage->lut, &pipeline->luts[op->arg]);
+                break;
+        }
+    }
+    for (i = 0; i < (unsigned int)job.arg; i++) {
+        stages[i].job.bmp = target;
+        stages[i].job.other = NULL;
+        stages[i].job.out = NULL;
+        if (stages[i].fn == bmp_lut_rows) {
+            stages[i].job.arg = bmp_lut_uniform(&stages[i].lut);
+        }
+    }
+    job.params = stages;
+    job.bmp = target;
+
+    bmp_parallel_rows(target->info.height, bmp_pipeline_rows, &job);
+    bmp_changed(bmp);
+
+    free(stages);
+    pipeline->count = 0;
+    pipeline->lut_count = 0;
+    return bmp;
+}
+
+#ifdef __SSE2__
+static __m128i bmp_blend_sse2(const __m128i a, const __m128i b, const int mode)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i one = _mm_set1_epi16(1);
+    __m128i lo;
+    __m128i hi;
+
+    switch (mode) {
+        case BMP_BLEND_ADD:
+            return _mm_adds_epu8(a, b);
+        case BMP_BLEND_SUBTRACT:
+            return _mm_subs_epu8(a, b);
+        case BMP_BLEND_DIFFERENCE:
+            return _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+        case BMP_BLEND_MULTIPLY:
+            // t / 255 == (t + 1 + (t >> 8)) >> 8 for every product of two bytes
+            lo = _mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+            hi = _mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+            lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(lo, one), _mm_srli_epi16(lo, 8)), 8);
+            hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(hi, one), _mm_srli_epi16(hi, 8)), 8);
+            return _mm_packus_epi16(lo, hi);
+        case BMP_BLEND_AVERAGE:
+            // pavgb rounds up, the library rounds down
+            return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+        case BMP_BLEND_MIN:
+            return _mm_min_epu8(a, b);
+        default:
+            return _mm_max_epu8(a, b);
+    }
+}
+#endif
+
+#ifdef __AVX2__
+static __m256i bmp_blend_avx2(const __m256i a, const __m256i b, const int mode)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i one = _mm256_set1_epi16(1);
+    __m256i lo;
+    __m256i hi;
+
+    switch (mode) {
+        case BMP_BLEND_ADD:
+            return _mm256_adds_epu8(a, b);
+        case BMP_BLEND_SUBTRACT:
+            return _mm256_subs_epu8(a, b);
+        case BMP_BLEND_DIFFERENCE:
+            return _mm256_or_si256(_mm256_subs_epu8(a, b), _mm256_subs_epu8(b, a));
+        case BMP_BLEND_MULTIPLY:
+            // unpack and pack both work within 128 bit lanes, so the byte order survives
+            lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero));
+            hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero));
+            lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(lo, one), _mm256_srli_epi16(lo, 8)), 8);
+            hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(hi, one), _mm256_srli_epi16(hi, 8)), 8);
+            return _mm256_packus_epi16(lo, hi);
+        case BMP_BLEND_AVERAGE:
+            return _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), _mm256_set1_epi8(1)));
+        case BMP_BLEND_MIN:
+            return _mm256_min_epu8(a, b);
+        default:
+            return _mm256_max_epu8(a, b);
+    }
+}
+#endif
+
+static unsigned char bmp_blend_byte(const unsigned int a, const unsigned int b, const int mode)
+{
+    unsigned int t;
+
+    switch (mode) {
+        case BMP_BLEND_ADD:
+            return (a + b > 255) ? 255 : a + b;
+        case BMP_BLEND_SUBTRACT:
+            return (a > b) ? a - b : 0;
+        case BMP_BLEND_DIFFERENCE:
+            return (a > b) ? a - b : b - a;
+        case BMP_BLEND_MULTIPLY:
+            t = a * b;
+            return (t + 1 + (t >> 8)) >> 8;
+        case BMP_BLEND_AVERAGE:
+            return (a + b) / 2;
+        case BMP_BLEND_MIN:
+            return (a < b) ? a : b;
+        default:
+            return (a > b) ? a : b;
+    }
+}
+
+// a = a <mode> b for n bytes
+static void bmp_blend_row(unsigned char *a, const unsigned char *b, const unsigned int n, const int mode)
+{
+    unsigned int x = 0;
+
+#ifdef __SSE2__
+    if (n >= 16) {
+        BMP_METRIC_SIMD();
+    }
+#endif
+#ifdef __AVX2__
+    for (; x + 32 <= n; x += 32) {
+        _mm256_storeu_si256((__m256i *)(a + x), bmp_blend_avx2(
+            _mm256_loadu_si256((const __m256i *)(a + x)), _mm256_loadu_si256((const __m256i *)(b + x)), mode));
+    }
+#endif
+#ifdef __SSE2__
+    for (; x + 16 <= n; x += 16) {
+        _mm_storeu_si128((__m128i *)(a + x), bmp_blend_sse2(
+            _mm_loadu_si128((const __m128i *)(a + x)), _mm_loadu_si128((const __m128i *)(b + x)), mode));
+    }
+#endif
+    for (; x < n; x++) {
+        a[x] = bmp_blend_byte(a[x], b[x], mode);
+    }
+}
+
+static void bmp_blend_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_job_t *job = ctx;
+    bmp_t *bmp = job->bmp;
+    unsigned int row_size = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
+    unsigned int y;
+
+    for (y = y0; y < y1; y++) {
+        bmp_blend_row(bmp->data[y], job->other->data[y], row_size, job->arg);
+    }
+}
+
+// byte-wise, so 32 bit images blend their alpha as well
+static bmp_t *bmp_blend(bmp_t *bmp, const bmp_t *other, const int mode)
+{
+    bmp_job_t job = { bmp, other, mode, 0, NULL, NULL };
+
+    assert(bmp->info.height == other->info.height);
+    assert(bmp->info.width == other->info.width);
+    assert(bmp->info.bits_per_pixel == other->info.bits_per_pixel);
+
+    if (bmp_check_direct_color(bmp)) {
+        return NULL;
+    }
+    if (bmp_flush(bmp) == NULL || bmp_flush((bmp_t *)other) == NULL) {
+        return NULL;
+    }
+    bmp_parallel_rows(bmp->info.height, bmp_blend_rows, &job);
+    bmp_changed(bmp);
+    return bmp;
+}
+
+bmp_t *bmp_add(bmp_t *bmp, const bmp_t *other)
+{
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    return bmp_blend(bmp, other, BMP_BLEND_ADD);
+}
+
+bmp_t *bmp_subtract(bmp_t *bmp, const bmp_t *other)
+{
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    return bmp_blend(bmp, other, BMP_BLEND_SUBTRACT);
+}
+
+bmp_t *bmp_difference(bmp_t *bmp, const bmp_t *other)
+{
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    return bmp_blend(bmp, other, BMP_BLEND_DIFFERENCE);
+}
+
+bmp_t *bmp_multiply(bmp_t *bmp, const bmp_t *other)
+{
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    return bmp_blend(bmp, other, BMP_BLEND_MULTIPLY);
+}
+
+bmp_t *bmp_average(bmp_t *bmp, const bmp_t *other)
+{
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    return bmp_blend(bmp, other, BMP_BLEND_AVERAGE);
+}
+
+bmp_t *bmp_min(bmp_t *bmp, const bmp_t *other)
+{
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    return bmp_blend(bmp, other, BMP_BLEND_MIN);
+}
+
+bmp_t *bmp_max(bmp_t *bmp, const bmp_t *other)
+{
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    return bmp_blend(bmp, other, BMP_BLEND_MAX);
+}
+
+int bmp_border_index(int i, const int n, const int border)
+{
+    int period;
+
+    if (i >= 0 && i < n) {
+        return i;
+    }
+    switch (border) {
+        case BMP_BORDER_CLAMP:
+            return (i < 0) ? 0 : n - 1;
+        case BMP_BORDER_MIRROR:
+            // reflect about the edge pixels without repeating them: -1 -> 1, n -> n - 2
+            if (n == 1) {
+                return 0;
+            }
+            period = 2 * n - 2;
+            i %= period;
+            if (i < 0) {
+                i += period;
+            }
+            return (i < n) ? i : period - i;
+        default:
+            i %= n;
+            return (i < 0) ? i + n : i;
+    }
+}
+
+// kernel prepared for bmp_convolve_row(): zero taps dropped, divisor turned into a multiply where that is exact
+typedef struct {
+    int count;
+    int row[9];
+    int dx[9];
+    int weight[9];
+    int divisor;
+    unsigned int magic;                    // (n * magic) >> (16 + shift) == n / divisor for n = sum + divisor / 2, or 0
+    int shift;
+    int bias;
+    int simd;
+    int pairs;                             // taps taken two at a time by bmp_planar_span(), or 0
+    short pair[5];                         // their weights, the first of each pair in the low byte
+} bmp_conv_t;
+
+// acc / divisor rounded half up, for sums the multiply cannot take
+static long long bmp_conv_divide(const long long acc, const int divisor)
+{
+    long long n = 2 * acc + divisor;
+    long long q = n / (2 * divisor);
+
+    return (n % (2 * divisor) < 0) ? q - 1 : q;
+}
+
+static void bmp_conv_prepare(bmp_conv_t *conv, const bmp_kernel_t *kernel)
+{
+    int fx;
+    int fy;
+    int sum = 0;
+    int low = 0;
+    int high = 0;
+    unsigned int error;
+
+    assert(kernel->divisor >= 1);
+
+    conv->count = 0;
+    for (fy = 0; fy < 3; fy++) {
+        for (fx = 0; fx < 3; fx++) {
+            if (kernel->taps[fy][fx] != 0) {
+                conv->row[conv->count] = fy;
+                conv->dx[conv->count] = fx - 1;
+                conv->weight[conv->count] = kernel->taps[fy][fx];
+                conv->count++;
+                sum += abs(kernel->taps[fy][fx]);
+                if (kernel->taps[fy][fx] < 0) {
+                    low += 255 * kernel->taps[fy][fx];
+                } else {
+                    high += 255 * kernel->taps[fy][fx];
+                }
+            }
+        }
+    }
+    conv->divisor = kernel->divisor;
+    conv->bias = kernel->bias;
+    conv->magic = 0;
+    conv->shift = 0;
+    // rounding is floor((acc + divisor / 2) / divisor); for non-negative sums below 2^15 that floor is
+    // a 16 bit multiply-high by ceil(2^(16 + shift) / divisor), exact while n * error < 2^(16 + shift)
+    if (kernel->divisor > 1 && kernel->divisor <= 32768 && low == 0 && sum <= 128) {
+        while ((2 << conv->shift) < kernel->divisor) {
+            conv->shift++;
+        }
+        conv->magic = (unsigned int)(((1ull << (16 + conv->shift)) + kernel->divisor - 1) / kernel->divisor);
+        error = conv->magic * kernel->divisor - (1u << (16 + conv->shift));
+        if (conv->magic > 65535
+                || (unsigned long long)(high + kernel->divisor / 2) * error >= (1ull << (16 + conv->shift))) {
+            conv->magic = 0;
+        }
+    }
+    // 16 bit lanes hold the sum as long as it cannot exceed 255 * 128
+    conv->simd = (sum <= 128 && abs(kernel->bias) <= 32767 && (conv->magic || kernel->divisor == 1));
+
+    // pairs multiply unsigned pixels by signed bytes; an odd last tap is paired with itself at weight 0
+    conv->pairs = conv->simd ? (conv->count + 1) / 2 : 0;
+    for (fx = 0; fx < conv->count; fx++) {
+        if (abs(conv->weight[fx]) > 127) {
+            conv->pairs = 0;
+        }
+    }
+    for (fx = 0; fx < conv->pairs; fx++) {
+        fy = (2 * fx + 1 < conv->count) ? conv->weight[2 * fx + 1] : 0;
+        conv->pair[fx] = (short)(((fy & 0xff) << 8) | (conv->weight[2 * fx] & 0xff));
+    }
+}
+
+static unsigned char bmp_conv_pixel(long long acc, const bmp_conv_t *conv)
+{
+    if (conv->magic) {
+        acc = ((acc + conv->divisor / 2) * conv->magic) >> (16 + conv->shift);
+    } else if (conv->divisor > 1) {
+        acc = bmp_conv_divide(acc, conv->divisor);
+    }
+    acc += conv->bias;
+    if (acc < 0) acc = 0; else if (acc > 255) acc = 255;
+    return (unsigned char)acc;
+}
+
+// one output row; `step` is the byte distance between horizontal neighbours (3 for bgr)
+// output byte x of a row, with neighbours outside the row taken through the border mode
+static unsigned char bmp_conv_edge(unsigned char *rows[3], const unsigned int x, const unsigned int pixels,
+        const unsigned int step, const bmp_conv_t *conv, const int border)
+{
+    long long acc = 0;
+    unsigned int ix;
+    int t;
+
+    for (t = 0; t < conv->count; t++) {
+        ix = bmp_border_index((int)(x / step) + conv->dx[t], pixels, border) * step + x % step;
+        acc += rows[conv->row[t]][ix] * conv->weight[t];
+    }
+    return bmp_conv_pixel(acc, conv);
+}
+
+static void bmp_convolve_row(
+    unsigned char *out,
+    unsigned char *rows[3],
+    const unsigned int width,
+    const unsigned int step,
+    const bmp_conv_t *conv,
+    const int border)
+{
+    unsigned int pixels = width / step;
+    unsigned int x = 0;
+    unsigned int end;
+    long long acc;
+    int t;
+
+    // left and right border pixels go through the border mode, the interior is addressed directly
+    end = (pixels > 2) ? step : width;
+    for (;;) {
+        for (; x < end; x++) {
+            out[x] = bmp_conv_edge(rows, x, pixels, step, conv, border);
+        }
+        if (x >= width) {
+            break;
+        }
+
+        end = width - step;
+#ifdef __SSE2__
+        if (conv->simd) {
+            __m128i zero = _mm_setzero_si128();
+            __m128i half = _mm_set1_epi16((short)(conv->divisor / 2));
+            __m128i magic = _mm_set1_epi16((short)conv->magic);
+            __m128i shift = _mm_cvtsi32_si128(conv->shift);
+            __m128i bias = _mm_set1_epi16((short)conv->bias);
+            __m128i weight[9];
+            __m128i lo;
+            __m128i hi;
+            __m128i p;
+
+            if (x + 16 <= end) {
+                BMP_METRIC_SIMD();
+            }
+            for (t = 0; t < conv->count; t++) {
+                weight[t] = _mm_set1_epi16((short)conv->weight[t]);
+            }
+            for (; x + 16 <= end; x += 16) {
+                lo = hi = zero;
+                for (t = 0; t < conv->count; t++) {
+                    p = _mm_loadu_si128((const __m128i *)(rows[conv->row[t]] + x + conv->dx[t] * (int)step));
+                    lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(p, zero), weight[t]));
+                    hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(p, zero), weight[t]));
+                }
+                if (conv->magic) {
+                    // the sums are unsigned here, the high half of the product is the rounded quotient
+                    lo = _mm_srl_epi16(_mm_mulhi_epu16(_mm_add_epi16(lo, half), magic), shift);
+                    hi = _mm_srl_epi16(_mm_mulhi_epu16(_mm_add_epi16(hi, half), magic), shift);
+                }
+                lo = _mm_adds_epi16(lo, bias);
+                hi = _mm_adds_epi16(hi, bias);
+                _mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16(lo, hi));
+            }
+        }
+#endif
+        for (; x < end; x++) {
+            acc = 0;
+            for (t = 0; t < conv->count; t++) {
+                acc += rows[conv->row[t]][x + conv->dx[t] * (int)step] * conv->weight[t];
+            }
+            out[x] = bmp_conv_pixel(acc, conv);
+        }
+        end = width;
+    }
+}
+
+static void bmp_convolve_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_job_t *job = ctx;
+    bmp_t *bmp = job->bmp;
+    int border = job->arg;
+    unsigned int width = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
+    unsigned int row_size = get_row_size(bmp);
+    unsigned int height = bmp->info.height;
+    unsigned int step = bmp->info.bits_per_pixel / 8;
+    unsigned char *rows[3];
+    unsigned int x;
+    unsigned int y;
+
+    for (y = y0; y < y1; y++) {
+        rows[0] = bmp->data[bmp_border_index((int)y - 1, height, border)];
+        rows[1] = bmp->data[y];
+        rows[2] = bmp->data[bmp_border_index((int)y + 1, height, border)];
+        bmp_convolve_row(job->out[y], rows, width, step, job->params, border);
+        // alpha is filtered along with the colours by the row kernel, then put back
+        for (x = 3; step == 4 && x < width; x += 4) {
+            job->out[y][x] = rows[1][x];
+        }
+        memset(job->out[y] + width, 0, row_size - width);
+    }
+}
+
+bmp_t *bmp_convolve(bmp_t *bmp, const bmp_kernel_t *kernel, const int border)
+{
+    bmp_conv_t conv;
+    bmp_job_t job = { bmp, NULL, border, 0, NULL, &conv };
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    if (bmp_check_direct_color(bmp)) {
+        return NULL;
+    }
+    if (bmp_flush(bmp) == NULL) {
+        return NULL;
+    }
+
+    bmp_conv_prepare(&conv, kernel);
+    job.out = bmp_acquire_rows(bmp);
+    if (job.out == NULL) {
+        return NULL;
+    }
+
+    bmp_parallel_rows(bmp->info.height, bmp_convolve_rows, &job);
+
+    // ping-pong: the old pixels become the output of the next filter call
+    bmp_recycle_pixels(bmp);
+    bmp->data = job.out;
+    bmp_changed(bmp);
+    return bmp;
+}
+
+bmp_t *bmp_blur(bmp_t *bmp)
+{
+    bmp_kernel_t kernel = {
+        {
+            {0, 1, 0},
+            {1, 1, 1},
+            {0, 1, 0},
+        }, 5, 0
+    };
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    return bmp_convolve(bmp, &kernel, BMP_BORDER_WRAP);
+}
+
+bmp_t *bmp_edges(bmp_t *bmp)
+{
+    bmp_kernel_t kernel = {
+        {
+            {-1, -1, -1},
+            {-1,  8, -1},
+            {-1, -1, -1},
+        }, 1, 0
+    };
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    return bmp_convolve(bmp, &kernel, BMP_BORDER_WRAP);
+}
+
+bmp_t *bmp_sharpen(bmp_t *bmp)
+{
+    bmp_kernel_t kernel = {
+        {
+            {-1, -1, -1},
+            {-1,  9, -1},
+            {-1, -1, -1},
+        }, 1, 0
+    };
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    return bmp_convolve(bmp, &kernel, BMP_BORDER_WRAP);
+}
+
+bmp_t *bmp_emboss(bmp_t *bmp)
+{
+    bmp_kernel_t kernel = {
+        {
+            {-1, -1,  0},
+            {-1,  0,  1},
+            { 0,  1,  1},
+        }, 1, 128
+    };
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    return bmp_convolve(bmp, &kernel, BMP_BORDER_WRAP);
+}
+
+bmp_t *bmp_mean(bmp_t *bmp)
+{
+    bmp_kernel_t kernel = {
+        {
+            {1, 1, 1},
+            {1, 1, 1},
+            {1, 1, 1},
+        }, 9, 0
+    };
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    return bmp_convolve(bmp, &kernel, BMP_BORDER_WRAP);
+}
+
+// bytes of a row handled by one vertical box pass task
+#define BMP_BOX_STRIP 192
+
+// largest box radius; the window sums are divided exactly up to 2^23 wide windows
+#define BMP_BOX_MAX_RADIUS ((1u << 22) - 1)
+
+// window sums go through floor((sum + window / 2) * mul >> shift), the rounded mean; with window < 2^bits
+// and shift = 8 + 2 * bits that is exact for every sum up to 255 * window, and stays within 64 bits
+static unsigned int bmp_box_reciprocal(const unsigned int window, unsigned long long *mul)
+{
+    unsigned int bits = 0;
+
+    while ((1u << bits) <= window) {
+        bits++;
+    }
+    *mul = ((1ULL << (8 + 2 * bits)) + window - 1) / window;
+    return 8 + 2 * bits;
+}
+
+// tab[i] is the border-mapped index of i - radius, for i in [0, n + 2 * radius]
+static int *bmp_border_table(const unsigned int n, const unsigned int radius, const int border)
+{
+    int *tab;
+    unsigned int i;
+
+    tab = malloc((n + 2 * radius + 1) * sizeof(int));
+    if (tab == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    for (i = 0; i < n + 2 * radius + 1; i++) {
+        tab[i] = bmp_border_index((int)i - (int)radius, n, border);
+    }
+    return tab;
+}
+
+// horizontal pass: sliding window sums along each row of job->bmp into job->out
+static void bmp_box_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_job_t *job = ctx;
+    const int *tab = job->params;
+    unsigned int width = job->bmp->info.width;
+    unsigned int step = job->bmp->info.bits_per_pixel / 8;
+    unsigned int window = 2 * job->arg + 1;
+    unsigned long long mul;
+    unsigned int shift = bmp_box_reciprocal(window, &mul);
+    const unsigned char *src;
+    unsigned char *dst;
+    unsigned int b;
+    unsigned int g;
+    unsigned int r;
+    unsigned int x;
+    unsigned int y;
+    int in;
+    int out;
+
+    for (y = y0; y < y1; y++) {
+        src = job->bmp->data[y];
+        dst = job->out[y];
+        b = g = r = 0;
+        for (x = 0; x < window - 1; x++) {
+            b += src[step * tab[x]];
+            g += src[step * tab[x] + 1];
+            r += src[step * tab[x] + 2];
+        }
+        for (x = 0; x < width; x++) {
+            in = step * tab[x + window - 1];
+            out = step * tab[x];
+            b += src[in];
+            g += src[in + 1];
+            r += src[in + 2];
+            dst[step * x] = (unsigned char)(((b + window / 2) * mul) >> shift);
+            dst[step * x + 1] = (unsigned char)(((g + window / 2) * mul) >> shift);
+            dst[step * x + 2] = (unsigned char)(((r + window / 2) * mul) >> shift);
+            b -= src[out];
+            g -= src[out + 1];
+            r -= src[out + 2];
+        }
+        // alpha is not blurred
+        for (x = 0; step == 4 && x < width; x++) {
+            dst[4 * x + 3] = src[4 * x + 3];
+        }
+    }
+}
+
+// vertical pass over strips of columns; running column sums keep it O(1) per pixel.
+// BMP_BOX_STRIP is a multiple of 12, so strips start on a pixel of either depth
+static void bmp_box_columns(void *ctx, unsigned int s0, unsigned int s1)
+{
+    bmp_job_t *job = ctx;
+    const int *tab = job->params;
+    unsigned int width = (job->bmp->info.width * job->bmp->info.bits_per_pixel) / 8;
+    unsigned int height = job->bmp->info.height;
+    unsigned int window = 2 * job->arg + 1;
+    unsigned long long mul;
+    unsigned int shift = bmp_box_reciprocal(window, &mul);
+    unsigned int sum[BMP_BOX_STRIP];
+    const unsigned char *in;
+    const unsigned char *out;
+    unsigned char *dst;
+    unsigned int x0;
+    unsigned int n;
+    unsigned int s;
+    unsigned int x;
+    unsigned int y;
+
+    for (s = s0; s < s1; s++) {
+        x0 = s * BMP_BOX_STRIP;
+        n = (width - x0 < BMP_BOX_STRIP) ? width - x0 : BMP_BOX_STRIP;
+        memset(sum, 0, sizeof(sum));
+        for (y = 0; y < window - 1; y++) {
+            in = job->bmp->data[tab[y]] + x0;
+            for (x = 0; x < n; x++) {
+                sum[x] += in[x];
+            }
+        }
+        for (y = 0; y < height; y++) {
+            in = job->bmp->data[tab[y + window - 1]] + x0;
+            out = job->bmp->data[tab[y]] + x0;
+            dst = job->out[y] + x0;
+            for (x = 0; x < n; x++) {
+                sum[x] += in[x];
+                dst[x] = (unsigned char)(((sum[x] + window / 2) * mul) >> shift);
+                sum[x] -= out[x];
+            }
+        }
+        // strips start on pixel boundaries; put the alpha of the row pass back
+        for (y = 0; job->bmp->info.bits_per_pixel == 32 && y < height; y++) {
+            in = job->bmp->data[y] + x0;
+            dst = job->out[y] + x0;
+            for (x = 3; x < n; x += 4) {
+                dst[x] = in[x];
+            }
+        }
+    }
+}
+
+bmp_t *bmp_box_blur(bmp_t *bmp, const unsigned int radius, const int border)
+{
+    unsigned int width = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
+    unsigned int row_size = get_row_size(bmp);
+    bmp_t temp;
+    bmp_job_t job = { bmp, NULL, (int)radius, 0, NULL, NULL };
+    unsigned char **out;
+    int *tab;
+    unsigned int y;
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    if (bmp_check_direct_color(bmp)) {
+        return NULL;
+    }
+    if (bmp_flush(bmp) == NULL) {
+        return NULL;
+    }
+    if (radius == 0 || bmp->info.width == 0 || bmp->info.height == 0) {
+        return bmp;
+    }
+    // a radius past both dimensions only piles up border copies, and past BMP_BOX_MAX_RADIUS the sums
+    // could not be divided exactly
+    if (radius > BMP_BOX_MAX_RADIUS || (radius > bmp->info.width && radius > bmp->info.height)) {
+        printf("Invalid radius: %u for a %ux%u image\n", radius, bmp->info.width, bmp->info.height);
+        return NULL;
+    }
+
+    // rows -> temp
+    temp = *bmp;
+    temp.map = NULL;
+    temp.data = bmp_acquire_rows(bmp);
+    tab = bmp_border_table(bmp->info.width, radius, border);
+    if (temp.data == NULL || tab == NULL) {
+        free(tab);
+        if (temp.data != NULL) {
+            bmp_recycle_pixels(&temp);
+        }
+        return NULL;
+    }
+    job.out = temp.data;
+    job.params = tab;
+    bmp_parallel_rows(bmp->info.height, bmp_box_rows, &job);
+    free(tab);
+
+    // columns of temp -> out
+    out = bmp_acquire_rows(bmp);
+    tab = bmp_border_table(bmp->info.height, radius, border);
+    if (out == NULL || tab == NULL) {
+        free(tab);
+        bmp_recycle_pixels(&temp);
+        // out came from the pool as well, so it goes back there
+        if (out != NULL) {
+            temp.data = out;
+            bmp_recycle_pixels(&temp);
+        }
+        return NULL;
+    }
+    job.bmp = &temp;
+    job.out = out;
+    job.params = tab;
+    bmp_parallel_rows((width + BMP_BOX_STRIP - 1) / BMP_BOX_STRIP, bmp_box_columns, &job);
+    free(tab);
+
+    for (y = 0; y < bmp->info.height; y++) {
+        memset(out[y] + width, 0, row_size - width);
+    }
+    bmp_recycle_pixels(&temp);
+    bmp_recycle_pixels(bmp);
+    bmp->data = out;
+    bmp_changed(bmp);
+    return bmp;
+}
+
+bmp_t *bmp_gaussian_blur(bmp_t *bmp, const double sigma, const int border)
+{
+    double ideal;
+    int lower;
+    int m;
+    int i;
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    assert(sigma > 0.0);
+
+    // three box passes of widths lower or lower + 2 whose combined variance matches sigma
+    ideal = sqrt(12.0 * sigma * sigma / 3.0 + 1.0);
+    lower = (int)floor(ideal);
+    if (lower % 2 == 0) {
+        lower--;
+    }
+    m = (int)floor((12.0 * sigma * sigma - 3.0 * lower * lower - 12.0 * lower - 9.0) / (-4.0 * lower - 4.0) + 0.5);
+
+    for (i = 0; i < 3; i++) {
+        if (bmp_box_blur(bmp, (unsigned int)(((i < m) ? lower : lower + 2) - 1) / 2, border) == NULL) {
+            return NULL;
+        }
+    }
+    return bmp;
+}
+
+// bytes of an output row handled at a time by the resize kernels; a multiple of 12, so strips hold whole pixels
+#define BMP_RESIZE_STRIP 192
+
+// fixed-point scale of resize weights; the taps of every output pixel sum to exactly this
+#define BMP_RESIZE_ONE (1 << 14)
+
+// per output column (or row) of a resize: the source pixels it reads and how much each one counts
+typedef struct {
+    unsigned int *index;                   // first source pixel read
+    unsigned int *taps;                    // weights of output i are weight[taps[i]] .. weight[taps[i + 1] - 1]
+    unsigned short *weight;                // of source pixels index[i], index[i] + 1, ...
+} bmp_resize_axis_t;
+
+typedef struct {
+    const bmp_resize_axis_t *x;
+    const bmp_resize_axis_t *y;
+    unsigned int width;                    // of the output
+    pthread_mutex_t lock;
+    int failed;                            // a band could not get its row of sums
+} bmp_resize_job_t;
+
+static void bmp_resize_axis_destroy(bmp_resize_axis_t *axis)
+{
+    free(axis->index);
+    free(axis->taps);
+    free(axis->weight);
+}
+
+// weight table mapping src pixels onto dst pixels along one axis; nearest gets one tap of BMP_RESIZE_ONE
+static int bmp_resize_axis(bmp_resize_axis_t *axis, const unsigned int src, const unsigned int dst, const int filter)
+{
+    unsigned long long lo;
+    unsigned long long hi;
+    unsigned long long a;
+    unsigned long long b;
+    unsigned int max = (filter == BMP_RESIZE_AREA) ? (src + dst - 1) / dst + 1 : 2;
+    unsigned int sum;
+    unsigned int big;
+    unsigned int n;
+    unsigned int i;
+    unsigned int k;
+    long long centre;
+
+    axis->index = malloc(dst * sizeof(unsigned int));
+    axis->taps = malloc((dst + 1) * sizeof(unsigned int));
+    axis->weight = malloc((size_t)dst * max * sizeof(unsigned short));
+    if (axis->index == NULL || axis->taps == NULL || axis->weight == NULL) {
+        perror("malloc");
+        bmp_resize_axis_destroy(axis);
+        return 1;
+    }
+    n = 0;
+    for (i = 0; i < dst; i++) {
+        axis->taps[i] = n;
+        if (filter == BMP_RESIZE_AREA) {
+            // output i spans [i * src, (i + 1) * src) and source k spans [k * dst, (k + 1) * dst), both in 1 / dst pixels
+            lo = (unsigned long long)i * src;
+            hi = lo + src;
+            axis->index[i] = (unsigned int)(lo / dst);
+            sum = 0;
+            big = n;
+            for (k = axis->index[i]; (unsigned long long)k * dst < hi; k++) {
+                a = ((unsigned long long)k * dst > lo) ? (unsigned long long)k * dst : lo;
+                b = ((unsigned long long)(k + 1) * dst < hi) ? (unsigned long long)(k + 1) * dst : hi;
+                axis->weight[n] = (unsigned short)(((b - a) * BMP_RESIZE_ONE + src / 2) / src);
+                sum += axis->weight[n];
+                if (axis->weight[n] > axis->weight[big]) {
+                    big = n;
+                }
+                n++;
+            }
+            // the rounding error, either way, goes to the largest tap
+            axis->weight[big] = (unsigned short)(axis->weight[big] + BMP_RESIZE_ONE - sum);
+        } else if (filter == BMP_RESIZE_BILINEAR) {
+            // the centre of output i, (i + 0.5) * src / dst - 0.5, in 1 / (2 * dst) source pixels
+            centre = (2LL * i + 1) * src - dst;
+            if (centre < 0) {
+                centre = 0;
+            }
+            axis->index[i] = (unsigned int)(centre / (2LL * dst));
+            a = (unsigned long long)((centre % (2LL * dst)) * BMP_RESIZE_ONE + dst) / (2ULL * dst);
+            if (axis->index[i] + 1 >= src || a == 0) {
+                axis->weight[n++] = BMP_RESIZE_ONE;
+            } else {
+                axis->weight[n++] = (unsigned short)(BMP_RESIZE_ONE - a);
+                axis->weight[n++] = (unsigned short)a;
+            }
+        } else {
+            axis->index[i] = (unsigned int)(((2ULL * i + 1) * src) / (2ULL * dst));
+            axis->weight[n++] = BMP_RESIZE_ONE;
+        }
+    }
+    axis->taps[dst] = n;
+    return 0;
+}
+
+static void bmp_resize_nearest_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_job_t *job = ctx;
+    const bmp_resize_job_t *resize = job->params;
+    const unsigned int *index = resize->x->index;
+    unsigned int step = job->bmp->info.bits_per_pixel / 8;
+    const unsigned char *src;
+    unsigned char *dst;
+    unsigned int x;
+    unsigned int y;
+
+    for (y = y0; y < y1; y++) {
+        src = job->bmp->data[resize->y->index[y]];
+        dst = job->out[y];
+        // fixed-size copies per depth, so they compile to plain moves
+        switch (step) {
+            case 1:
+                for (x = 0; x < resize->width; x++) {
+                    dst[x] = src[index[x]];
+                }
+                break;
+            case 2:
+                for (x = 0; x < resize->width; x++) {
+                    memcpy(dst + 2 * x, src + 2 * index[x], 2);
+                }
+                break;
+            case 3:
+                for (x = 0; x < resize->width; x++) {
+                    memcpy(dst + 3 * x, src + 3 * index[x], 3);
+                }
+                break;
+            default:
+                for (x = 0; x < resize->width; x++) {
+                    memcpy(dst + 4 * x, src + 4 * index[x], 4);
+                }
+                break;
+        }
+    }
+}
+
+// sum[i] += w * row[i] for n bytes; w is at most BMP_RESIZE_ONE, so the products need 32 bits
+static void bmp_resize_accumulate(unsigned int *sum, const unsigned char *row, const unsigned int w, const unsigned int n)
+{
+    unsigned int i = 0;
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i weight = _mm_set1_epi16((short)w);
+    __m128i p;
+    __m128i lo;
+    __m128i hi;
+
+    if (n >= 16) {
+        BMP_METRIC_SIMD();
+    }
+    for (; i + 16 <= n; i += 16) {
+        p = _mm_loadu_si128((const __m128i *)(row + i));
+        lo = _mm_unpacklo_epi8(p, zero);
+        hi = _mm_unpackhi_epi8(p, zero);
+        p = _mm_mullo_epi16(lo, weight);
+        lo = _mm_mulhi_epu16(lo, weight);
+        _mm_storeu_si128((__m128i *)(sum + i), _mm_add_epi32(_mm_loadu_si128((const __m128i *)(sum + i)),
+                    _mm_unpacklo_epi16(p, lo)));
+        _mm_storeu_si128((__m128i *)(sum + i + 4), _mm_add_epi32(_mm_loadu_si128((const __m128i *)(sum + i + 4)),
+                    _mm_unpackhi_epi16(p, lo)));
+        p = _mm_mullo_epi16(hi, weight);
+        hi = _mm_mulhi_epu16(hi, weight);
+        _mm_storeu_si128((__m128i *)(sum + i + 8), _mm_add_epi32(_mm_loadu_si128((const __m128i *)(sum + i + 8)),
+                    _mm_unpacklo_epi16(p, hi)));
+        _mm_storeu_si128((__m128i *)(sum + i + 12), _mm_add_epi32(_mm_loadu_si128((const __m128i *)(sum + i + 12)),
+                    _mm_unpackhi_epi16(p, hi)));
+    }
+#endif
+    for (; i < n; i++) {
+        sum[i] += w * row[i];
+    }
+}
+
+// separable weighted sum, rows first: the source rows under an output row are accumulated with packed
+// multiply-adds, then the columns of that one sum row are combined, so the per-tap work of the horizontal
+// pass is done once per output row instead of once per source row
+static void bmp_resize_filter_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_job_t *job = ctx;
+    bmp_resize_job_t *resize = (bmp_resize_job_t *)job->params;
+    const bmp_resize_axis_t *ax = resize->x;
+    const bmp_resize_axis_t *ay = resize->y;
+    unsigned int step = job->bmp->info.bits_per_pixel / 8;
+    unsigned int bytes = job->bmp->info.width * step;
+    unsigned int *sum;
+    const unsigned int *v;
+    unsigned char *dst;
+    unsigned int h[4];
+    unsigned int w;
+    unsigned int t;
+    unsigned int k;
+    unsigned int c;
+    unsigned int x;
+    unsigned int y;
+
+    sum = malloc((bytes ? bytes : 1) * sizeof(unsigned int));
+    if (sum == NULL) {
+        pthread_mutex_lock(&resize->lock);
+        if (!resize->failed) {
+            perror("malloc");
+        }
+        resize->failed = 1;
+        pthread_mutex_unlock(&resize->lock);
+        return;
+    }
+    for (y = y0; y < y1; y++) {
+        memset(sum, 0, bytes * sizeof(unsigned int));
+        for (t = ay->taps[y]; t < ay->taps[y + 1]; t++) {
+            bmp_resize_accumulate(sum, job->bmp->data[ay->index[y] + (t - ay->taps[y])], ay->weight[t], bytes);
+        }
+        dst = job->out[y];
+        for (x = 0; x < resize->width; x++, dst += step) {
+            v = sum + (size_t)step * ax->index[x];
+            h[0] = h[1] = h[2] = h[3] = 0;
+            for (k = ax->taps[x]; k < ax->taps[x + 1]; k++, v += step) {
+                // Q14 sums of bytes fit 22 bits; scaled to Q8 they leave room for the column weights
+                w = ax->weight[k];
+                for (c = 0; c < step; c++) {
+                    h[c] += w * (v[c] >> 6);
+                }
+            }
+            for (c = 0; c < step; c++) {
+                dst[c] = (unsigned char)((h[c] + (1u << 21)) >> 22);
+            }
+        }
+    }
+    free(sum);
+}
+
+// exact 2:1 reduction of `bytes` output bytes from source rows r0 and r1: the rounded mean of each
+// 2x2 block, which is what the area filter gives for this ratio; the rows are summed a strip at a time
+// with packed adds
+static void bmp_halve_span(const unsigned char *r0, const unsigned char *r1, unsigned char *dst,
+        const unsigned int bytes, const unsigned int step)
+{
+    unsigned short v[2 * BMP_RESIZE_STRIP];
+    unsigned int o;
+    unsigned int n;
+    unsigned int i;
+    unsigned int c;
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i two = _mm_set1_epi16(2);
+    __m128i a;
+    __m128i b;
+    __m128i lo;
+    __m128i hi;
+
+    // the vector loop runs once the first strip has 16 source bytes, 8 output bytes
+    if (bytes >= 8) {
+        BMP_METRIC_SIMD();
+    }
+#endif
+
+    for (o = 0; o < bytes; o += BMP_RESIZE_STRIP) {
+        n = (bytes - o < BMP_RESIZE_STRIP) ? bytes - o : BMP_RESIZE_STRIP;
+        i = 0;
+#ifdef __SSE2__
+        for (; i + 16 <= 2 * n; i += 16) {
+            a = _mm_loadu_si128((const __m128i *)(r0 + 2 * o + i));
+            b = _mm_loadu_si128((const __m128i *)(r1 + 2 * o + i));
+            _mm_storeu_si128((__m128i *)(v + i), _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)));
+            _mm_storeu_si128((__m128i *)(v + i + 8), _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)));
+        }
+#endif
+        for (; i < 2 * n; i++) {
+            v[i] = (unsigned short)(r0[2 * o + i] + r1[2 * o + i]);
+        }
+        // neighbouring pixels are step bytes apart; the common depths get unrolled loops
+        if (step == 3) {
+            for (i = 0; i < n; i += 3) {
+                dst[o + i] = (unsigned char)((v[2 * i] + v[2 * i + 3] + 2) >> 2);
+                dst[o + i + 1] = (unsigned char)((v[2 * i + 1] + v[2 * i + 4] + 2) >> 2);
+                dst[o + i + 2] = (unsigned char)((v[2 * i + 2] + v[2 * i + 5] + 2) >> 2);
+            }
+        } else if (step == 4) {
+            i = 0;
+#ifdef __SSE2__
+            // two output pixels per add: the pixel pairs sit in the low and high halves of the sums
+            for (; i + 16 <= n; i += 16) {
+                a = _mm_loadu_si128((const __m128i *)(v + 2 * i));
+                b = _mm_loadu_si128((const __m128i *)(v + 2 * i + 8));
+                lo = _mm_add_epi16(_mm_unpacklo_epi64(a, b), _mm_unpackhi_epi64(a, b));
+                a = _mm_loadu_si128((const __m128i *)(v + 2 * i + 16));
+                b = _mm_loadu_si128((const __m128i *)(v + 2 * i + 24));
+                hi = _mm_add_epi16(_mm_unpacklo_epi64(a, b), _mm_unpackhi_epi64(a, b));
+                lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+                hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+                _mm_storeu_si128((__m128i *)(dst + o + i), _mm_packus_epi16(lo, hi));
+            }
+#endif
+            for (; i < n; i++) {
+                dst[o + i] = (unsigned char)((v[2 * i - i % 4] + v[2 * i - i % 4 + 4] + 2) >> 2);
+            }
+        } else {
+            for (i = 0; i < n; i += step) {
+                for (c = 0; c < step; c++) {
+                    dst[o + i + c] = (unsigned char)((v[2 * i + c] + v[2 * i + step + c] + 2) >> 2);
+                }
+            }
+        }
+    }
+}
+
+static void bmp_resize_halve_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_job_t *job = ctx;
+    const bmp_resize_job_t *resize = job->params;
+    unsigned int step = job->bmp->info.bits_per_pixel / 8;
+    unsigned int y;
+
+    for (y = y0; y < y1; y++) {
+        bmp_halve_span(job->bmp->data[2 * y], job->bmp->data[2 * y + 1], job->out[y], resize->width * step, step);
+    }
+}
+
+bmp_t *bmp_resize(bmp_t *bmp, const unsigned int width, const unsigned int height, const int filter)
+{
+    bmp_t *out;
+    bmp_resize_axis_t ax;
+    bmp_resize_axis_t ay;
+    bmp_resize_job_t resize;
+    bmp_job_t job = { bmp, NULL, 0, 0, NULL, NULL };
+    unsigned int sw = bmp->info.width;
+    unsigned int sh = bmp->info.height;
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    if (width == 0 || height == 0 || sw == 0 || sh == 0) {
+        printf("Invalid size: %ux%u to %ux%u\n", sw, sh, width, height);
+        return NULL;
+    }
+    if (filter != BMP_RESIZE_NEAREST && filter != BMP_RESIZE_BILINEAR && filter != BMP_RESIZE_AREA) {
+        printf("Unknown resize filter: %d\n", filter);
+        return NULL;
+    }
+    if (filter != BMP_RESIZE_NEAREST && bmp_check_direct_color(bmp)) {
+        return NULL;
+    }
+    if (bmp_flush(bmp) == NULL) {
+        return NULL;
+    }
+
+    out = malloc(sizeof(bmp_t));
+    if (out == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    *out = *bmp;
+    bmp_init(out);
+    out->top_down = bmp->top_down;
+    out->info.width = width;
+    out->info.height = height;
+    out->info.image_size = get_pixel_array_size(out);
+    out->data = bmp_alloc_rows(out, height);
+    if (bmp->palette != NULL) {
+        out->palette = malloc(1024);
+        if (out->palette != NULL) {
+            memcpy(out->palette, bmp->palette, 1024);
+        }
+    }
+    if (out->data == NULL || (bmp->palette != NULL && out->palette == NULL)) {
+        if (out->data != NULL) {
+            bmp_free_pixels(out);
+        }
+        free(out->palette);
+        free(out);
+        return NULL;
+    }
+    if (bmp_resize_axis(&ax, sw, width, filter)) {
+        bmp_destroy(out);
+        return NULL;
+    }
+    if (bmp_resize_axis(&ay, sh, height, filter)) {
+        bmp_resize_axis_destroy(&ax);
+        bmp_destroy(out);
+        return NULL;
+    }
+
+    resize.x = &ax;
+    resize.y = &ay;
+    resize.width = width;
+    resize.failed = 0;
+    pthread_mutex_init(&resize.lock, NULL);
+    job.out = out->data;
+    job.params = &resize;
+    if (filter == BMP_RESIZE_NEAREST) {
+        bmp_parallel_rows(height, bmp_resize_nearest_rows, &job);
+    } else if (filter == BMP_RESIZE_AREA && sw == 2 * width && sh == 2 * height) {
+        bmp_parallel_rows(height, bmp_resize_halve_rows, &job);
+    } else {
+        bmp_parallel_rows(height, bmp_resize_filter_rows, &job);
+    }
+    pthread_mutex_destroy(&resize.lock);
+    bmp_resize_axis_destroy(&ax);
+    bmp_resize_axis_destroy(&ay);
+    if (resize.failed) {
+        bmp_destroy(out);
+        return NULL;
+    }
+    return out;
+}
+
+// side of the square tiles, in pixels of their own level, that pyramid levels are rebuilt by
+#ifndef BMP_PYRAMID_TILE
+#define BMP_PYRAMID_TILE 64
+#endif
+
+static unsigned int bmp_pyramid_tiles_x(const bmp_t *level)
+{
+    return (level->info.width + BMP_PYRAMID_TILE - 1) / BMP_PYRAMID_TILE;
+}
+
+static unsigned int bmp_pyramid_tiles_y(const bmp_t *level)
+{
+    return (level->info.height + BMP_PYRAMID_TILE - 1) / BMP_PYRAMID_TILE;
+}
+
+static void bmp_pyramid_free_levels(bmp_pyramid_t *pyramid)
+{
+    free(pyramid->levels);
+    free(pyramid->block);
+    free(pyramid->rows);
+    free(pyramid->dirty);
+    free(pyramid->tiles);
+    pyramid->levels = NULL;
+    pyramid->block = NULL;
+    pyramid->rows = NULL;
+    pyramid->dirty = NULL;
+    pyramid->tiles = NULL;
+    pyramid->count = 0;
+}
+
+// sizes every level after the base's current geometry and allocates them, all tiles dirty
+static int bmp_pyramid_layout(bmp_pyramid_t *pyramid)
+{
+    bmp_t *base = pyramid->bmp;
+    bmp_t *level;
+    size_t pixels = 0;
+    unsigned int rows = 0;
+    unsigned int tiles = 0;
+    unsigned int count = 1;
+    unsigned int w = base->info.width;
+    unsigned int h = base->info.height;
+    unsigned int i;
+    unsigned int y;
+
+    bmp_pyramid_free_levels(pyramid);
+    while (w / 2 > 0 && h / 2 > 0) {
+        w /= 2;
+        h /= 2;
+        count++;
+    }
+    pyramid->levels = malloc(count * sizeof(bmp_t));
+    pyramid->tiles = malloc(count * sizeof(unsigned int));
+    if (pyramid->levels == NULL || pyramid->tiles == NULL) {
+        perror("malloc");
+        bmp_pyramid_free_levels(pyramid);
+        return 1;
+    }
+    for (i = 0; i < count; i++) {
+        level = &pyramid->levels[i];
+        *level = *base;
+        bmp_init(level);
+        level->info.width = (i == 0) ? base->info.width : pyramid->levels[i - 1].info.width / 2;
+        level->info.height = (i == 0) ? base->info.height : pyramid->levels[i - 1].info.height / 2;
+        level->info.image_size = get_pixel_array_size(level);
+        level->data = NULL;
+        pyramid->tiles[i] = tiles;
+        if (i > 0) {
+            pixels += level->info.image_size;
+            rows += level->info.height;
+            tiles += bmp_pyramid_tiles_x(level) * bmp_pyramid_tiles_y(level);
+        }
+    }
+    pyramid->count = count;
+    pyramid->block = calloc(pixels + 1, 1);
+    pyramid->rows = malloc((rows + 1) * sizeof(unsigned char *));
+    pyramid->dirty = malloc(tiles + 1);
+    BMP_METRIC_ALLOC(pixels);
+    if (pyramid->block == NULL || pyramid->rows == NULL || pyramid->dirty == NULL) {
+        perror("malloc");
+        bmp_pyramid_free_levels(pyramid);
+        return 1;
+    }
+    memset(pyramid->dirty, 1, tiles + 1);
+
+    // levels follow each other in the block, biggest first
+    pixels = 0;
+    rows = 0;
+    for (i = 1; i < count; i++) {
+        level = &pyramid->levels[i];
+        level->data = pyramid->rows + rows;
+        for (y = 0; y < level->info.height; y++) {
+            level->data[y] = pyramid->block + pixels + (size_t)get_row_size(level) * y;
+        }
+        pixels += level->info.image_size;
+        rows += level->info.height;
+    }
+    pyramid->width = base->info.width;
+    pyramid->height = base->info.height;
+    pyramid->bits = base->info.bits_per_pixel;
+    return 0;
+}
+
+bmp_pyramid_t *bmp_pyramid(bmp_t *bmp)
+{
+    bmp_pyramid_t *pyramid;
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    if (bmp->pyramid != NULL) {
+        return bmp->pyramid;
+    }
+    if (bmp_check_direct_color(bmp)) {
+        return NULL;
+    }
+    pyramid = calloc(1, sizeof(bmp_pyramid_t));
+    if (pyramid == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    pyramid->bmp = bmp;
+    if (bmp_pyramid_layout(pyramid)) {
+        free(pyramid);
+        return NULL;
+    }
+    bmp->pyramid = pyramid;
+    return pyramid;
+}
+
+void bmp_pyramid_destroy(bmp_pyramid_t *pyramid)
+{
+    pyramid->bmp->pyramid = NULL;
+    bmp_pyramid_free_levels(pyramid);
+    free(pyramid);
+}
+
+void bmp_pyramid_invalidate(bmp_t *bmp, const unsigned int x, const unsigned int y, const unsigned int w,
+        const unsigned int h)
+{
+    bmp_pyramid_t *pyramid = bmp->pyramid;
+    unsigned long long x1 = (unsigned long long)x + w;
+    unsigned long long y1 = (unsigned long long)y + h;
+    const bmp_t *level;
+    unsigned int tx0;
+    unsigned int tx1;
+    unsigned int ty0;
+    unsigned int ty1;
+    unsigned int tx;
+    unsigned int ty;
+    unsigned int i;
+
+    if (pyramid == NULL || w == 0 || h == 0) {
+        return;
+    }
+    // pixel p of level i is made from base pixels [p << i, (p + 1) << i)
+    for (i = 1; i < pyramid->count; i++) {
+        level = &pyramid->levels[i];
+        if ((x >> i) >= level->info.width || (y >> i) >= level->info.height) {
+            break;
+        }
+        tx0 = (x >> i) / BMP_PYRAMID_TILE;
+        ty0 = (y >> i) / BMP_PYRAMID_TILE;
+        tx1 = (unsigned int)((((x1 - 1) >> i) < level->info.width ? ((x1 - 1) >> i) : level->info.width - 1)
+                / BMP_PYRAMID_TILE);
+        ty1 = (unsigned int)((((y1 - 1) >> i) < level->info.height ? ((y1 - 1) >> i) : level->info.height - 1)
+                / BMP_PYRAMID_TILE);
+        for (ty = ty0; ty <= ty1; ty++) {
+            for (tx = tx0; tx <= tx1; tx++) {
+                pyramid->dirty[pyramid->tiles[i] + ty * bmp_pyramid_tiles_x(level) + tx] = 1;
+            }
+        }
+    }
+}
+
+// rebuilds the dirty tiles in rows of tiles [t0, t1) of level job->arg from the level above it
+static void bmp_pyramid_rows(void *ctx, unsigned int t0, unsigned int t1)
+{
+    bmp_job_t *job = ctx;
+    bmp_pyramid_t *pyramid = (bmp_pyramid_t *)job->params;
+    const bmp_t *src = job->bmp;
+    const bmp_t *level = &pyramid->levels[job->arg];
+    unsigned char *dirty = pyramid->dirty + pyramid->tiles[job->arg];
+    unsigned int step = level->info.bits_per_pixel / 8;
+    unsigned int tiles = bmp_pyramid_tiles_x(level);
+    unsigned int x0;
+    unsigned int x1;
+    unsigned int y1;
+    unsigned int tx;
+    unsigned int ty;
+    unsigned int y;
+
+    for (ty = t0; ty < t1; ty++) {
+        y1 = (ty + 1) * BMP_PYRAMID_TILE < level->info.height ? (ty + 1) * BMP_PYRAMID_TILE : level->info.height;
+        for (tx = 0; tx < tiles; tx++) {
+            if (!dirty[ty * tiles + tx]) {
+                continue;
+            }
+            // runs of neighbouring dirty tiles are reduced together
+            x0 = tx * BMP_PYRAMID_TILE;
+            while (tx + 1 < tiles && dirty[ty * tiles + tx + 1]) {
+                dirty[ty * tiles + tx] = 0;
+                tx++;
+            }
+            dirty[ty * tiles + tx] = 0;
+            x1 = (tx + 1) * BMP_PYRAMID_TILE < level->info.width ? (tx + 1) * BMP_PYRAMID_TILE : level->info.width;
+            for (y = ty * BMP_PYRAMID_TILE; y < y1; y++) {
+                bmp_halve_span(src->data[2 * y] + 2 * step * x0, src->data[2 * y + 1] + 2 * step * x0,
+                        level->data[y] + step * x0, step * (x1 - x0), step);
+            }
+        }
+    }
+}
+
+bmp_t *bmp_pyramid_level(bmp_pyramid_t *pyramid, const unsigned int level)
+{
+    bmp_t *base = pyramid->bmp;
+    bmp_job_t job = { NULL, NULL, 0, 0, NULL, pyramid };
+    unsigned int tiles;
+    unsigned int i;
+    BMP_METRIC(pyramid->width, pyramid->height);
+
+    if (bmp_flush(base) == NULL || bmp_check_direct_color(base)) {
+        return NULL;
+    }
+    // a conversion changed the base under the pyramid, so every level starts over
+    if (base->info.width != pyramid->width || base->info.height != pyramid->height
+            || base->info.bits_per_pixel != pyramid->bits) {
+        if (bmp_pyramid_layout(pyramid)) {
+            return NULL;
+        }
+    }
+    if (level >= pyramid->count) {
+        printf("Invalid pyramid level: %u of %u\n", level, pyramid->count);
+        return NULL;
+    }
+    // each level is brought up to date from the one above, base first
+    for (i = 1; i <= level; i++) {
+        tiles = bmp_pyramid_tiles_x(&pyramid->levels[i]) * bmp_pyramid_tiles_y(&pyramid->levels[i]);
+        if (memchr(pyramid->dirty + pyramid->tiles[i], 1, tiles) == NULL) {
+            continue;
+        }
+        job.bmp = (i == 1) ? base : &pyramid->levels[i - 1];
+        job.arg = (int)i;
+        bmp_parallel_rows(bmp_pyramid_tiles_y(&pyramid->levels[i]), bmp_pyramid_rows, &job);
+    }
+    return (level == 0) ? base : &pyramid->levels[level];
+}
+
+unsigned int bmp_pyramid_levels(bmp_pyramid_t *pyramid)
+{
+    return pyramid->count;
+}
+
+bmp_t *bmp_pyramid_view(bmp_pyramid_t *pyramid, const unsigned int width, const unsigned int height, const int filter)
+{
+    bmp_t *level;
+    unsigned int i = 0;
+    BMP_METRIC(pyramid->width, pyramid->height);
+
+    if (bmp_pyramid_level(pyramid, 0) == NULL) {
+        return NULL;
+    }
+    // the smallest level that still has every output pixel's worth of detail
+    while (i + 1 < pyramid->count && pyramid->levels[i + 1].info.width >= width
+            && pyramid->levels[i + 1].info.height >= height) {
+        i++;
+    }
+    level = bmp_pyramid_level(pyramid, i);
+    if (level == NULL) {
+        return NULL;
+    }
+    return bmp_resize(level, width, height, filter);
+}
+
+// entries of the integral image handled by one column pass task
+#define BMP_INTEGRAL_STRIP 64
+
+// row pass: prefix sums along every row, written one row and one column down
+static void bmp_integral_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_job_t *job = ctx;
+    bmp_integral_t *ii = (bmp_integral_t *)job->params;
+    unsigned int stride = 3 * (ii->width + 1);
+    unsigned int step = job->bmp->info.bits_per_pixel / 8;
+    const unsigned char *src;
+    unsigned long long *sum;
+    unsigned long long *sq;
+    unsigned long long s[3];
+    unsigned long long q[3];
+    unsigned int x;
+    unsigned int y;
+    unsigned int c;
+
+    for (y = y0; y < y1; y++) {
+        src = job->bmp->data[y];
+        sum = ii->sum + (size_t)(y + 1) * stride;
+        sq = (ii->squares != NULL) ? ii->squares + (size_t)(y + 1) * stride : NULL;
+        s[0] = s[1] = s[2] = 0;
+        q[0] = q[1] = q[2] = 0;
+        sum[0] = sum[1] = sum[2] = 0;
+        if (sq != NULL) {
+            sq[0] = sq[1] = sq[2] = 0;
+        }
+        for (x = 0; x < ii->width; x++) {
+            for (c = 0; c < 3; c++) {
+                s[c] += src[step * x + c];
+                sum[3 * (x + 1) + c] = s[c];
+            }
+            if (sq != NULL) {
+                for (c = 0; c < 3; c++) {
+                    q[c] += src[step * x + c] * src[step * x + c];
+                    sq[3 * (x + 1) + c] = q[c];
+                }
+            }
+        }
+    }
+}
+
+// column pass: accumulates the row prefixes downwards, one strip of entries per task
+static void bmp_integral_columns(void *ctx, unsigned int s0, unsigned int s1)
+{
+    bmp_job_t *job = ctx;
+    bmp_integral_t *ii = (bmp_integral_t *)job->params;
+    size_t stride = 3 * (ii->width + 1);
+    unsigned long long *table;
+    unsigned long long *row;
+    unsigned int x0;
+    unsigned int x1;
+    unsigned int x;
+    unsigned int y;
+    unsigned int s;
+    int t;
+
+    for (t = 0; t < 2; t++) {
+        table = (t == 0) ? ii->sum : ii->squares;
+        if (table == NULL) {
+            continue;
+        }
+        for (s = s0; s < s1; s++) {
+            x0 = s * BMP_INTEGRAL_STRIP;
+            x1 = (stride - x0 < BMP_INTEGRAL_STRIP) ? (unsigned int)stride : x0 + BMP_INTEGRAL_STRIP;
+            for (y = 2; y <= ii->height; y++) {
+                row = table + y * stride;
+                for (x = x0; x < x1; x++) {
+                    row[x] += row[x - stride];
+                }
+            }
+        }
+    }
+}
+
+bmp_integral_t *bmp_integral(bmp_t *bmp, const int squares)
+{
+    bmp_integral_t *ii;
+    bmp_job_t job = { bmp, NULL, 0, 0, NULL, NULL };
+    size_t entries = (size_t)3 * (bmp->info.width + 1) * (bmp->info.height + 1);
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    if (bmp_check_direct_color(bmp)) {
+        return NULL;
+    }
+    if (bmp_flush(bmp) == NULL) {
+        return NULL;
+    }
+
+    ii = malloc(sizeof(bmp_integral_t));
+    if (ii == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    ii->width = bmp->info.width;
+    ii->height = bmp->info.height;
+    ii->sum = malloc(entries * sizeof(unsigned long long));
+    ii->squares = squares ? malloc(entries * sizeof(unsigned long long)) : NULL;
+    BMP_METRIC_ALLOC((squares ? 2 : 1) * entries * sizeof(unsigned long long));
+    if (ii->sum == NULL || (squares && ii->squares == NULL)) {
+        perror("malloc");
+        bmp_integral_destroy(ii);
+        return NULL;
+    }
+    // the top row stays zero; the row pass fills in the left column
+    memset(ii->sum, 0, 3 * (ii->width + 1) * sizeof(unsigned long long));
+    if (ii->squares != NULL) {
+        memset(ii->squares, 0, 3 * (ii->width + 1) * sizeof(unsigned long long));
+    }
+
+    job.params = ii;
+    bmp_parallel_rows(ii->height, bmp_integral_rows, &job);
+    bmp_parallel_rows((3 * (ii->width + 1) + BMP_INTEGRAL_STRIP - 1) / BMP_INTEGRAL_STRIP, bmp_integral_columns, &job);
+    return ii;
+}
+
+void bmp_integral_destroy(bmp_integral_t *ii)
+{
+    free(ii->sum);
+    free(ii->squares);
+    free(ii);
+}
+
+// sums of a table over the rectangle, four lookups per channel
+static void bmp_integral_lookup(
+    const bmp_integral_t *ii,
+    const unsigned long long *table,
+    const unsigned int x,
+    const unsigned int y,
+    const unsigned int w,
+    const unsigned int h,
+    unsigned long long sum[3])
+{
+    size_t stride = 3 * (ii->width + 1);
+    const unsigned long long *top = table + y * stride + 3 * x;
+    const unsigned long long *bottom = table + (y + h) * stride + 3 * x;
+    unsigned int c;
+
+    for (c = 0; c < 3; c++) {
+        sum[c] = bottom[3 * w + c] - bottom[c] - top[3 * w + c] + top[c];
+    }
+}
+
+void bmp_region_sum(
+    const bmp_integral_t *ii,
+    const unsigned int x,
+    const unsigned int y,
+    const unsigned int w,
+    const unsigned int h,
+    unsigned long long sum[3])
+{
+    assert(x + w <= ii->width);
+    assert(y + h <= ii->height);
+
+    bmp_integral_lookup(ii, ii->sum, x, y, w, h, sum);
+}
+
+void bmp_region_mean(
+    const bmp_integral_t *ii,
+    const unsigned int x,
+    const unsigned int y,
+    const unsigned int w,
+    const unsigned int h,
+    double mean[3])
+{
+    unsigned long long sum[3];
+    double n = (double)w * h;
+    unsigned int c;
+
+    bmp_region_sum(ii, x, y, w, h, sum);
+    for (c = 0; c < 3; c++) {
+        mean[c] = (n > 0) ? sum[c] / n : 0.0;
+    }
+}
+
+void bmp_region_variance(
+    const bmp_integral_t *ii,
+    const unsigned int x,
+    const unsigned int y,
+    const unsigned int w,
+    const unsigned int h,
+    double variance[3])
+{
+    unsigned long long sum[3];
+    unsigned long long sq[3];
+    double n = (double)w * h;
+    double mean;
+    unsigned int c;
+
+    assert(ii->squares != NULL);
+
+    bmp_region_sum(ii, x, y, w, h, sum);
+    bmp_integral_lookup(ii, ii->squares, x, y, w, h, sq);
+    for (c = 0; c < 3; c++) {
+        mean = (n > 0) ? sum[c] / n : 0.0;
+        variance[c] = (n > 0) ? sq[c] / n - mean * mean : 0.0;
+        if (variance[c] < 0.0) {
+            variance[c] = 0.0;
+        }
+    }
+}
+
+// pixels one band may count in 32-bit sub-histograms before folding them into the totals
+#define BMP_STATS_FOLD (1u << 30)
+
+typedef struct {
+    bmp_stats_t *stats;
+    pthread_mutex_t lock;
+} bmp_stats_job_t;
+
+// adds the sub-histograms into the 64-bit totals and clears them
+static void bmp_stats_fold(unsigned long long total[4][256], unsigned int sub[4][4][256])
+{
+    unsigned int c;
+    unsigned int v;
+
+    for (c = 0; c < 4; c++) {
+        for (v = 0; v < 256; v++) {
+            total[c][v] += (unsigned long long)sub[0][c][v] + sub[1][c][v] + sub[2][c][v] + sub[3][c][v];
+        }
+    }
+    memset(sub, 0, 4 * 4 * 256 * sizeof(unsigned int));
+}
+
+// counts a band into four interleaved sub-histograms, so that runs of equal
+// pixels do not serialize on the same counter, then merges into the shared result
+static void bmp_stats_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_job_t *job = ctx;
+    bmp_stats_job_t *sj = (bmp_stats_job_t *)job->params;
+    unsigned int width = job->bmp->info.width;
+    unsigned int step = job->bmp->info.bits_per_pixel / 8;
+    unsigned int sub[4][4][256];
+    unsigned long long total[4][256];
+    unsigned long long counted = 0;
+    const unsigned char *p;
+    unsigned int x;
+    unsigned int y;
+    unsigned int c;
+    unsigned int v;
+    unsigned int k;
+
+    memset(sub, 0, sizeof(sub));
+    memset(total, 0, sizeof(total));
+
+    for (y = y0; y < y1; y++) {
+        p = job->bmp->data[y];
+        for (x = 0; x + 4 <= width; x += 4, p += 4 * step) {
+            for (k = 0; k < 4; k++) {
+                sub[k][0][p[step * k]]++;
+                sub[k][1][p[step * k + 1]]++;
+                sub[k][2][p[step * k + 2]]++;
+                sub[k][3][(19 * p[step * k] + 183 * p[step * k + 1] + 54 * p[step * k + 2] + 128) >> 8]++;
+            }
+        }
+        for (; x < width; x++, p += step) {
+            sub[0][0][p[0]]++;
+            sub[0][1][p[1]]++;
+            sub[0][2][p[2]]++;
+            sub[0][3][(19 * p[0] + 183 * p[1] + 54 * p[2] + 128) >> 8]++;
+        }
+        counted += width;
+        if (counted >= BMP_STATS_FOLD) {
+            bmp_stats_fold(total, sub);
+            counted = 0;
+        }
+    }
+    bmp_stats_fold(total, sub);
+
+    pthread_mutex_lock(&sj->lock);
+    for (c = 0; c < 4; c++) {
+        for (v = 0; v < 256; v++) {
+            sj->stats->histogram[c][v] += total[c][v];
+        }
+    }
+    pthread_mutex_unlock(&sj->lock);
+}
+
+bmp_stats_t *bmp_stats(bmp_t *bmp, bmp_stats_t *stats)
+{
+    bmp_stats_job_t sj;
+    bmp_job_t job = { bmp, NULL, 0, 0, NULL, NULL };
+    unsigned long long n = (unsigned long long)bmp->info.width * bmp->info.height;
+    double sum;
+    double squares;
+    double mean;
+    unsigned int c;
+    unsigned int v;
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    if (bmp_check_direct_color(bmp)) {
+        return NULL;
+    }
+    if (bmp_flush(bmp) == NULL) {
+        return NULL;
+    }
+
+    memset(stats, 0, sizeof(bmp_stats_t));
+    sj.stats = stats;
+    pthread_mutex_init(&sj.lock, NULL);
+    job.params = &sj;
+    bmp_parallel_rows(bmp->info.height, bmp_stats_rows, &job);
+    pthread_mutex_destroy(&sj.lock);
+
+    // everything else follows from the histograms
+    for (c = 0; c < 4; c++) {
+        stats->min[c] = 255;
+        sum = 0.0;
+        squares = 0.0;
+        for (v = 0; v < 256; v++) {
+            if (stats->histogram[c][v] == 0) {
+                continue;
+            }
+            if (v < stats->min[c]) {
+                stats->min[c] = (unsigned char)v;
+            }
+            stats->max[c] = (unsigned char)v;
+            sum += (double)stats->histogram[c][v] * v;
+            squares += (double)stats->histogram[c][v] * v * v;
+        }
+        if (n == 0) {
+            stats->min[c] = 0;
+            continue;
+        }
+        mean = sum / n;
+        stats->mean[c] = mean;
+        stats->stddev[c] = (squares / n > mean * mean) ? sqrt(squares / n - mean * mean) : 0.0;
+    }
+    return stats;
+}
+
+typedef struct {
+    bmp_planar_t *planar;
+    const bmp_planar_t *other;
+    bmp_t *bmp;                            // interleaved side of a conversion
+    unsigned char *out;                    // destination block of a convolution
+    const void *params;
+    int arg;
+} bmp_planar_job_t;
+
+static unsigned char *bmp_planar_alloc(const bmp_planar_t *planar)
+{
+    void *block;
+    size_t size = (size_t)3 * planar->stride * planar->height;
+
+    if (posix_memalign(&block, BMP_PLANAR_ALIGN, size ? size : BMP_PLANAR_ALIGN) != 0) {
+        perror("posix_memalign");
+        return NULL;
+    }
+    BMP_METRIC_ALLOC(size);
+    // padding is never read, but keep it deterministic
+    memset(block, 0, size);
+    return block;
+}
+
+static void bmp_planar_set_block(bmp_planar_t *planar, unsigned char *block)
+{
+    unsigned int c;
+
+    for (c = 0; c < 3; c++) {
+        planar->planes[c] = block + (size_t)c * planar->stride * planar->height;
+    }
+}
+
+// plane rows are numbered 0 .. 3 * height - 1, blue first
+static unsigned char *bmp_planar_row(const bmp_planar_t *planar, unsigned char *block, const unsigned int r)
+{
+    return block + (size_t)(r / planar->height) * planar->stride * planar->height
+        + (size_t)(r % planar->height) * planar->stride;
+}
+
+static void bmp_planar_split_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_planar_job_t *job = ctx;
+    bmp_planar_t *planar = job->planar;
+    const unsigned char *src;
+    unsigned char *b;
+    unsigned char *g;
+    unsigned char *r;
+    unsigned int step = job->bmp->info.bits_per_pixel / 8;
+    unsigned int x;
+    unsigned int y;
+#ifdef __SSSE3__
+    __m128i ch[3];
+#endif
+
+    for (y = y0; y < y1; y++) {
+        src = job->bmp->data[y];
+        b = planar->planes[0] + (size_t)y * planar->stride;
+        g = planar->planes[1] + (size_t)y * planar->stride;
+        r = planar->planes[2] + (size_t)y * planar->stride;
+        x = 0;
+#ifdef __SSSE3__
+        // plane rows are aligned, so the stores are too
+        for (; x + 16 <= planar->width; x += 16) {
+            if (step == 3) {
+                bmp_split3(src + 3 * x, ch);
+            } else {
+                bmp_split4(src + 4 * x, ch);
+            }
+            _mm_store_si128((__m128i *)(b + x), ch[0]);
+            _mm_store_si128((__m128i *)(g + x), ch[1]);
+            _mm_store_si128((__m128i *)(r + x), ch[2]);
+        }
+#endif
+        for (; x < planar->width; x++) {
+            b[x] = src[step * x];
+            g[x] = src[step * x + 1];
+            r[x] = src[step * x + 2];
+        }
+    }
+}
+
+static void bmp_planar_merge_row(const bmp_planar_t *planar, const unsigned int y, unsigned char *dst)
+{
+    const unsigned char *b = planar->planes[0] + (size_t)y * planar->stride;
+    const unsigned char *g = planar->planes[1] + (size_t)y * planar->stride;
+    const unsigned char *r = planar->planes[2] + (size_t)y * planar->stride;
+    unsigned int x = 0;
+#ifdef __SSSE3__
+    __m128i ch[3];
+
+    for (; x + 16 <= planar->width; x += 16) {
+        ch[0] = _mm_load_si128((const __m128i *)(b + x));
+        ch[1] = _mm_load_si128((const __m128i *)(g + x));
+        ch[2] = _mm_load_si128((const __m128i *)(r + x));
+        bmp_merge3(ch, dst + 3 * x);
+    }
+#endif
+    for (; x < planar->width; x++) {
+        dst[3 * x] = b[x];
+        dst[3 * x + 1] = g[x];
+        dst[3 * x + 2] = r[x];
+    }
+}
+
+static void bmp_planar_merge_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_planar_job_t *job = ctx;
+    unsigned int y;
+
+    for (y = y0; y < y1; y++) {
+        bmp_planar_merge_row(job->planar, y, job->bmp->data[y]);
+    }
+}
+
+bmp_planar_t *bmp_planar_from(bmp_t *bmp)
+{
+    bmp_planar_t *planar;
+    bmp_planar_job_t job;
+    unsigned char *block;
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    if (bmp_check_direct_color(bmp)) {
+        return NULL;
+    }
+    if (bmp_flush(bmp) == NULL) {
+        return NULL;
+    }
+
+    planar = malloc(sizeof(bmp_planar_t));
+    if (planar == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    planar->header = bmp->header;
+    planar->info = bmp->info;
+    // the planes hold colour only, so the bitmap comes back as 24 bit
+    planar->info.bits_per_pixel = 24;
+    planar->info.compression = BMP_BI_RGB;
+    planar->info.colors = 0;
+    planar->width = bmp->info.width;
+    planar->height = bmp->info.height;
+    planar->stride = (planar->width + BMP_PLANAR_ALIGN - 1) / BMP_PLANAR_ALIGN * BMP_PLANAR_ALIGN;
+    planar->spare = NULL;
+    block = bmp_planar_alloc(planar);
+    if (block == NULL) {
+        free(planar);
+        return NULL;
+    }
+    bmp_planar_set_block(planar, block);
+
+    job.planar = planar;
+    job.bmp = bmp;
+    bmp_parallel_rows(planar->height, bmp_planar_split_rows, &job);
+    return planar;
+}
+
+bmp_t *bmp_planar_to(const bmp_planar_t *planar)
+{
+    bmp_planar_job_t job;
+    bmp_t *bmp;
+    BMP_METRIC(planar->width, planar->height);
+
+    bmp = bmp_create(planar->width, planar->height);
+    if (bmp == NULL) {
+        return NULL;
+    }
+    bmp->header = planar->header;
+    bmp->info = planar->info;
+
+    job.planar = (bmp_planar_t *)planar;
+    job.bmp = bmp;
+    bmp_parallel_rows(planar->height, bmp_planar_merge_rows, &job);
+    return bmp;
+}
+
+bmp_planar_t *bmp_planar_load(const char *path)
+{
+    bmp_planar_t *planar;
+    bmp_t *bmp;
+    BMP_METRIC(0, 0);
+
+    bmp = bmp_map(path, BMP_MAP_READONLY);
+    if (bmp == NULL) {
+        return NULL;
+    }
+    // the interleaved pixels are only ever seen through the mapping
+    planar = bmp_planar_from(bmp);
+    bmp_destroy(bmp);
+    return planar;
+}
+
+int bmp_planar_write(const bmp_planar_t *planar, const char *path)
+{
+    bmp_t image;
+    unsigned char *row;
+    unsigned int row_size;
+    unsigned int y;
+    FILE *f;
+    BMP_METRIC(planar->width, planar->height);
+
+    bmp_init(&image);
+    image.header = planar->header;
+    image.info = planar->info;
+    row_size = get_row_size(&image);
+
+    f = fopen(path, "wb");
+    if (f == NULL) {
+        perror("fopen");
         return 1;
     }
-    fwrite(&bmp->header.bitmap_size, sizeof(unsigned int), 1, f);
-    fwrite(&bmp->header.reserved1, sizeof(unsigned short int), 1, f);
-    fwrite(&bmp->header.reserved2, sizeof(unsigned short int), 1, f);
-    fwrite(&bmp->header.bitmap_offset, sizeof(unsigned int), 1, f);
-
-    // info dump
-    if (0 > (int)fwrite(&bmp->info.header_size, sizeof(unsigned int), 1, f)) {
-        perror("fwrite");
+    if (bmp_write_header(&image, f)) {
+        fclose(f);
         return 1;
     }
-    fwrite(&bmp->info.width, sizeof(unsigned int), 1, f);
-    fwrite(&bmp->info.height, sizeof(unsigned int), 1, f);
-    fwrite(&bmp->info.planes, sizeof(unsigned short int), 1, f);
-    fwrite(&bmp->info.bits_per_pixel, sizeof(unsigned short int), 1, f);
-    fwrite(&bmp->info.compression, sizeof(unsigned int), 1, f);
-    fwrite(&bmp->info.image_size, sizeof(unsigned int), 1, f);
-    fwrite(&bmp->info.x_resolution, sizeof(unsigned int), 1, f);
-    fwrite(&bmp->info.y_resolution, sizeof(unsigned int), 1, f);
-    fwrite(&bmp->info.colors, sizeof(unsigned int), 1, f);
-    fwrite(&bmp->info.important_colors, sizeof(unsigned int), 1, f);
 
-    // pixels dump
-    if (0 > (int)fwrite(bmp->data[0], sizeof(char), get_pixel_array_size(bmp), f)) {
-        perror("fwrite");
+    // interleave one row at a time into a reused buffer; calloc keeps the padding zero
+    row = calloc(row_size ? row_size : 1, 1);
+    if (row == NULL) {
+        perror("calloc");
+        fclose(f);
         return 1;
     }
+    for (y = 0; y < planar->height; y++) {
+        bmp_planar_merge_row(planar, y, row);
+        if (fwrite(row, 1, row_size, f) != row_size) {
+            perror("fwrite");
+            free(row);
+            fclose(f);
+            return 1;
+        }
+        BMP_METRIC_WRITTEN(row_size);
+    }
+    free(row);
 
     if (fclose(f) == EOF) {
         perror("fclose");
         return 1;
     }
-
     return 0;
 }
 
-void bmp_destroy(bmp_t *bmp)
+void bmp_planar_destroy(bmp_planar_t *planar)
 {
-    free(bmp->data[0]);
-    free(bmp->data);
-    free(bmp);
+    free(planar->planes[0]);
+    free(planar->spare);
+    free(planar);
 }
 
-bmp_t *bmp_brightness(bmp_t *bmp, int step)
+#ifdef __SSSE3__
+#ifdef __AVX2__
+#define BMP_PLANAR_SPAN 32
+#else
+#define BMP_PLANAR_SPAN 16
+#endif
+
+// pixels 1 .. width - 2 of a plane row, width >= BMP_PLANAR_SPAN + 2; neighbours are adjacent bytes, so
+// one maddubs takes two taps: their pixels interleaved, against the pair of weights. The last vector
+// overlaps the one before it instead of leaving a scalar tail
+static void bmp_planar_span(unsigned char *out, unsigned char *rows[3], const unsigned int width, const bmp_conv_t *conv)
 {
-    unsigned int row_size = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
+    const unsigned char *src[10];
+    unsigned int last = width - 1 - BMP_PLANAR_SPAN;
     unsigned int x;
-    unsigned int y;
-    int d;
+    int t;
+#ifdef __AVX2__
+    __m256i half = _mm256_set1_epi16((short)(conv->divisor / 2));
+    __m256i magic = _mm256_set1_epi16((short)conv->magic);
+    __m128i shift = _mm_cvtsi32_si128(conv->shift);
+    __m256i bias = _mm256_set1_epi16((short)conv->bias);
+    __m256i weight[5];
+    __m256i lo;
+    __m256i hi;
+    __m256i a;
+    __m256i b;
+#else
+    __m128i half = _mm_set1_epi16((short)(conv->divisor / 2));
+    __m128i magic = _mm_set1_epi16((short)conv->magic);
+    __m128i shift = _mm_cvtsi32_si128(conv->shift);
+    __m128i bias = _mm_set1_epi16((short)conv->bias);
+    __m128i weight[5];
+    __m128i lo;
+    __m128i hi;
+    __m128i a;
+    __m128i b;
+#endif
 
-    for (y = 0; y < bmp->info.height; y++) {
-        for (x = 0; x < row_size; x++) {
-            d = (int)bmp->data[y][x] + step;
-            if (d > 255) {
-                d = 255;
-            } else if (d < 0) {
-                d = 0;
-            }
-            bmp->data[y][x] = d;
+    BMP_METRIC_SIMD();
+    for (t = 0; t < 2 * conv->pairs; t++) {
+        src[t] = rows[conv->row[t < conv->count ? t : t - 1]] + conv->dx[t < conv->count ? t : t - 1];
+    }
+    for (t = 0; t < conv->pairs; t++) {
+#ifdef __AVX2__
+        weight[t] = _mm256_set1_epi16(conv->pair[t]);
+#else
+        weight[t] = _mm_set1_epi16(conv->pair[t]);
+#endif
+    }
+    for (x = 1; ; x = (x + BMP_PLANAR_SPAN < last) ? x + BMP_PLANAR_SPAN : last) {
+#ifdef __AVX2__
+        // unpack works within 128 bit halves, pack puts the halves back in order
+        lo = hi = _mm256_setzero_si256();
+        for (t = 0; t < conv->pairs; t++) {
+            a = _mm256_loadu_si256((const __m256i *)(src[2 * t] + x));
+            b = _mm256_loadu_si256((const __m256i *)(src[2 * t + 1] + x));
+            lo = _mm256_add_epi16(lo, _mm256_maddubs_epi16(_mm256_unpacklo_epi8(a, b), weight[t]));
+            hi = _mm256_add_epi16(hi, _mm256_maddubs_epi16(_mm256_unpackhi_epi8(a, b), weight[t]));
+        }
+        if (conv->magic) {
+            lo = _mm256_srl_epi16(_mm256_mulhi_epu16(_mm256_add_epi16(lo, half), magic), shift);
+            hi = _mm256_srl_epi16(_mm256_mulhi_epu16(_mm256_add_epi16(hi, half), magic), shift);
+        }
+        lo = _mm256_adds_epi16(lo, bias);
+        hi = _mm256_adds_epi16(hi, bias);
+        _mm256_storeu_si256((__m256i *)(out + x), _mm256_packus_epi16(lo, hi));
+#else
+        lo = hi = _mm_setzero_si128();
+        for (t = 0; t < conv->pairs; t++) {
+            a = _mm_loadu_si128((const __m128i *)(src[2 * t] + x));
+            b = _mm_loadu_si128((const __m128i *)(src[2 * t + 1] + x));
+            lo = _mm_add_epi16(lo, _mm_maddubs_epi16(_mm_unpacklo_epi8(a, b), weight[t]));
+            hi = _mm_add_epi16(hi, _mm_maddubs_epi16(_mm_unpackhi_epi8(a, b), weight[t]));
+        }
+        if (conv->magic) {
+            lo = _mm_srl_epi16(_mm_mulhi_epu16(_mm_add_epi16(lo, half), magic), shift);
+            hi = _mm_srl_epi16(_mm_mulhi_epu16(_mm_add_epi16(hi, half), magic), shift);
+        }
+        lo = _mm_adds_epi16(lo, bias);
+        hi = _mm_adds_epi16(hi, bias);
+        _mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16(lo, hi));
+#endif
+        if (x == last) {
+            break;
         }
     }
-    return bmp;
 }
+#endif
 
-bmp_t *bmp_invert(bmp_t *bmp)
+static void bmp_planar_convolve_rows(void *ctx, unsigned int r0, unsigned int r1)
 {
-    unsigned int row_size = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
-    unsigned int x;
+    bmp_planar_job_t *job = ctx;
+    bmp_planar_t *planar = job->planar;
+    const bmp_conv_t *conv = job->params;
+    unsigned int height = planar->height;
+    unsigned char *plane;
+    unsigned char *out;
+    unsigned char *rows[3];
+    unsigned int r;
     unsigned int y;
 
-    for (y = 0; y < bmp->info.height; y++) {
-        for (x = 0; x < row_size; x++) {
-            bmp->data[y][x] = (unsigned char)(255 - bmp->data[y][x]);
+    for (r = r0; r < r1; r++) {
+        plane = planar->planes[r / height];
+        y = r % height;
+        rows[0] = plane + (size_t)bmp_border_index((int)y - 1, height, job->arg) * planar->stride;
+        rows[1] = plane + (size_t)y * planar->stride;
+        rows[2] = plane + (size_t)bmp_border_index((int)y + 1, height, job->arg) * planar->stride;
+        out = bmp_planar_row(planar, job->out, r);
+#ifdef __SSSE3__
+        if (conv->pairs && planar->width >= BMP_PLANAR_SPAN + 2) {
+            out[0] = bmp_conv_edge(rows, 0, planar->width, 1, conv, job->arg);
+            out[planar->width - 1] = bmp_conv_edge(rows, planar->width - 1, planar->width, 1, conv, job->arg);
+            bmp_planar_span(out, rows, planar->width, conv);
+            continue;
         }
+#endif
+        // neighbours are one byte apart, so the whole row is one run of lanes
+        bmp_convolve_row(out, rows, planar->width, 1, conv, job->arg);
     }
-    return bmp;
 }
 
-bmp_t *bmp_grayscale(bmp_t *bmp)
+bmp_planar_t *bmp_planar_convolve(bmp_planar_t *planar, const bmp_kernel_t *kernel, const int border)
 {
-    unsigned int row_size = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
-    unsigned int x;
-    unsigned int y;
-    float r;
-    float g;
-    float b;
-    float gray;
+    bmp_conv_t conv;
+    bmp_planar_job_t job;
+    unsigned char *block;
+    BMP_METRIC(planar->width, planar->height);
 
-    for (y = 0; y < bmp->info.height; y++) {
-        for (x = 0; x < row_size; x+=3) {
-            b = 0.07 * (float)bmp->data[y][x];
-            g = 0.72 * (float)bmp->data[y][x+1];
-            r = 0.21 * (float)bmp->data[y][x+2];
-            gray = (r + g + b) / 3.0;
-            bmp->data[y][x] = bmp->data[y][x+1] = bmp->data[y][x+2] = (unsigned char)gray;
+    bmp_conv_prepare(&conv, kernel);
+    if (planar->spare == NULL) {
+        planar->spare = bmp_planar_alloc(planar);
+        if (planar->spare == NULL) {
+            return NULL;
         }
     }
-    return bmp;
+
+    job.planar = planar;
+    job.out = planar->spare;
+    job.params = &conv;
+    job.arg = border;
+    bmp_parallel_rows(3 * planar->height, bmp_planar_convolve_rows, &job);
+
+    // ping-pong between the two blocks
+    block = planar->spare;
+    planar->spare = planar->planes[0];
+    bmp_planar_set_block(planar, block);
+    return planar;
 }
 
-bmp_t *bmp_remove_channel(bmp_t *bmp, const char channel)
+static void bmp_planar_blend_rows(void *ctx, unsigned int r0, unsigned int r1)
 {
-    unsigned int row_size = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
+    bmp_planar_job_t *job = ctx;
+    unsigned int r;
+
+    for (r = r0; r < r1; r++) {
+        bmp_blend_row(
+            bmp_planar_row(job->planar, job->planar->planes[0], r),
+            bmp_planar_row(job->other, job->other->planes[0], r),
+            job->planar->width, job->arg);
+    }
+}
+
+bmp_planar_t *bmp_planar_blend(bmp_planar_t *planar, const bmp_planar_t *other, const int mode)
+{
+    bmp_planar_job_t job;
+    BMP_METRIC(planar->width, planar->height);
+
+    assert(planar->height == other->height);
+    assert(planar->width == other->width);
+
+    job.planar = planar;
+    job.other = other;
+    job.arg = mode;
+    bmp_parallel_rows(3 * planar->height, bmp_planar_blend_rows, &job);
+    return planar;
+}
+
+static void bmp_planar_lut_rows(void *ctx, unsigned int r0, unsigned int r1)
+{
+    bmp_planar_job_t *job = ctx;
+    const bmp_lut_t *lut = job->params;
+    const unsigned char *table;
+    unsigned char *p;
+    unsigned int r;
     unsigned int x;
-    unsigned int y;
 
-    for (y = 0; y < bmp->info.height; y++) {
-        for (x = 0; x < row_size; x+=3) {
-            switch (channel) {
-                case 'b':
-                    bmp->data[y][x] = 0;
-                    break;
-                case 'g':
-                    bmp->data[y][x+1] = 0;
-                    break;
-                case 'r':
-                    bmp->data[y][x+2] = 0;
-                    break;
-            }
+    for (r = r0; r < r1; r++) {
+        table = lut->table[r / job->planar->height];
+        p = bmp_planar_row(job->planar, job->planar->planes[0], r);
+        for (x = 0; x < job->planar->width; x++) {
+            p[x] = table[p[x]];
         }
     }
-    return bmp;
 }
 
-bmp_t *bmp_swap_channel(bmp_t *bmp, const char channel, const char other)
+bmp_planar_t *bmp_planar_apply_lut(bmp_planar_t *planar, const bmp_lut_t *lut)
 {
-    unsigned int row_size = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
-    unsigned int x;
-    unsigned int y;
+    bmp_planar_job_t job;
+    BMP_METRIC(planar->width, planar->height);
 
-    for (y = 0; y < bmp->info.height; y++) {
-        for (x = 0; x < row_size; x+=3) {
-            switch (channel) {
-                case 'b':
-                    switch (other) {
-                        case 'g':
-                            bmp->data[y][x] = bmp->data[y][x+1];
-                            break;
-                        case 'r':
-                            bmp->data[y][x] = bmp->data[y][x+2];
-                            break;
-                    }
-                    break;
-                case 'g':
-                    switch (other) {
-                        case 'b':
-                            bmp->data[y][x+1] = bmp->data[y][x];
-                            break;
-                        case 'r':
-                            bmp->data[y][x+1] = bmp->data[y][x+2];
-                            break;
-                    }
-                    break;
-                case 'r':
-                    switch (other) {
-                        case 'b':
-                            bmp->data[y][x+2] = bmp->data[y][x];
-                            break;
-                        case 'g':
-                            bmp->data[y][x+2] = bmp->data[y][x+1];
-                            break;
-                    }
-                    break;
+    job.planar = planar;
+    job.params = lut;
+    bmp_parallel_rows(3 * planar->height, bmp_planar_lut_rows, &job);
+    return planar;
+}
+
+// a loaded or processed image on its way through bmp_batch()
+typedef struct {
+    bmp_t *bmp;
+    unsigned int index;                    // position in the file list
+} bmp_batch_item_t;
+
+// bounded queue between two stages of bmp_batch()
+typedef struct {
+    bmp_batch_item_t *items;
+    unsigned int capacity;
+    unsigned int head;
+    unsigned int count;
+    int closed;                            // set when the producing stage has finished
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} bmp_batch_queue_t;
+
+typedef struct {
+    const char **inputs;
+    const char **outputs;
+    unsigned int count;
+    const bmp_batch_op_t *ops;
+    unsigned int op_count;
+    bmp_batch_queue_t loaded;
+    bmp_batch_queue_t processed;
+    pthread_mutex_t lock;                  // guards the fields below
+    pthread_cond_t room;
+    unsigned int in_flight;                // images loaded and not yet written or dropped
+    unsigned int max_in_flight;
+    unsigned int workers;                  // workers still running
+    bmp_batch_stats_t *stats;
+} bmp_batch_t;
+
+static int bmp_batch_queue_init(bmp_batch_queue_t *queue, const unsigned int capacity)
+{
+    queue->items = malloc(capacity * sizeof(bmp_batch_item_t));
+    if (queue->items == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    queue->closed = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return 0;
+}
+
+static void bmp_batch_queue_destroy(bmp_batch_queue_t *queue)
+{
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+    free(queue->items);
+}
+
+static void bmp_batch_push(bmp_batch_queue_t *queue, bmp_t *bmp, const unsigned int index)
+{
+    bmp_batch_item_t *item;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    item = &queue->items[(queue->head + queue->count) % queue->capacity];
+    item->bmp = bmp;
+    item->index = index;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// takes the next item; returns 0 once the queue is closed and drained
+static int bmp_batch_pop(bmp_batch_queue_t *queue, bmp_batch_item_t *item)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    if (queue->count == 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return 0;
+    }
+    *item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    return 1;
+}
+
+static void bmp_batch_close(bmp_batch_queue_t *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// an image has left the batch, written or not
+static void bmp_batch_done(bmp_batch_t *batch, const int failed, const unsigned long long written)
+{
+    pthread_mutex_lock(&batch->lock);
+    batch->in_flight--;
+    if (failed) {
+        batch->stats->failed++;
+    } else {
+        batch->stats->files++;
+        batch->stats->bytes_written += written;
+    }
+    pthread_cond_signal(&batch->room);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+// read-ahead: loads files in order for as long as the in-flight limit allows
+static void *bmp_batch_reader(void *arg)
+{
+    bmp_batch_t *batch = arg;
+    struct stat st;
+    bmp_t *bmp;
+    unsigned int i;
+
+    for (i = 0; i < batch->count; i++) {
+        pthread_mutex_lock(&batch->lock);
+        while (batch->in_flight >= batch->max_in_flight) {
+            pthread_cond_wait(&batch->room, &batch->lock);
+        }
+        batch->in_flight++;
+        pthread_mutex_unlock(&batch->lock);
+
+        bmp = bmp_load(batch->inputs[i]);
+        if (bmp == NULL) {
+            bmp_batch_done(batch, 1, 0);
+            continue;
+        }
+        if (stat(batch->inputs[i], &st) == 0) {
+            pthread_mutex_lock(&batch->lock);
+            batch->stats->bytes_read += st.st_size;
+            pthread_mutex_unlock(&batch->lock);
+        }
+        bmp_batch_push(&batch->loaded, bmp, i);
+    }
+    bmp_batch_close(&batch->loaded);
+    return NULL;
+}
+
+// runs the op chain; point operations are deferred so consecutive ones fuse into one pass
+static bmp_t *bmp_batch_run(const bmp_batch_t *batch, bmp_t *bmp)
+{
+    const bmp_batch_op_t *op;
+    unsigned int i;
+
+    for (i = 0; i < batch->op_count; i++) {
+        op = &batch->ops[i];
+        if (op->filter != NULL) {
+            if (op->filter(bmp) == NULL) {
+                return NULL;
             }
+        } else if (bmp_defer(bmp) == NULL
+                || bmp_pipeline_push(bmp->pipeline, op->op.type, op->op.arg, op->op.arg2) == NULL) {
+            return NULL;
         }
     }
-    return bmp;
+    return bmp_flush(bmp);
 }
 
-bmp_t *bmp_add(bmp_t *bmp, const bmp_t *other)
+static void *bmp_batch_worker(void *arg)
 {
-    unsigned int row_size = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
-    unsigned int x;
-    unsigned int y;
-    int d;
+    bmp_batch_t *batch = arg;
+    bmp_batch_item_t item;
 
-    assert(bmp->info.height == other->info.height);
-    assert(bmp->info.width == other->info.width);
+    while (bmp_batch_pop(&batch->loaded, &item)) {
+        if (bmp_batch_run(batch, item.bmp) == NULL) {
+            bmp_destroy(item.bmp);
+            bmp_batch_done(batch, 1, 0);
+            continue;
+        }
+        bmp_batch_push(&batch->processed, item.bmp, item.index);
+    }
 
-    for (y = 0; y < bmp->info.height; y++) {
-        for (x = 0; x < row_size; x++) {
-            d = (int)bmp->data[y][x] + (int)other->data[y][x];
-            if (d > 255) {
-                d = 255;
+    // the last worker out tells the writer no more images are coming
+    pthread_mutex_lock(&batch->lock);
+    if (--batch->workers == 0) {
+        bmp_batch_close(&batch->processed);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+}
+
+// write-behind: writes images in the order they finish
+static void *bmp_batch_writer(void *arg)
+{
+    bmp_batch_t *batch = arg;
+    bmp_batch_item_t item;
+    unsigned long long size;
+    struct stat st;
+    int failed;
+
+    while (bmp_batch_pop(&batch->processed, &item)) {
+        failed = bmp_write(item.bmp, batch->outputs[item.index]);
+        // the header of the input says nothing about what was written: RLE is re-encoded, extended
+        // headers are dropped and many writers leave the file size 0
+        size = (!failed && stat(batch->outputs[item.index], &st) == 0) ? (unsigned long long)st.st_size : 0;
+        bmp_destroy(item.bmp);
+        bmp_batch_done(batch, failed, size);
+    }
+    return NULL;
+}
+
+int bmp_batch(
+    const char **inputs,
+    const char **outputs,
+    const unsigned int count,
+    const bmp_batch_op_t *ops,
+    const unsigned int op_count,
+    unsigned int workers,
+    unsigned int in_flight,
+    bmp_batch_stats_t *stats)
+{
+    bmp_batch_t batch;
+    pthread_t reader;
+    pthread_t writer;
+    pthread_t *threads;
+    struct timespec t0;
+    struct timespec t1;
+    unsigned int started = 0;
+    int reading;
+    long cores;
+    BMP_METRIC(0, 0);
+
+    if (workers == 0) {
+        cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = (cores > 0) ? (unsigned int)cores : 1;
+    }
+    if (in_flight == 0) {
+        in_flight = 2 * workers + 2;
+    }
+
+    memset(stats, 0, sizeof(bmp_batch_stats_t));
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    batch.inputs = inputs;
+    batch.outputs = outputs;
+    batch.count = count;
+    batch.ops = ops;
+    batch.op_count = op_count;
+    batch.in_flight = 0;
+    batch.max_in_flight = in_flight;
+    batch.workers = workers;
+    batch.stats = stats;
+
+    threads = malloc(workers * sizeof(pthread_t));
+    if (threads == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    if (bmp_batch_queue_init(&batch.loaded, in_flight)) {
+        free(threads);
+        return 1;
+    }
+    if (bmp_batch_queue_init(&batch.processed, in_flight)) {
+        bmp_batch_queue_destroy(&batch.loaded);
+        free(threads);
+        return 1;
+    }
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.room, NULL);
+
+    // every queue holds max_in_flight images, so a push never waits on a later stage
+    if (pthread_create(&writer, NULL, bmp_batch_writer, &batch) != 0) {
+        perror("pthread_create");
+        stats->failed = count;
+    } else {
+        reading = (pthread_create(&reader, NULL, bmp_batch_reader, &batch) == 0);
+        if (!reading) {
+            perror("pthread_create");
+            stats->failed = count;
+            bmp_batch_close(&batch.loaded);
+        }
+        for (started = 0; started < workers; started++) {
+            if (pthread_create(&threads[started], NULL, bmp_batch_worker, &batch) != 0) {
+                perror("pthread_create");
+                break;
+            }
+        }
+        // workers that did not start will never count themselves out
+        pthread_mutex_lock(&batch.lock);
+        batch.workers -= workers - started;
+        if (started > 0 && batch.workers == 0) {
+            bmp_batch_close(&batch.processed);
+        }
+        pthread_mutex_unlock(&batch.lock);
+        if (started == 0) {
+            // process on this thread instead
+            batch.workers = 1;
+            bmp_batch_worker(&batch);
+        }
+        if (reading) {
+            pthread_join(reader, NULL);
+        }
+        while (started > 0) {
+            pthread_join(threads[--started], NULL);
+        }
+        pthread_join(writer, NULL);
+    }
+
+    pthread_cond_destroy(&batch.room);
+    pthread_mutex_destroy(&batch.lock);
+    bmp_batch_queue_destroy(&batch.processed);
+    bmp_batch_queue_destroy(&batch.loaded);
+    free(threads);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    stats->seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+    return stats->failed != 0;
+}
+
+// 0xrrggbb colour of pixel x of a row, in any supported format
+static unsigned int bmp_unpack_pixel(const bmp_t *bmp, const unsigned char *row, const unsigned int x)
+{
+    const unsigned char *p;
+    unsigned int v;
+    unsigned int r;
+    unsigned int g;
+    unsigned int b;
+
+    switch (bmp->info.bits_per_pixel) {
+        case 8:
+            p = bmp->palette + 4 * row[x];
+            return p[0] | p[1] << 8 | p[2] << 16;
+        case 16:
+            v = row[2 * x] | row[2 * x + 1] << 8;
+            b = v & 0x1f;
+            if (bmp->info.compression == BMP_BI_BITFIELDS) {
+                g = (v >> 5) & 0x3f;
+                r = v >> 11;
+                g = (g << 2) | (g >> 4);
+            } else {
+                g = (v >> 5) & 0x1f;
+                r = (v >> 10) & 0x1f;
+                g = (g << 3) | (g >> 2);
             }
-            bmp->data[y][x] = (unsigned char)d;
+            // widen to 8 bits so that full intensity stays 255
+            return ((b << 3) | (b >> 2)) | g << 8 | ((r << 3) | (r >> 2)) << 16;
+        default:
+            p = row + x * (bmp->info.bits_per_pixel / 8);
+            return p[0] | p[1] << 8 | p[2] << 16;
+    }
+}
+
+// closest palette entry to a colour, by squared distance
+static unsigned char bmp_palette_index(const bmp_t *bmp, const unsigned int hex)
+{
+    const unsigned char *p;
+    unsigned int best = 0;
+    unsigned int best_d = ~0u;
+    unsigned int d;
+    int db;
+    int dg;
+    int dr;
+    unsigned int i;
+
+    for (i = 0; i < bmp_palette_colors(bmp); i++) {
+        p = bmp->palette + 4 * i;
+        db = (int)p[0] - (int)(hex & 0xff);
+        dg = (int)p[1] - (int)((hex >> 8) & 0xff);
+        dr = (int)p[2] - (int)((hex >> 16) & 0xff);
+        d = db * db + dg * dg + dr * dr;
+        if (d < best_d) {
+            best_d = d;
+            best = i;
         }
     }
-    return bmp;
+    return (unsigned char)best;
 }
 
-bmp_t *bmp_subtract(bmp_t *bmp, const bmp_t *other)
+// stores a 0xrrggbb colour into pixel x of a row; 32 bit alpha is left as it is
+static void bmp_pack_pixel(const bmp_t *bmp, unsigned char *row, const unsigned int x, const unsigned int hex)
 {
-    unsigned int row_size = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
+    unsigned char *p;
+    unsigned int v;
+
+    switch (bmp->info.bits_per_pixel) {
+        case 8:
+            row[x] = bmp_palette_index(bmp, hex);
+            break;
+        case 16:
+            if (bmp->info.compression == BMP_BI_BITFIELDS) {
+                v = (hex >> 3 & 0x1f) | (hex >> 10 & 0x3f) << 5 | (hex >> 19 & 0x1f) << 11;
+            } else {
+                v = (hex >> 3 & 0x1f) | (hex >> 11 & 0x1f) << 5 | (hex >> 19 & 0x1f) << 10;
+            }
+            row[2 * x] = (unsigned char)v;
+            row[2 * x + 1] = (unsigned char)(v >> 8);
+            break;
+        default:
+            p = row + x * (bmp->info.bits_per_pixel / 8);
+            p[0] = (unsigned char)hex;
+            p[1] = (unsigned char)(hex >> 8);
+            p[2] = (unsigned char)(hex >> 16);
+            break;
+    }
+}
+
+static void bmp_convert_rows(void *ctx, unsigned int y0, unsigned int y1)
+{
+    bmp_job_t *job = ctx;
+    const bmp_t *src = job->other;
+    bmp_t *dst = job->bmp;
+    unsigned int width = dst->info.width;
+    unsigned int row_size = get_row_size(dst);
+    const unsigned char *in;
+    unsigned char *out;
     unsigned int x;
     unsigned int y;
-    int d;
-
-    assert(bmp->info.height == other->info.height);
-    assert(bmp->info.width == other->info.width);
 
-    for (y = 0; y < bmp->info.height; y++) {
-        for (x = 0; x < row_size; x++) {
-            d = (int)bmp->data[y][x] - (int)other->data[y][x];
-            if (d < 0) {
-                d = 0;
+    for (y = y0; y < y1; y++) {
+        in = src->data[y];
+        out = dst->data[y];
+        if (src->info.bits_per_pixel == 32 && dst->info.bits_per_pixel == 24) {
+            for (x = 0; x < width; x++) {
+                out[3 * x] = in[4 * x];
+                out[3 * x + 1] = in[4 * x + 1];
+                out[3 * x + 2] = in[4 * x + 2];
+            }
+        } else if (src->info.bits_per_pixel == 24 && dst->info.bits_per_pixel == 32) {
+            for (x = 0; x < width; x++) {
+                out[4 * x] = in[3 * x];
+                out[4 * x + 1] = in[3 * x + 1];
+                out[4 * x + 2] = in[3 * x + 2];
+                out[4 * x + 3] = 255;
+            }
+        } else {
+            for (x = 0; x < width; x++) {
+                bmp_pack_pixel(dst, out, x, bmp_unpack_pixel(src, in, x));
+                if (dst->info.bits_per_pixel == 32) {
+                    out[4 * x + 3] = 255;
+                }
             }
-            bmp->data[y][x] = (unsigned char)d;
         }
+        memset(out + (width * dst->info.bits_per_pixel) / 8, 0, row_size - (width * dst->info.bits_per_pixel) / 8);
+    }
+}
+
+bmp_t *bmp_convert(bmp_t *bmp, const unsigned int bits)
+{
+    bmp_t src;
+    bmp_job_t job = { bmp, NULL, 0, 0, NULL, NULL };
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    if (bits != 16 && bits != 24 && bits != 32) {
+        printf("Unsupported pixel format: %u bits per pixel\n", bits);
+        return NULL;
     }
+    if (bmp_flush(bmp) == NULL) {
+        return NULL;
+    }
+    if (bits == bmp->info.bits_per_pixel && (bits == 32 || bmp->info.compression == BMP_BI_RGB)) {
+        // 32 bit bitfields are laid out exactly like BI_RGB
+        bmp->info.compression = BMP_BI_RGB;
+        return bmp;
+    }
+
+    src = *bmp;
+    bmp->info.bits_per_pixel = (unsigned short int)bits;
+    bmp->info.compression = BMP_BI_RGB;
+    bmp->info.colors = 0;
+    bmp->info.image_size = get_pixel_array_size(bmp);
+    bmp->data = bmp_alloc_rows(bmp, bmp->info.height);
+    if (bmp->data == NULL) {
+        *bmp = src;
+        return NULL;
+    }
+    bmp->map = NULL;
+    bmp->map_size = 0;
+    bmp->palette = NULL;
+
+    job.other = &src;
+    bmp_parallel_rows(bmp->info.height, bmp_convert_rows, &job);
+
+    bmp_free_pixels(&src);
+    free(src.palette);
+    bmp_changed(bmp);
     return bmp;
 }
 
-bmp_t *bmp_difference(bmp_t *bmp, const bmp_t *other)
+// side of the square tiles transposes copy at a time, in pixels; a tile of the source and one of the destination stay in L1
+#ifndef BMP_TRANSPOSE_TILE
+#define BMP_TRANSPOSE_TILE 64
+#endif
+
+// bytes mirrored through the stack at a time
+#define BMP_MIRROR_CHUNK 4096
+
+// dst[i] = src[width - 1 - i] for pixels of `step` bytes; the spans must not overlap
+static void bmp_reverse_pixels(unsigned char *dst, const unsigned char *src, const unsigned int width,
+        const unsigned int step)
 {
-    unsigned int row_size = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
-    unsigned int x;
-    unsigned int y;
-    int d;
+    unsigned int i = 0;
+    unsigned int c;
+#ifdef __SSE2__
+    unsigned int n = (step == 3) ? 0 : 16 / step;
+    __m128i v;
+
+    if (n > 0 && width >= n) {
+        BMP_METRIC_SIMD();
+    }
+    for (; n > 0 && i + n <= width; i += n) {
+        v = _mm_loadu_si128((const __m128i *)(src + (size_t)step * (width - i - n)));
+        if (step == 4) {
+            v = _mm_shuffle_epi32(v, 0x1b);
+        } else {
+            v = _mm_shufflelo_epi16(v, 0x1b);
+            v = _mm_shufflehi_epi16(v, 0x1b);
+            v = _mm_shuffle_epi32(v, 0x4e);
+            if (step == 1) {
+                v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            }
+        }
+        _mm_storeu_si128((__m128i *)(dst + (size_t)step * i), v);
+    }
+#endif
+    if (step == 3) {
+        for (; i < width; i++) {
+            dst[3 * i] = src[3 * (width - 1 - i)];
+            dst[3 * i + 1] = src[3 * (width - 1 - i) + 1];
+            dst[3 * i + 2] = src[3 * (width - 1 - i) + 2];
+        }
+    }
+    for (; i < width; i++) {
+        for (c = 0; c < step; c++) {
+            dst[step * i + c] = src[step * (width - 1 - i) + c];
+        }
+    }
+}
 
-    assert(bmp->info.height == other->info.height);
-    assert(bmp->info.width == other->info.width);
+// replaces row a with row b mirrored and row b with row a mirrored, or mirrors a in place when b is a
+static void bmp_mirror_pair(unsigned char *a, unsigned char *b, const unsigned int width, const unsigned int step)
+{
+    unsigned char tmp[BMP_MIRROR_CHUNK];
+    unsigned int limit = (a == b) ? width / 2 : width;
+    unsigned int chunk = BMP_MIRROR_CHUNK / step;
+    unsigned int n;
+    unsigned int i;
 
-    for (y = 0; y < bmp->info.height; y++) {
-        for (x = 0; x < row_size; x++) {
-            d = (int)bmp->data[y][x] - (int)other->data[y][x];
-            d = (d < 0) ? -1 * d : d;
-            bmp->data[y][x] = (unsigned char)d;
-        }
+    // pixels [i, i + n) of a trade places with [width - i - n, width - i) of b
+    for (i = 0; i < limit; i += n) {
+        n = (limit - i < chunk) ? limit - i : chunk;
+        memcpy(tmp, a + (size_t)step * i, (size_t)step * n);
+        bmp_reverse_pixels(a + (size_t)step * i, b + (size_t)step * (width - i - n), n, step);
+        bmp_reverse_pixels(b + (size_t)step * (width - i - n), tmp, n, step);
     }
-    return bmp;
 }
 
-bmp_t *bmp_multiply(bmp_t *bmp, const bmp_t *other)
+// job->arg mirrors rows left to right, job->arg2 swaps row y with row height - 1 - y for y in [y0, y1)
+static void bmp_mirror_rows(void *ctx, unsigned int y0, unsigned int y1)
 {
-    unsigned int row_size = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
-    unsigned int x;
+    bmp_job_t *job = ctx;
+    bmp_t *bmp = job->bmp;
+    unsigned char tmp[BMP_MIRROR_CHUNK];
+    unsigned int step = bmp->info.bits_per_pixel / 8;
+    unsigned int bytes = step * bmp->info.width;
+    unsigned char *a;
+    unsigned char *b;
+    unsigned int at;
+    unsigned int n;
     unsigned int y;
 
-    assert(bmp->info.height == other->info.height);
-    assert(bmp->info.width == other->info.width);
-
-    for (y = 0; y < bmp->info.height; y++) {
-        for (x = 0; x < row_size; x++) {
-            bmp->data[y][x] = (unsigned char)(255 * ((float)bmp->data[y][x] / 255.0 * (float)other->data[y][x] / 255.0));
+    for (y = y0; y < y1; y++) {
+        a = bmp->data[y];
+        b = job->arg2 ? bmp->data[bmp->info.height - 1 - y] : a;
+        if (job->arg) {
+            bmp_mirror_pair(a, b, bmp->info.width, step);
+            continue;
+        }
+        for (at = 0; a != b && at < bytes; at += n) {
+            n = (bytes - at < BMP_MIRROR_CHUNK) ? bytes - at : BMP_MIRROR_CHUNK;
+            memcpy(tmp, a + at, n);
+            memcpy(a + at, b + at, n);
+            memcpy(b + at, tmp, n);
         }
     }
-    return bmp;
 }
 
-bmp_t *bmp_average(bmp_t *bmp, const bmp_t *other)
+static bmp_t *bmp_mirror(bmp_t *bmp, const int horizontal, const int vertical)
 {
-    unsigned int row_size = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
-    unsigned int x;
-    unsigned int y;
-
-    assert(bmp->info.height == other->info.height);
-    assert(bmp->info.width == other->info.width);
+    bmp_job_t job = { bmp, NULL, horizontal, vertical, NULL, NULL };
 
-    for (y = 0; y < bmp->info.height; y++) {
-        for (x = 0; x < row_size; x++) {
-            bmp->data[y][x] = (unsigned char)(((int)bmp->data[y][x] + (int)other->data[y][x]) / 2);
-        }
+    if (bmp_flush(bmp) == NULL) {
+        return NULL;
     }
+    bmp_parallel_rows(vertical ? (bmp->info.height + 1) / 2 : bmp->info.height, bmp_mirror_rows, &job);
+    bmp_changed(bmp);
     return bmp;
 }
 
-bmp_t *bmp_min(bmp_t *bmp, const bmp_t *other)
+// copies dst rows [y0, y1) and columns [x0, x1) of a transpose one pixel at a time; inlined with a constant step
+static inline void bmp_transpose_span(bmp_job_t *job, const unsigned int y0, const unsigned int y1,
+        const unsigned int x0, const unsigned int x1, const unsigned int step)
 {
-    unsigned int row_size = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
+    // source rows x0, x0 + 1, ... are walked through their pointers, downwards when counted from the top
+    unsigned char **first = job->other->data + (job->arg ? job->other->info.height - 1 - x0 : x0);
+    long dir = job->arg ? -1 : 1;
+    unsigned char **out = job->bmp->data;
+    unsigned char **rows;
+    const unsigned char *s;
+    unsigned char *d;
+    unsigned int sx;
     unsigned int x;
     unsigned int y;
+    unsigned int c;
 
-    assert(bmp->info.height == other->info.height);
-    assert(bmp->info.width == other->info.width);
-
-    for (y = 0; y < bmp->info.height; y++) {
-        for (x = 0; x < row_size; x++) {
-            if (bmp->data[y][x] > other->data[y][x]) {
-                bmp->data[y][x] = other->data[y][x];
+    for (y = y0; y < y1; y++) {
+        sx = step * (job->arg2 ? job->other->info.width - 1 - y : y);
+        d = out[y] + step * x0;
+        rows = first;
+        for (x = x0; x < x1; x++, d += step, rows += dir) {
+            s = *rows + sx;
+            for (c = 0; c < step; c++) {
+                d[c] = s[c];
             }
         }
     }
-    return bmp;
 }
 
-bmp_t *bmp_max(bmp_t *bmp, const bmp_t *other)
+static void bmp_transpose_block(bmp_job_t *job, const unsigned int y0, const unsigned int y1, const unsigned int x0,
+        const unsigned int x1)
 {
-    unsigned int row_size = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
+    switch (job->other->info.bits_per_pixel) {
+        case 8:
+            bmp_transpose_span(job, y0, y1, x0, x1, 1);
+            break;
+        case 16:
+            bmp_transpose_span(job, y0, y1, x0, x1, 2);
+            break;
+        case 24:
+            bmp_transpose_span(job, y0, y1, x0, x1, 3);
+            break;
+        default:
+            bmp_transpose_span(job, y0, y1, x0, x1, 4);
+            break;
+    }
+}
+
+// fills tile rows [t0, t1) of job->bmp with pixel (x, y) = job->other's (y, x), where job->arg counts source rows
+// from the top and job->arg2 source columns from the right
+static void bmp_transpose_rows(void *ctx, unsigned int t0, unsigned int t1)
+{
+    bmp_job_t *job = ctx;
+    bmp_t *dst = job->bmp;
+    unsigned int width = dst->info.width;
+    unsigned int height = dst->info.height;
+    unsigned int tx;
+    unsigned int ty;
+    unsigned int x1;
+    unsigned int y1;
+    unsigned int xe;
+    unsigned int ye;
+#ifdef __SSE2__
+    const bmp_t *src = job->other;
+    __m128i r[4];
+    __m128i t[4];
+    unsigned int sx;
     unsigned int x;
     unsigned int y;
+    unsigned int i;
+#endif
 
-    assert(bmp->info.height == other->info.height);
-    assert(bmp->info.width == other->info.width);
-
-    for (y = 0; y < bmp->info.height; y++) {
-        for (x = 0; x < row_size; x++) {
-            if (bmp->data[y][x] < other->data[y][x]) {
-                bmp->data[y][x] = other->data[y][x];
+    for (ty = t0 * BMP_TRANSPOSE_TILE; ty < t1 * BMP_TRANSPOSE_TILE && ty < height; ty += BMP_TRANSPOSE_TILE) {
+        y1 = (ty + BMP_TRANSPOSE_TILE < height) ? ty + BMP_TRANSPOSE_TILE : height;
+        for (tx = 0; tx < width; tx += BMP_TRANSPOSE_TILE) {
+            x1 = (tx + BMP_TRANSPOSE_TILE < width) ? tx + BMP_TRANSPOSE_TILE : width;
+            ye = ty;
+            xe = tx;
+#ifdef __SSE2__
+            // 4x4 blocks of 32 bit pixels are transposed in registers
+            if (dst->info.bits_per_pixel == 32) {
+                ye = ty + (y1 - ty) / 4 * 4;
+                xe = tx + (x1 - tx) / 4 * 4;
+                if (ye > ty && xe > tx) {
+                    BMP_METRIC_SIMD();
+                }
+                for (y = ty; y < ye; y += 4) {
+                    sx = 4 * (job->arg2 ? src->info.width - 4 - y : y);
+                    for (x = tx; x < xe; x += 4) {
+                        for (i = 0; i < 4; i++) {
+                            r[i] = _mm_loadu_si128((const __m128i *)(src->data[job->arg ? src->info.height - 1 - x - i
+                                    : x + i] + sx));
+                            if (job->arg2) {
+                                r[i] = _mm_shuffle_epi32(r[i], 0x1b);
+                            }
+                        }
+                        t[0] = _mm_unpacklo_epi32(r[0], r[1]);
+                        t[1] = _mm_unpacklo_epi32(r[2], r[3]);
+                        t[2] = _mm_unpackhi_epi32(r[0], r[1]);
+                        t[3] = _mm_unpackhi_epi32(r[2], r[3]);
+                        _mm_storeu_si128((__m128i *)(dst->data[y] + 4 * x), _mm_unpacklo_epi64(t[0], t[1]));
+                        _mm_storeu_si128((__m128i *)(dst->data[y + 1] + 4 * x), _mm_unpackhi_epi64(t[0], t[1]));
+                        _mm_storeu_si128((__m128i *)(dst->data[y + 2] + 4 * x), _mm_unpacklo_epi64(t[2], t[3]));
+                        _mm_storeu_si128((__m128i *)(dst->data[y + 3] + 4 * x), _mm_unpackhi_epi64(t[2], t[3]));
+                    }
+                }
             }
+#endif
+            // whatever the blocks left over on the right and at the bottom of the tile
+            bmp_transpose_block(job, ty, ye, xe, x1);
+            bmp_transpose_block(job, ye, y1, tx, x1);
         }
     }
-    return bmp;
 }
 
-bmp_t *bmp_blur(bmp_t *bmp)
+// swaps width and height; pixel (x, y) comes from source row `x` (or height - 1 - x with from_top) and
+// column `y` (or width - 1 - y with from_right)
+static bmp_t *bmp_transposed(bmp_t *bmp, const int from_top, const int from_right)
 {
-    unsigned int width = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
-    unsigned int x;
-    unsigned int y;
-    float filter[3][3] = {
-        {0.0, 0.2, 0.0},
-        {0.2, 0.2, 0.2},
-        {0.0, 0.2, 0.0},
-    };
-    unsigned int fx;
-    unsigned int fy;
-    float r;
-    float g;
-    float b;
-    int iy;
-    int ix;
-    unsigned int pixel_array_size;
-    unsigned int row_size;
-    unsigned char **temp;
-    unsigned int i;
+    bmp_t src;
+    bmp_job_t job = { bmp, NULL, from_top, from_right, NULL, NULL };
 
-    // allocate pixel data array
-    row_size = get_row_size(bmp);
-    pixel_array_size = get_pixel_array_size(bmp);
-    temp = malloc(bmp->info.height * sizeof(unsigned char *));
-    if (temp == NULL) {
-        perror("malloc");
+    if (bmp_flush(bmp) == NULL) {
         return NULL;
     }
-    temp[0] = malloc(pixel_array_size * sizeof(unsigned char));
-    if (temp[0] == NULL) {
-        perror("malloc");
+    src = *bmp;
+    bmp->info.width = src.info.height;
+    bmp->info.height = src.info.width;
+    bmp->info.x_resolution = src.info.y_resolution;
+    bmp->info.y_resolution = src.info.x_resolution;
+    bmp->info.image_size = get_pixel_array_size(bmp);
+    // turning back and forth trades the same two arrays through the scratch pool
+    bmp->data = bmp_acquire_rows(bmp);
+    if (bmp->data == NULL) {
+        *bmp = src;
         return NULL;
     }
-    // write addresses of row_sized chunks
-    for (i = 0; i < bmp->info.height; i++) {
-        temp[i] = (temp[0] + row_size * i);
-    }
+    bmp->map = NULL;
+    bmp->map_size = 0;
 
-    // blurring the image
-    for (y = 0; y < bmp->info.height; y++) {
-        for (x = 0; x < width; x+=3) {
-            b = g = r = 0.0;
-            for (fy = 0; fy < 3; fy++) {
-                iy = (y - 3 / 2 + fy + bmp->info.height) % bmp->info.height;
-                for (fx = 0; fx < 3; fx++) {
-                    ix = (width + x - 3 + 3 * fx) % width;
-                    b += bmp->data[iy][ix] * filter[fy][fx];
-                    g += bmp->data[iy][ix+1] * filter[fy][fx];
-                    r += bmp->data[iy][ix+2] * filter[fy][fx];
-                }
-            }
-            if (b < 0.0) b = 0.0; else if (b > 255.0) b = 255.0;
-            if (g < 0.0) g = 0.0; else if (g > 255.0) g = 255.0;
-            if (r < 0.0) r = 0.0; else if (r > 255.0) r = 255.0;
-            temp[y][x] = (unsigned char)b;
-            temp[y][x+1] = (unsigned char)g;
-            temp[y][x+2] = (unsigned char)r;
-        }
-    }
+    job.other = &src;
+    bmp_parallel_rows((bmp->info.height + BMP_TRANSPOSE_TILE - 1) / BMP_TRANSPOSE_TILE, bmp_transpose_rows, &job);
 
-    free(bmp->data[0]);
-    free(bmp->data);
-    bmp->data = temp;
+    bmp_recycle_pixels(&src);
+    bmp_changed(bmp);
     return bmp;
 }
 
-bmp_t *bmp_edges(bmp_t *bmp)
+bmp_t *bmp_flip_horizontal(bmp_t *bmp)
 {
-    unsigned int width = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
-    unsigned int x;
-    unsigned int y;
-    float filter[3][3] = {
-        {-1.0, -1.0, -1.0},
-        {-1.0,  8.0, -1.0},
-        {-1.0, -1.0, -1.0},
-    };
-    unsigned int fx;
-    unsigned int fy;
-    float r;
-    float g;
-    float b;
-    int iy;
-    int ix;
-    unsigned int pixel_array_size;
-    unsigned int row_size;
-    unsigned char **temp;
-    unsigned int i;
+    BMP_METRIC(bmp->info.width, bmp->info.height);
 
-    // allocate pixel data array
-    row_size = get_row_size(bmp);
-    pixel_array_size = get_pixel_array_size(bmp);
-    temp = malloc(bmp->info.height * sizeof(unsigned char *));
-    if (temp == NULL) {
-        perror("malloc");
-        return NULL;
-    }
-    temp[0] = malloc(pixel_array_size * sizeof(unsigned char));
-    if (temp[0] == NULL) {
-        perror("malloc");
-        return NULL;
+    return bmp_mirror(bmp, 1, 0);
+}
+
+bmp_t *bmp_flip_vertical(bmp_t *bmp)
+{
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    return bmp_mirror(bmp, 0, 1);
+}
+
+bmp_t *bmp_transpose(bmp_t *bmp)
+{
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    // the top-left to bottom-right diagonal of the picture, with data[0] being its bottom row
+    return bmp_transposed(bmp, 1, 1);
+}
+
+bmp_t *bmp_rotate(bmp_t *bmp, const int degrees)
+{
+    BMP_METRIC(bmp->info.width, bmp->info.height);
+
+    switch (((degrees % 360) + 360) % 360) {
+        case 0:
+            return bmp;
+        case 90:
+            return bmp_transposed(bmp, 0, 1);
+        case 180:
+            return bmp_mirror(bmp, 1, 1);
+        case 270:
+            return bmp_transposed(bmp, 1, 0);
     }
-    // write addresses of row_sized chunks
-    for (i = 0; i < bmp->info.height; i++) {
-        temp[i] = (temp[0] + row_size * i);
+    printf("Unsupported rotation: %d degrees\n", degrees);
+    return NULL;
+}
+
+void bmp_set_pixel(bmp_t *bmp, const unsigned int x, const unsigned int y, const unsigned int hex)
+{
+    assert(x < bmp->info.width);
+    assert(y < bmp->info.height);
+
+    if (bmp_flush(bmp) == NULL) {
+        return;
     }
+    bmp_pack_pixel(bmp, bmp->data[y], x, hex);
+    bmp_pyramid_invalidate(bmp, x, y, 1, 1);
+}
 
-    // blurring the image
-    for (y = 0; y < bmp->info.height; y++) {
-        for (x = 0; x < width; x+=3) {
-            b = g = r = 0.0;
-            for (fy = 0; fy < 3; fy++) {
-                iy = (y - 3 / 2 + fy + bmp->info.height) % bmp->info.height;
-                for (fx = 0; fx < 3; fx++) {
-                    ix = (width + x - 3 + 3 * fx) % width;
-                    b += bmp->data[iy][ix] * filter[fy][fx];
-                    g += bmp->data[iy][ix+1] * filter[fy][fx];
-                    r += bmp->data[iy][ix+2] * filter[fy][fx];
-                }
-            }
-            if (b < 0.0) b = 0.0; else if (b > 255.0) b = 255.0;
-            if (g < 0.0) g = 0.0; else if (g > 255.0) g = 255.0;
-            if (r < 0.0) r = 0.0; else if (r > 255.0) r = 255.0;
-            temp[y][x] = (unsigned char)b;
-            temp[y][x+1] = (unsigned char)g;
-            temp[y][x+2] = (unsigned char)r;
-        }
+unsigned char *bmp_get_pixel(bmp_t *bmp, const unsigned int x, const unsigned int y)
+{
+    static unsigned char bgr[3];
+    unsigned int hex;
+
+    assert(x < bmp->info.width);
+    assert(y < bmp->info.height);
+
+    if (bmp_flush(bmp) == NULL) {
+        return NULL;
     }
+    hex = bmp_unpack_pixel(bmp, bmp->data[y], x);
+    bgr[0] = (unsigned char)hex;
+    bgr[1] = (unsigned char)(hex >> 8);
+    bgr[2] = (unsigned char)(hex >> 16);
 
-    free(bmp->data[0]);
-    free(bmp->data);
-    bmp->data = temp;
-    return bmp;
+    return bgr;
 }
 
-bmp_t *bmp_sharpen(bmp_t *bmp)
+// rows per band that bmp_draw() bins shapes into; each band is rasterized by one task
+#ifndef BMP_DRAW_BAND
+#define BMP_DRAW_BAND 32
+#endif
+
+// bytes of the fill pattern, a whole number of pixels of every size
+#define BMP_DRAW_PATTERN 48
+
+// largest coordinate magnitude bmp_draw() takes, so that line arithmetic stays within 64 bits
+#define BMP_DRAW_LIMIT (1 << 28)
+
+// the shapes of a bmp_draw() call, binned by band
+typedef struct {
+    const bmp_shape_t *shapes;
+    unsigned char *patterns;               // BMP_DRAW_PATTERN bytes of every shape's colour
+    unsigned int *bins;                    // indices of the shapes that reach each band, in the order given
+    unsigned int *first;                   // start of each band in bins, one entry more than there are bands
+    unsigned int points;                   // most points of any polygon
+    pthread_mutex_t lock;
+    int failed;
+} bmp_draw_t;
+
+static long long bmp_ceil_div(const long long a, const long long b)
 {
-    unsigned int width = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
-    unsigned int x;
-    unsigned int y;
-    float filter[3][3] = {
-        {-1.0, -1.0, -1.0},
-        {-1.0,  9.0, -1.0},
-        {-1.0, -1.0, -1.0},
-    };
-    unsigned int fx;
-    unsigned int fy;
-    float r;
-    float g;
-    float b;
-    int iy;
-    int ix;
-    unsigned int pixel_array_size;
-    unsigned int row_size;
-    unsigned char **temp;
-    unsigned int i;
+    return (a >= 0) ? (a + b - 1) / b : -(-a / b);
+}
 
-    // allocate pixel data array
-    row_size = get_row_size(bmp);
-    pixel_array_size = get_pixel_array_size(bmp);
-    temp = malloc(bmp->info.height * sizeof(unsigned char *));
-    if (temp == NULL) {
-        perror("malloc");
-        return NULL;
+// pixels [x0, x1] of row, clipped to the image, from the repeating pattern
+static void bmp_fill_span(const bmp_t *bmp, unsigned char *row, long long x0, long long x1,
+        const unsigned char *pattern)
+{
+    unsigned int step = bmp->info.bits_per_pixel / 8;
+    unsigned char *d;
+    size_t n;
+#ifdef __SSE2__
+    __m128i p0 = _mm_loadu_si128((const __m128i *)pattern);
+    __m128i p1 = _mm_loadu_si128((const __m128i *)(pattern + 16));
+    __m128i p2 = _mm_loadu_si128((const __m128i *)(pattern + 32));
+#endif
+
+    x0 = (x0 > 0) ? x0 : 0;
+    x1 = (x1 < (long long)bmp->info.width - 1) ? x1 : (long long)bmp->info.width - 1;
+    if (x0 > x1) {
+        return;
     }
-    temp[0] = malloc(pixel_array_size * sizeof(unsigned char));
-    if (temp[0] == NULL) {
-        perror("malloc");
-        return NULL;
+    d = row + step * x0;
+    n = (size_t)step * (size_t)(x1 - x0 + 1);
+#ifdef __SSE2__
+    if (n >= BMP_DRAW_PATTERN) {
+        BMP_METRIC_SIMD();
     }
-    // write addresses of row_sized chunks
-    for (i = 0; i < bmp->info.height; i++) {
-        temp[i] = (temp[0] + row_size * i);
+#endif
+    for (; n >= BMP_DRAW_PATTERN; n -= BMP_DRAW_PATTERN, d += BMP_DRAW_PATTERN) {
+#ifdef __SSE2__
+        _mm_storeu_si128((__m128i *)d, p0);
+        _mm_storeu_si128((__m128i *)(d + 16), p1);
+        _mm_storeu_si128((__m128i *)(d + 32), p2);
+#else
+        memcpy(d, pattern, BMP_DRAW_PATTERN);
+#endif
     }
+    memcpy(d, pattern, n);
+}
 
-    // blurring the image
-    for (y = 0; y < bmp->info.height; y++) {
-        for (x = 0; x < width; x+=3) {
-            b = g = r = 0.0;
-            for (fy = 0; fy < 3; fy++) {
-                iy = (y - 3 / 2 + fy + bmp->info.height) % bmp->info.height;
-                for (fx = 0; fx < 3; fx++) {
-                    ix = (width + x - 3 + 3 * fx) % width;
-                    b += bmp->data[iy][ix] * filter[fy][fx];
-                    g += bmp->data[iy][ix+1] * filter[fy][fx];
-                    r += bmp->data[iy][ix+2] * filter[fy][fx];
-                }
+// rows [r0, r1] of a line; shallow lines take a span per row, steep ones a pixel
+static void bmp_draw_line(bmp_t *bmp, const bmp_shape_t *shape, const unsigned char *pattern, const long long r0,
+        const long long r1)
+{
+    long long x0 = shape->x0;
+    long long y0 = shape->y0;
+    long long x1 = shape->x1;
+    long long y1 = shape->y1;
+    long long dx = (x1 > x0) ? x1 - x0 : x0 - x1;
+    long long dy = (y1 > y0) ? y1 - y0 : y0 - y1;
+    long long t;
+    long long k;
+    long long y;
+    long long sign;
+
+    // ends are swapped so that the major axis runs forwards; the minor one steps by `sign`
+    if ((dx > dy) ? x0 > x1 : y0 > y1) {
+        t = x0;
+        x0 = x1;
+        x1 = t;
+        t = y0;
+        y0 = y1;
+        y1 = t;
+    }
+    if (dx > dy) {
+        // pixel t along the line sits on row y0 + sign * floor((2 * t * dy + dx) / (2 * dx))
+        sign = (y1 >= y0) ? 1 : -1;
+        for (y = (r0 > (y0 < y1 ? y0 : y1)) ? r0 : (y0 < y1 ? y0 : y1); y <= r1 && y <= (y0 > y1 ? y0 : y1); y++) {
+            k = (y - y0) * sign;
+            if (dy == 0) {
+                bmp_fill_span(bmp, bmp->data[y], x0, x1, pattern);
+                continue;
             }
-            if (b < 0.0) b = 0.0; else if (b > 255.0) b = 255.0;
-            if (g < 0.0) g = 0.0; else if (g > 255.0) g = 255.0;
-            if (r < 0.0) r = 0.0; else if (r > 255.0) r = 255.0;
-            temp[y][x] = (unsigned char)b;
-            temp[y][x+1] = (unsigned char)g;
-            temp[y][x+2] = (unsigned char)r;
+            t = bmp_ceil_div(2 * dx * k - dx, 2 * dy);
+            bmp_fill_span(bmp, bmp->data[y], x0 + (t > 0 ? t : 0),
+                    x0 + (bmp_ceil_div(2 * dx * k + dx, 2 * dy) - 1 < dx ? bmp_ceil_div(2 * dx * k + dx, 2 * dy) - 1 : dx),
+                    pattern);
         }
+        return;
+    }
+    sign = (x1 >= x0) ? 1 : -1;
+    for (y = (r0 > y0) ? r0 : y0; y <= r1 && y <= y1; y++) {
+        t = (dy == 0) ? x0 : x0 + sign * ((2 * (y - y0) * dx + dy) / (2 * dy));
+        bmp_fill_span(bmp, bmp->data[y], t, t, pattern);
     }
-
-    free(bmp->data[0]);
-    free(bmp->data);
-    bmp->data = temp;
-    return bmp;
 }
 
-bmp_t *bmp_emboss(bmp_t *bmp)
+// rows [r0, r1] of a polygon, sampled at pixel centres; xs has room for one crossing per edge
+static void bmp_draw_polygon(bmp_t *bmp, const bmp_shape_t *shape, const unsigned char *pattern, const long long r0,
+        const long long r1, double *xs)
 {
-    unsigned int width = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
-    unsigned int x;
-    unsigned int y;
-    float filter[3][3] = {
-        {-1.0, -1.0,  0.0},
-        {-1.0,  0.0,  1.0},
-        {0.0,   1.0,  1.0},
-    };
-    unsigned int fx;
-    unsigned int fy;
-    float r;
-    float g;
-    float b;
-    int iy;
-    int ix;
-    unsigned int pixel_array_size;
-    unsigned int row_size;
-    unsigned char **temp;
+    const int *p = shape->points;
+    unsigned int n;
     unsigned int i;
-    float bias = 128.0;
-
-    // allocate pixel data array
-    row_size = get_row_size(bmp);
-    pixel_array_size = get_pixel_array_size(bmp);
-    temp = malloc(bmp->info.height * sizeof(unsigned char *));
-    if (temp == NULL) {
-        perror("malloc");
-        return NULL;
-    }
-    temp[0] = malloc(pixel_array_size * sizeof(unsigned char));
-    if (temp[0] == NULL) {
-        perror("malloc");
-        return NULL;
-    }
-    // write addresses of row_sized chunks
-    for (i = 0; i < bmp->info.height; i++) {
-        temp[i] = (temp[0] + row_size * i);
-    }
+    unsigned int j;
+    double c;
+    double x;
+    long long y;
 
-    // blurring the image
-    for (y = 0; y < bmp->info.height; y++) {
-        for (x = 0; x < width; x+=3) {
-            b = g = r = 0.0;
-            for (fy = 0; fy < 3; fy++) {
-                iy = (y - 3 / 2 + fy + bmp->info.height) % bmp->info.height;
-                for (fx = 0; fx < 3; fx++) {
-                    ix = (width + x - 3 + 3 * fx) % width;
-                    b += bmp->data[iy][ix] * filter[fy][fx];
-                    g += bmp->data[iy][ix+1] * filter[fy][fx];
-                    r += bmp->data[iy][ix+2] * filter[fy][fx];
-                }
+    for (y = r0; y <= r1; y++) {
+        c = (double)y + 0.5;
+        n = 0;
+        for (i = 0; i < shape->count; i++) {
+            j = (i + 1 < shape->count) ? i + 1 : 0;
+            if ((p[2 * i + 1] <= c) == (p[2 * j + 1] <= c)) {
+                continue;
+            }
+            x = p[2 * i] + (c - p[2 * i + 1]) * (p[2 * j] - p[2 * i]) / (double)(p[2 * j + 1] - p[2 * i + 1]);
+            // insertion sort, polygons of annotations have few edges
+            for (j = n++; j > 0 && xs[j - 1] > x; j--) {
+                xs[j] = xs[j - 1];
             }
-            if (b + bias < 0.0) b = 0.0; else if (b + bias > 255.0) b = 255.0;
-            if (g + bias < 0.0) g = 0.0; else if (g + bias > 255.0) g = 255.0;
-            if (r + bias < 0.0) r = 0.0; else if (r + bias > 255.0) r = 255.0;
-            temp[y][x] = (unsigned char)b;
-            temp[y][x+1] = (unsigned char)g;
-            temp[y][x+2] = (unsigned char)r;
+            xs[j] = x;
+        }
+        // pixels whose centre lies in [xs[i], xs[i + 1])
+        for (i = 0; i + 1 < n; i += 2) {
+            bmp_fill_span(bmp, bmp->data[y], (long long)ceil(xs[i] - 0.5), (long long)ceil(xs[i + 1] - 0.5) - 1,
+                    pattern);
         }
     }
-
-    free(bmp->data[0]);
-    free(bmp->data);
-    bmp->data = temp;
-    return bmp;
 }
 
-bmp_t *bmp_mean(bmp_t *bmp)
+// rows [y0, y1] and columns [x0, x1] a shape can touch, before clipping
+static void bmp_shape_bounds(const bmp_shape_t *shape, long long *x0, long long *y0, long long *x1, long long *y1)
 {
-    unsigned int width = (bmp->info.width * bmp->info.bits_per_pixel) / 8;
-    unsigned int x;
-    unsigned int y;
-    float filter[3][3] = {
-        {0.1111, 0.1111, 0.1111},
-        {0.1111, 0.1111, 0.1111},
-        {0.1111, 0.1111, 0.1111},
-    };
-    unsigned int fx;
-    unsigned int fy;
-    float r;
-    float g;
-    float b;
-    int iy;
-    int ix;
-    unsigned int pixel_array_size;
-    unsigned int row_size;
-    unsigned char **temp;
     unsigned int i;
 
-    // allocate pixel data array
-    row_size = get_row_size(bmp);
-    pixel_array_size = get_pixel_array_size(bmp);
-    temp = malloc(bmp->info.height * sizeof(unsigned char *));
-    if (temp == NULL) {
-        perror("malloc");
-        return NULL;
+    if (shape->type == BMP_SHAPE_POLYGON) {
+        *x0 = *y0 = LLONG_MAX;
+        *x1 = *y1 = LLONG_MIN;
+        for (i = 0; i < shape->count; i++) {
+            *x0 = (shape->points[2 * i] < *x0) ? shape->points[2 * i] : *x0;
+            *x1 = (shape->points[2 * i] > *x1) ? shape->points[2 * i] : *x1;
+            *y0 = (shape->points[2 * i + 1] < *y0) ? shape->points[2 * i + 1] : *y0;
+            *y1 = (shape->points[2 * i + 1] > *y1) ? shape->points[2 * i + 1] : *y1;
+        }
+        return;
     }
-    temp[0] = malloc(pixel_array_size * sizeof(unsigned char));
-    if (temp[0] == NULL) {
-        perror("malloc");
-        return NULL;
+    *x0 = (shape->x0 < shape->x1) ? shape->x0 : shape->x1;
+    *x1 = (shape->x0 < shape->x1) ? shape->x1 : shape->x0;
+    *y0 = (shape->y0 < shape->y1) ? shape->y0 : shape->y1;
+    *y1 = (shape->y0 < shape->y1) ? shape->y1 : shape->y0;
+}
+
+static int bmp_shape_valid(const bmp_shape_t *shape)
+{
+    long long x0;
+    long long y0;
+    long long x1;
+    long long y1;
+
+    if (shape->type < BMP_SHAPE_LINE || shape->type > BMP_SHAPE_POLYGON) {
+        return 0;
     }
-    // write addresses of row_sized chunks
-    for (i = 0; i < bmp->info.height; i++) {
-        temp[i] = (temp[0] + row_size * i);
+    if (shape->type == BMP_SHAPE_POLYGON && (shape->count == 0 || shape->points == NULL)) {
+        return shape->count == 0;
     }
+    bmp_shape_bounds(shape, &x0, &y0, &x1, &y1);
+    return x0 >= -BMP_DRAW_LIMIT && y0 >= -BMP_DRAW_LIMIT && x1 <= BMP_DRAW_LIMIT && y1 <= BMP_DRAW_LIMIT;
+}
 
-    // blurring the image
-    for (y = 0; y < bmp->info.height; y++) {
-        for (x = 0; x < width; x+=3) {
-            b = g = r = 0.0;
-            for (fy = 0; fy < 3; fy++) {
-                iy = (y - 3 / 2 + fy + bmp->info.height) % bmp->info.height;
-                for (fx = 0; fx < 3; fx++) {
-                    ix = (width + x - 3 + 3 * fx) % width;
-                    b += bmp->data[iy][ix] * filter[fy][fx];
-                    g += bmp->data[iy][ix+1] * filter[fy][fx];
-                    r += bmp->data[iy][ix+2] * filter[fy][fx];
-                }
+static void bmp_draw_bands(void *ctx, unsigned int b0, unsigned int b1)
+{
+    bmp_job_t *job = ctx;
+    bmp_draw_t *draw = (bmp_draw_t *)job->params;
+    bmp_t *bmp = job->bmp;
+    const bmp_shape_t *shape;
+    const unsigned char *pattern;
+    double *xs = NULL;
+    long long x0;
+    long long y0;
+    long long x1;
+    long long y1;
+    long long r0;
+    long long r1;
+    long long y;
+    unsigned int b;
+    unsigned int i;
+
+    for (b = b0; b < b1; b++) {
+        for (i = draw->first[b]; i < draw->first[b + 1]; i++) {
+            shape = &draw->shapes[draw->bins[i]];
+            pattern = draw->patterns + (size_t)BMP_DRAW_PATTERN * draw->bins[i];
+            bmp_shape_bounds(shape, &x0, &y0, &x1, &y1);
+            r0 = ((long long)b * BMP_DRAW_BAND > y0) ? (long long)b * BMP_DRAW_BAND : y0;
+            r1 = ((long long)(b + 1) * BMP_DRAW_BAND - 1 < y1) ? (long long)(b + 1) * BMP_DRAW_BAND - 1 : y1;
+            r1 = (r1 < (long long)bmp->info.height - 1) ? r1 : (long long)bmp->info.height - 1;
+            switch (shape->type) {
+                case BMP_SHAPE_LINE:
+                    bmp_draw_line(bmp, shape, pattern, r0, r1);
+                    break;
+                case BMP_SHAPE_RECT:
+                    for (y = r0; y <= r1; y++) {
+                        if (y == y0 || y == y1) {
+                            bmp_fill_span(bmp, bmp->data[y], x0, x1, pattern);
+                        } else {
+                            bmp_fill_span(bmp, bmp->data[y], x0, x0, pattern);
+                            bmp_fill_span(bmp, bmp->data[y], x1, x1, pattern);
+                        }
+                    }
+                    break;
+                case BMP_SHAPE_FILL:
+                    for (y = r0; y <= r1; y++) {
+                        bmp_fill_span(bmp, bmp->data[y], x0, x1, pattern);
+                    }
+                    break;
+                case BMP_SHAPE_POLYGON:
+                    if (xs == NULL) {
+                        xs = malloc(draw->points * sizeof(double));
+                    }
+                    if (xs == NULL) {
+                        pthread_mutex_lock(&draw->lock);
+                        if (!draw->failed) {
+                            perror("malloc");
+                        }
+                        draw->failed = 1;
+                        pthread_mutex_unlock(&draw->lock);
+                        return;
+                    }
+                    bmp_draw_polygon(bmp, shape, pattern, r0, r1, xs);
+                    break;
             }
-            if (b < 0.0) b = 0.0; else if (b > 255.0) b = 255.0;
-            if (g < 0.0) g = 0.0; else if (g > 255.0) g = 255.0;
-            if (r < 0.0) r = 0.0; else if (r > 255.0) r = 255.0;
-            temp[y][x] = (unsigned char)b;
-            temp[y][x+1] = (unsigned char)g;
-            temp[y][x+2] = (unsigned char)r;
         }
     }
-
-    free(bmp->data[0]);
-    free(bmp->data);
-    bmp->data = temp;
-    return bmp;
+    free(xs);
 }
 
-void bmp_set_pixel(bmp_t *bmp, const unsigned int x, const unsigned int y, const unsigned int hex)
+int bmp_draw(bmp_t *bmp, const bmp_shape_t *shapes, const unsigned int count)
 {
-    unsigned int dx = 3 * x;
-
-    assert(bmp->info.width >= x);
-    assert(bmp->info.height >= y);
+    bmp_draw_t draw;
+    bmp_job_t job = { bmp, NULL, 0, 0, NULL, &draw };
+    unsigned int bands = (bmp->info.height + BMP_DRAW_BAND - 1) / BMP_DRAW_BAND;
+    unsigned int step = bmp->info.bits_per_pixel / 8;
+    unsigned char pixel[4];
+    unsigned char *visible;
+    long long x0;
+    long long y0;
+    long long x1;
+    long long y1;
+    size_t total = 0;
+    unsigned int b;
+    unsigned int i;
+    unsigned int j;
+    BMP_METRIC(bmp->info.width, bmp->info.height);
 
-    bmp->data[y][dx] = (unsigned char)hex;
-    bmp->data[y][dx+1] = (unsigned char)(hex >> 8);
-    bmp->data[y][dx+2] = (unsigned char)(hex >> 16);
-}
+    for (i = 0; i < count; i++) {
+        if (!bmp_shape_valid(&shapes[i])) {
+            printf("Invalid shape: %u\n", i);
+            return 1;
+        }
+    }
+    if (bmp_flush(bmp) == NULL) {
+        return 1;
+    }
+    draw.shapes = shapes;
+    draw.points = 0;
+    draw.failed = 0;
+    draw.patterns = malloc((size_t)BMP_DRAW_PATTERN * count + 1);
+    draw.first = calloc(bands + 2, sizeof(unsigned int));
+    visible = malloc(count + 1);
+    if (draw.patterns == NULL || draw.first == NULL || visible == NULL) {
+        perror("malloc");
+        free(draw.patterns);
+        free(draw.first);
+        free(visible);
+        return 1;
+    }
 
-unsigned char *bmp_get_pixel(bmp_t *bmp, const unsigned int x, const unsigned int y)
-{
-    static unsigned char bgr[3];
-    unsigned int dx = 3 * x;
+    // clipping happens once: shapes off the image are dropped and the others counted into the bands they reach
+    for (i = 0; i < count; i++) {
+        bmp_shape_bounds(&shapes[i], &x0, &y0, &x1, &y1);
+        visible[i] = x1 >= 0 && y1 >= 0 && x0 < (long long)bmp->info.width && y0 < (long long)bmp->info.height
+                && (shapes[i].type != BMP_SHAPE_POLYGON || shapes[i].count >= 3);
+        if (!visible[i]) {
+            continue;
+        }
+        y0 = (y0 > 0) ? y0 : 0;
+        y1 = (y1 < (long long)bmp->info.height - 1) ? y1 : (long long)bmp->info.height - 1;
+        for (b = (unsigned int)(y0 / BMP_DRAW_BAND); b <= (unsigned int)(y1 / BMP_DRAW_BAND); b++) {
+            draw.first[b + 2]++;
+        }
+        total += (size_t)(y1 / BMP_DRAW_BAND - y0 / BMP_DRAW_BAND + 1);
+        draw.points = (shapes[i].type == BMP_SHAPE_POLYGON && shapes[i].count > draw.points) ? shapes[i].count
+                : draw.points;
+        bmp_pyramid_invalidate(bmp, (unsigned int)(x0 > 0 ? x0 : 0), (unsigned int)y0,
+                (unsigned int)((x1 < (long long)bmp->info.width - 1 ? x1 : (long long)bmp->info.width - 1)
+                - (x0 > 0 ? x0 : 0) + 1), (unsigned int)(y1 - y0 + 1));
 
-    assert(bmp->info.width >= x);
-    assert(bmp->info.height >= y);
+        // the colour is packed once per shape and repeated to fill the pattern; 32 bit pixels are drawn opaque
+        pixel[3] = 255;
+        bmp_pack_pixel(bmp, pixel, 0, shapes[i].rgb);
+        for (j = 0; j < BMP_DRAW_PATTERN; j++) {
+            draw.patterns[(size_t)BMP_DRAW_PATTERN * i + j] = pixel[j % step];
+        }
+    }
+    draw.bins = malloc(total * sizeof(unsigned int) + 1);
+    if (draw.bins == NULL) {
+        perror("malloc");
+        free(draw.patterns);
+        free(draw.first);
+        free(visible);
+        return 1;
+    }
+    // first[b + 2] counted band b; after the prefix sum first[b + 1] is where band b is filled in from
+    for (b = 0; b < bands; b++) {
+        draw.first[b + 2] += draw.first[b + 1];
+    }
+    for (i = 0; i < count; i++) {
+        if (!visible[i]) {
+            continue;
+        }
+        bmp_shape_bounds(&shapes[i], &x0, &y0, &x1, &y1);
+        y0 = (y0 > 0) ? y0 : 0;
+        y1 = (y1 < (long long)bmp->info.height - 1) ? y1 : (long long)bmp->info.height - 1;
+        for (b = (unsigned int)(y0 / BMP_DRAW_BAND); b <= (unsigned int)(y1 / BMP_DRAW_BAND); b++) {
+            draw.bins[draw.first[b + 1]++] = i;
+        }
+    }
+    free(visible);
 
-    bgr[0] = bmp->data[y][dx];
-    bgr[1] = bmp->data[y][dx+1];
-    bgr[2] = bmp->data[y][dx+2];
+    pthread_mutex_init(&draw.lock, NULL);
+    bmp_parallel_rows(bands, bmp_draw_bands, &job);
+    pthread_mutex_destroy(&draw.lock);
 
-    return bgr;
+    free(draw.patterns);
+    free(draw.first);
+    free(draw.bins);
+    return draw.failed;
 }
 
 bmp_t *bmp_line(
@@ -809,25 +7188,9 @@ bmp_t *bmp_line(
     const int y1,
     const int rgb)
 {
-    int dx = x1 - x0;
-    int dy = y1 - y0;
-    int x;
-    int y = y0;
-    int e = dx - dy;
+    bmp_shape_t line = { BMP_SHAPE_LINE, (unsigned int)rgb, x0, y0, x1, y1, NULL, 0 };
+    BMP_METRIC(bmp->info.width, bmp->info.height);
 
-    x = x0;
-    while (x < x1) {
-        bmp->data[y][x] = (unsigned char)rgb;
-        bmp->data[y][x+1] = (unsigned char)(rgb >> 8);
-        bmp->data[y][x+2] = (unsigned char)(rgb >> 16);
-
-        if (e >= 0) {
-            y += 1;
-            e -= dx;
-        }
-        x += 1;
-        e += dy;
-    }
-    return bmp;
+    return bmp_draw(bmp, &line, 1) ? NULL : bmp;
 }
 